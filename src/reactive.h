@@ -5,182 +5,5939 @@
 #include <vector>
 #include <memory>
 #include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <ostream>
+#include <functional>
+#include <limits>
+#include <list>
+#include <map>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+#include <type_traits>
+#include <typeindex>
+#include <unordered_map>
+#include <unordered_set>
+#include <fcntl.h>
+#include <unistd.h>
 #include "json.hpp"
 
+// Coroutine support (Task, Deferred, Component::spawn) needs C++20
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#define JGOD_REACTIVE_COROUTINES 1
+#include <coroutine>
+#include <optional>
+#endif
+#endif
+
 namespace jgod { namespace reactive {
+#pragma mark - Object containers
+  /**
+   * Sorted-vector map usable as basic_json's ObjectType. Members of small
+   * objects live in one contiguous allocation and lookups binary-search it,
+   * instead of std::map's allocation and pointer chase per member. Iterates
+   * in key order, like std::map. Inserting or erasing invalidates iterators.
+   */
+  template<class Key,
+           class T,
+           class Compare = std::less<Key>,
+           class Allocator = std::allocator<std::pair<const Key, T>>>
+  class FlatMap {
+  public:
+    typedef Key key_type;
+    typedef T mapped_type;
+    typedef std::pair<Key, T> value_type;
+    typedef Compare key_compare;
+    typedef typename std::allocator_traits<Allocator>::template rebind_alloc<value_type> allocator_type;
+    typedef std::vector<value_type, allocator_type> container_type;
+    typedef typename container_type::size_type size_type;
+    typedef typename container_type::difference_type difference_type;
+    typedef typename container_type::reference reference;
+    typedef typename container_type::const_reference const_reference;
+    typedef typename container_type::iterator iterator;
+    typedef typename container_type::const_iterator const_iterator;
+
+    FlatMap() {}
+
+    /**
+     * Keeps the first of duplicate keys, like std::map.
+     */
+    template<class InputIt>
+    FlatMap(InputIt first, InputIt last) {
+      for (; first != last; ++first) {
+        _items.push_back(value_type(first->first, first->second));
+      }
+      auto less = [this](const value_type &a, const value_type &b) {
+        return _compare(a.first, b.first);
+      };
+      std::stable_sort(std::begin(_items), std::end(_items), less);
+      _items.erase(std::unique(std::begin(_items), std::end(_items),
+                               [&less](const value_type &a, const value_type &b) {
+                                 return !less(a, b) && !less(b, a);
+                               }),
+                   std::end(_items));
+    }
+
+    inline iterator begin() {return _items.begin();}
+    inline iterator end() {return _items.end();}
+    inline const_iterator begin() const {return _items.begin();}
+    inline const_iterator end() const {return _items.end();}
+    inline const_iterator cbegin() const {return _items.cbegin();}
+    inline const_iterator cend() const {return _items.cend();}
+
+    inline bool empty() const {return _items.empty();}
+    inline size_type size() const {return _items.size();}
+    inline size_type max_size() const {return _items.max_size();}
+    inline void clear() {_items.clear();}
+    inline void reserve(size_type count) {_items.reserve(count);}
+
+    inline iterator find(const Key &key) {
+      auto it = lowerBound(key);
+      return it != end() && !_compare(key, it->first) ? it : end();
+    }
+    inline const_iterator find(const Key &key) const {
+      return const_cast<FlatMap*>(this)->find(key);
+    }
+    inline size_type count(const Key &key) const {return find(key) != end() ? 1 : 0;}
+
+    /**
+     * @throws std::out_of_range if key is missing
+     */
+    inline T &at(const Key &key) {
+      auto it = find(key);
+      if (it == end()) throw std::out_of_range("key not found");
+      return it->second;
+    }
+    inline const T &at(const Key &key) const {
+      return const_cast<FlatMap*>(this)->at(key);
+    }
+    inline T &operator[](const Key &key) {
+      auto it = lowerBound(key);
+      if (it == end() || _compare(key, it->first)) {
+        it = _items.insert(it, value_type(key, T()));
+      }
+      return it->second;
+    }
+
+    inline std::pair<iterator, bool> insert(value_type value) {
+      auto it = lowerBound(value.first);
+      if (it != end() && !_compare(value.first, it->first)) return {it, false};
+      return {_items.insert(it, std::move(value)), true};
+    }
+    template<class... Args>
+    inline std::pair<iterator, bool> emplace(Args&&... args) {
+      return insert(value_type(std::forward<Args>(args)...));
+    }
+
+    inline iterator erase(iterator pos) {return _items.erase(pos);}
+    inline iterator erase(iterator first, iterator last) {return _items.erase(first, last);}
+    inline size_type erase(const Key &key) {
+      auto it = find(key);
+      if (it == end()) return 0;
+      _items.erase(it);
+      return 1;
+    }
+
+    friend inline bool operator==(const FlatMap &lhs, const FlatMap &rhs) {
+      return lhs._items == rhs._items;
+    }
+    friend inline bool operator!=(const FlatMap &lhs, const FlatMap &rhs) {
+      return !(lhs == rhs);
+    }
+    friend inline bool operator<(const FlatMap &lhs, const FlatMap &rhs) {
+      return lhs._items < rhs._items;
+    }
+
+  private:
+    inline iterator lowerBound(const Key &key) {
+      return std::lower_bound(std::begin(_items), std::end(_items), key,
+                              [this](const value_type &item, const Key &key) {
+                                return _compare(item.first, key);
+                              });
+    }
+
+    container_type _items;
+    Compare _compare;
+  };
+
+  /**
+   * Open-addressing hash map usable as basic_json's ObjectType, for objects
+   * with many members. Members are stored densely in insertion order and
+   * found through a linear-probing index of slots; erasing moves the last
+   * member into the hole. Compare is accepted for ObjectType compatibility
+   * and only used to order objects for operator<. Inserting or erasing
+   * invalidates iterators.
+   */
+  template<class Key,
+           class T,
+           class Compare = std::less<Key>,
+           class Allocator = std::allocator<std::pair<const Key, T>>>
+  class OpenHashMap {
+  public:
+    typedef Key key_type;
+    typedef T mapped_type;
+    typedef std::pair<Key, T> value_type;
+    typedef Compare key_compare;
+    typedef typename std::allocator_traits<Allocator>::template rebind_alloc<value_type> allocator_type;
+    typedef std::vector<value_type, allocator_type> container_type;
+    typedef typename container_type::size_type size_type;
+    typedef typename container_type::difference_type difference_type;
+    typedef typename container_type::reference reference;
+    typedef typename container_type::const_reference const_reference;
+    typedef typename container_type::iterator iterator;
+    typedef typename container_type::const_iterator const_iterator;
+
+    OpenHashMap() {}
+
+    /**
+     * Keeps the first of duplicate keys, like std::map.
+     */
+    template<class InputIt>
+    OpenHashMap(InputIt first, InputIt last) {
+      for (; first != last; ++first) {
+        insert(value_type(first->first, first->second));
+      }
+    }
+
+    inline iterator begin() {return _items.begin();}
+    inline iterator end() {return _items.end();}
+    inline const_iterator begin() const {return _items.begin();}
+    inline const_iterator end() const {return _items.end();}
+    inline const_iterator cbegin() const {return _items.cbegin();}
+    inline const_iterator cend() const {return _items.cend();}
+
+    inline bool empty() const {return _items.empty();}
+    inline size_type size() const {return _items.size();}
+    inline size_type max_size() const {return std::min<size_type>(_items.max_size(), kEmpty);}
+    inline void clear() {
+      _items.clear();
+      _hashes.clear();
+      std::fill(std::begin(_slots), std::end(_slots), kEmpty);
+    }
+    inline void reserve(size_type count) {
+      _items.reserve(count);
+      _hashes.reserve(count);
+      size_t slots = 8;
+      while (slots * 3 < count * 4) slots *= 2;
+      if (slots > _slots.size()) rehash(slots);
+    }
+
+    inline iterator find(const Key &key) {
+      if (_items.empty()) return end();
+      auto slot = findSlot(key, _hasher(key));
+      return _slots[slot] == kEmpty ? end() : begin() + _slots[slot];
+    }
+    inline const_iterator find(const Key &key) const {
+      return const_cast<OpenHashMap*>(this)->find(key);
+    }
+    inline size_type count(const Key &key) const {return find(key) != end() ? 1 : 0;}
+
+    /**
+     * @throws std::out_of_range if key is missing
+     */
+    inline T &at(const Key &key) {
+      auto it = find(key);
+      if (it == end()) throw std::out_of_range("key not found");
+      return it->second;
+    }
+    inline const T &at(const Key &key) const {
+      return const_cast<OpenHashMap*>(this)->at(key);
+    }
+    inline T &operator[](const Key &key) {
+      auto it = find(key);
+      if (it == end()) it = insert(value_type(key, T())).first;
+      return it->second;
+    }
+
+    inline std::pair<iterator, bool> insert(value_type value) {
+      auto hash = _hasher(value.first);
+      if ((_items.size() + 1) * 4 > _slots.size() * 3) {
+        rehash(std::max<size_t>(8, _slots.size() * 2));
+      }
+      auto slot = findSlot(value.first, hash);
+      if (_slots[slot] != kEmpty) return {begin() + _slots[slot], false};
+      _slots[slot] = static_cast<uint32_t>(_items.size());
+      _items.push_back(std::move(value));
+      _hashes.push_back(hash);
+      return {end() - 1, true};
+    }
+    template<class... Args>
+    inline std::pair<iterator, bool> emplace(Args&&... args) {
+      return insert(value_type(std::forward<Args>(args)...));
+    }
+
+    /**
+     * @returns an iterator to the member moved into pos, or end()
+     */
+    inline iterator erase(iterator pos) {
+      auto index = static_cast<size_t>(pos - begin());
+      clearSlot(findSlot(pos->first, _hashes[index]));
+      auto last = _items.size() - 1;
+      if (index != last) {
+        _slots[findSlot(_items[last].first, _hashes[last])] = static_cast<uint32_t>(index);
+        _items[index] = std::move(_items[last]);
+        _hashes[index] = _hashes[last];
+      }
+      _items.pop_back();
+      _hashes.pop_back();
+      return begin() + index;
+    }
+    inline iterator erase(iterator first, iterator last) {
+      auto index = first - begin();
+      _hashes.erase(std::begin(_hashes) + index, std::begin(_hashes) + (last - begin()));
+      _items.erase(first, last);
+      rehash(_slots.size());
+      return begin() + index;
+    }
+    inline size_type erase(const Key &key) {
+      auto it = find(key);
+      if (it == end()) return 0;
+      erase(it);
+      return 1;
+    }
+
+    friend inline bool operator==(const OpenHashMap &lhs, const OpenHashMap &rhs) {
+      if (lhs.size() != rhs.size()) return false;
+      for (const auto &item : lhs._items) {
+        auto it = rhs.find(item.first);
+        if (it == rhs.end() || !(it->second == item.second)) return false;
+      }
+      return true;
+    }
+    friend inline bool operator!=(const OpenHashMap &lhs, const OpenHashMap &rhs) {
+      return !(lhs == rhs);
+    }
+    /**
+     * Orders by sorted members, like std::map.
+     */
+    friend inline bool operator<(const OpenHashMap &lhs, const OpenHashMap &rhs) {
+      auto l = lhs.sorted(), r = rhs.sorted();
+      return std::lexicographical_compare(std::begin(l), std::end(l), std::begin(r), std::end(r),
+                                          [](const value_type *a, const value_type *b) {
+                                            return *a < *b;
+                                          });
+    }
+
+  private:
+    enum : uint32_t {kEmpty = 0xffffffff};
+
+    inline size_t bucket(size_t hash) const {
+      // Fibonacci hashing spreads identity hashes over the high bits
+      return static_cast<size_t>((static_cast<uint64_t>(hash) * 0x9e3779b97f4a7c15ull) >> _shift);
+    }
+
+    /**
+     * @returns the slot holding key, or the empty slot it would go in
+     */
+    inline size_t findSlot(const Key &key, size_t hash) const {
+      auto mask = _slots.size() - 1;
+      for (auto i = bucket(hash);; i = (i + 1) & mask) {
+        auto index = _slots[i];
+        if (index == kEmpty || (_hashes[index] == hash && _items[index].first == key)) {
+          return i;
+        }
+      }
+    }
+
+    /**
+     * Backward-shift deletion: pulls later members of the probe run into the
+     * hole so lookups never need tombstones.
+     */
+    inline void clearSlot(size_t hole) {
+      auto mask = _slots.size() - 1;
+      for (auto i = (hole + 1) & mask; _slots[i] != kEmpty; i = (i + 1) & mask) {
+        auto home = bucket(_hashes[_slots[i]]);
+        auto stays = hole <= i ? (hole < home && home <= i) : (hole < home || home <= i);
+        if (!stays) {
+          _slots[hole] = _slots[i];
+          hole = i;
+        }
+      }
+      _slots[hole] = kEmpty;
+    }
+
+    inline void rehash(size_t slots) {
+      _slots.assign(slots, kEmpty);
+      _shift = 64;
+      for (auto n = slots; n > 1; n >>= 1) --_shift;
+      for (size_t index = 0; index < _items.size(); ++index) {
+        _slots[findSlot(_items[index].first, _hashes[index])] = static_cast<uint32_t>(index);
+      }
+    }
+
+    inline std::vector<const value_type*> sorted() const {
+      std::vector<const value_type*> items;
+      items.reserve(_items.size());
+      for (const auto &item : _items) items.push_back(&item);
+      Compare compare;
+      std::sort(std::begin(items), std::end(items),
+                [&compare](const value_type *a, const value_type *b) {
+                  return compare(a->first, b->first);
+                });
+      return items;
+    }
+
+    container_type _items;
+    std::vector<size_t> _hashes;
+    std::vector<uint32_t> _slots;
+    unsigned _shift = 64;
+    std::hash<Key> _hasher;
+  };
+
+#pragma mark - SlabAllocator
+  /**
+   * Size-class free lists carved out of 64KB chunks, backing SlabAllocator.
+   * Each thread allocates from its own arena without locking. A block freed
+   * on another thread is pushed onto its owning arena's lock-free remote
+   * list, which the owner takes back once its local list runs dry, so memory
+   * handed between threads (e.g. by a background DisposalQueue) is reused
+   * rather than stranded. An exiting thread's arena is adopted by the next
+   * new thread; chunks are kept for the life of the process.
+   */
+  class Slab {
+  public:
+    enum : size_t {kGranularity = 16, kMaxSize = 256, kChunkSize = 64 * 1024};
+
+    static inline void *allocate(size_t bytes, size_t alignment) {
+      if (bytes == 0 || bytes > kMaxSize || alignment > kGranularity) {
+        return ::operator new(bytes);
+      }
+      auto &arena = local();
+      auto sizeClass = classOf(bytes);
+      auto &head = arena.free[sizeClass];
+      if (!head) head = arena.remote[sizeClass].exchange(nullptr, std::memory_order_acquire);
+      if (head) {
+        auto block = head;
+        head = block->next;
+        return block;
+      }
+      auto size = (sizeClass + 1) * kGranularity;
+      if (arena.cursor + size > arena.end) {
+        auto chunk = newChunk();
+        chunk->owner = &arena;
+        arena.cursor = reinterpret_cast<char*>(chunk) + kGranularity;
+        arena.end = reinterpret_cast<char*>(chunk) + kChunkSize;
+      }
+      auto block = arena.cursor;
+      arena.cursor += size;
+      return block;
+    }
+
+    static inline void deallocate(void *pointer, size_t bytes, size_t alignment) {
+      if (bytes == 0 || bytes > kMaxSize || alignment > kGranularity) {
+        ::operator delete(pointer);
+        return;
+      }
+      auto block = static_cast<Block*>(pointer);
+      auto owner = chunkOf(pointer)->owner;
+      auto sizeClass = classOf(bytes);
+      if (owner == current()) {
+        block->next = owner->free[sizeClass];
+        owner->free[sizeClass] = block;
+        return;
+      }
+      auto &remote = owner->remote[sizeClass];
+      auto head = remote.load(std::memory_order_relaxed);
+      do {
+        block->next = head;
+      } while (!remote.compare_exchange_weak(head, block, std::memory_order_release,
+                                             std::memory_order_relaxed));
+    }
+
+    /**
+     * @returns how many chunks have been carved so far, for diagnostics
+     */
+    static inline size_t chunks() {return chunkCount().load(std::memory_order_relaxed);}
+
+  private:
+    enum : size_t {kClasses = kMaxSize / kGranularity, kChunksPerRegion = 16};
+
+    struct Block {
+      Block *next;
+    };
+    struct Arena {
+      Arena() {for (auto &list : remote) list.store(nullptr, std::memory_order_relaxed);}
+      Block *free[kClasses] = {};
+      std::atomic<Block*> remote[kClasses]; // freed by other threads
+      char *cursor = nullptr;
+      char *end = nullptr;
+    };
+    // Header in the first kGranularity bytes of every kChunkSize-aligned chunk
+    struct Chunk {
+      Arena *owner;
+    };
+    // Hands this thread's arena back for adoption when the thread exits
+    struct Owner {
+      ~Owner() {
+        detached() = true;
+        orphan(current());
+        current() = nullptr;
+      }
+    };
+
+    static inline size_t classOf(size_t bytes) {return (bytes - 1) / kGranularity;}
+    static inline Chunk *chunkOf(void *pointer) {
+      return reinterpret_cast<Chunk*>(reinterpret_cast<uintptr_t>(pointer) &
+                                      ~static_cast<uintptr_t>(kChunkSize - 1));
+    }
+
+    static inline Arena *&current() {
+      static thread_local Arena *arena = nullptr;
+      return arena;
+    }
+    static inline bool &detached() {
+      static thread_local bool detached = false;
+      return detached;
+    }
+    static inline Arena &local() {
+      auto &arena = current();
+      if (!arena) {
+        arena = adopt();
+        // Allocating while thread-locals are torn down keeps the arena
+        if (!detached()) {static thread_local Owner owner; (void)owner;}
+      }
+      return *arena;
+    }
+
+    static inline std::mutex &mutex() {
+      static auto mutex = new std::mutex();
+      return *mutex;
+    }
+    static inline std::vector<Arena*> &orphans() {
+      static auto orphans = new std::vector<Arena*>();
+      return *orphans;
+    }
+    static inline Arena *adopt() {
+      std::lock_guard<std::mutex> lock(mutex());
+      auto &pool = orphans();
+      if (pool.empty()) return new Arena();
+      auto arena = pool.back();
+      pool.pop_back();
+      return arena;
+    }
+    static inline void orphan(Arena *arena) {
+      if (!arena) return;
+      std::lock_guard<std::mutex> lock(mutex());
+      orphans().push_back(arena);
+    }
+
+    static inline std::atomic<size_t> &chunkCount() {
+      static std::atomic<size_t> count(0);
+      return count;
+    }
+    static inline Chunk *newChunk() {
+      // Regions stay reachable from here so they outlive every thread's arena
+      static auto regions = new std::vector<std::unique_ptr<char[]>>();
+      static auto fresh = new std::vector<char*>();
+      std::lock_guard<std::mutex> lock(mutex());
+      if (fresh->empty()) {
+        std::unique_ptr<char[]> region(new char[(kChunksPerRegion + 1) * kChunkSize]);
+        auto base = (reinterpret_cast<uintptr_t>(region.get()) + kChunkSize - 1) &
+                    ~static_cast<uintptr_t>(kChunkSize - 1);
+        for (size_t i = kChunksPerRegion; i-- > 0;) {
+          fresh->push_back(reinterpret_cast<char*>(base + i * kChunkSize));
+        }
+        regions->push_back(std::move(region));
+      }
+      auto chunk = fresh->back();
+      fresh->pop_back();
+      chunkCount().fetch_add(1, std::memory_order_relaxed);
+      return reinterpret_cast<Chunk*>(chunk);
+    }
+  };
+
+  /**
+   * Allocator usable as basic_json's AllocatorType. Every string, array and
+   * object of a JSON value is a separate node allocation; this serves them,
+   * and the small element buffers and map nodes behind them, from Slab's
+   * per-thread arenas instead of the global heap.
+   */
+  template<class T>
+  class SlabAllocator {
+  public:
+    typedef T value_type;
+    typedef T *pointer;
+    typedef const T *const_pointer;
+    typedef T &reference;
+    typedef const T &const_reference;
+    typedef size_t size_type;
+    typedef ptrdiff_t difference_type;
+    template<class U> struct rebind {typedef SlabAllocator<U> other;};
+
+    SlabAllocator() noexcept {}
+    template<class U> SlabAllocator(const SlabAllocator<U>&) noexcept {}
+
+    /**
+     * @throws std::bad_alloc
+     */
+    inline T *allocate(size_t count) {
+      if (count > max_size()) throw std::bad_alloc();
+      return static_cast<T*>(Slab::allocate(count * sizeof(T), alignof(T)));
+    }
+    inline void deallocate(T *pointer, size_t count) {
+      Slab::deallocate(pointer, count * sizeof(T), alignof(T));
+    }
+    inline size_t max_size() const {return static_cast<size_t>(-1) / sizeof(T);}
+
+    template<class U, class... Args>
+    inline void construct(U *pointer, Args&&... args) {
+      ::new(static_cast<void*>(pointer)) U(std::forward<Args>(args)...);
+    }
+    template<class U>
+    inline void destroy(U *pointer) {pointer->~U();}
+  };
+  template<class T, class U>
+  inline bool operator==(const SlabAllocator<T>&, const SlabAllocator<U>&) {return true;}
+  template<class T, class U>
+  inline bool operator!=(const SlabAllocator<T>&, const SlabAllocator<U>&) {return false;}
+
 #pragma mark - Types
   class Component;
+  class Snapshot;
+  class DisposalQueue;
   typedef std::shared_ptr<Component> SharedComponent;
   typedef std::vector<SharedComponent> NodeList; // ReactNode | ReactEmpty
 
-  typedef nlohmann::json JSON;
-  typedef JSON State;
-  typedef JSON Props;
-  typedef std::function<void(const State &prevState,
-                             const Props &currentProps)> UpdateCb;
-  typedef std::function<const State(const State &prevState,
-                                    const Props &currentProps)> ReturnedUpdateCb;
+  /**
+   * Container for JSON objects in state and props. Define as
+   * jgod::reactive::FlatMap or jgod::reactive::OpenHashMap before including
+   * this header to trade std::map for fewer allocations.
+   */
+#ifndef JGOD_REACTIVE_OBJECT_TYPE
+#define JGOD_REACTIVE_OBJECT_TYPE std::map
+#endif
+  /**
+   * Allocator for the strings, arrays and objects of JSON values. Define as
+   * jgod::reactive::SlabAllocator to take them off the global heap.
+   */
+#ifndef JGOD_REACTIVE_ALLOCATOR_TYPE
+#define JGOD_REACTIVE_ALLOCATOR_TYPE std::allocator
+#endif
+  typedef nlohmann::basic_json<JGOD_REACTIVE_OBJECT_TYPE,
+                               std::vector,
+                               std::string,
+                               bool,
+                               int64_t,
+                               double,
+                               JGOD_REACTIVE_ALLOCATOR_TYPE> JSON;
+  typedef JSON State;
+  typedef std::shared_ptr<const State> SharedState;
+  typedef JSON Props;
+  typedef std::shared_ptr<const Props> SharedProps;
+  typedef std::function<void(const State &prevState,
+                             const Props &currentProps)> UpdateCb;
+  typedef std::function<const State(const State &prevState,
+                                    const Props &currentProps)> ReturnedUpdateCb;
+
+  /**
+   * Identifies an async request issued by Component::beginUpdate(). A later
+   * beginUpdate() on the same channel supersedes it, and updates carrying a
+   * superseded token are dropped. A default-constructed token is never
+   * superseded.
+   */
+  struct UpdateToken {
+    std::string channel;
+    uint64_t generation = 0;
+  };
+
+#pragma mark - StateObserver
+  /**
+   * Notified after every setState() merge on the subtree it is attached to.
+   */
+  class StateObserver {
+  public:
+    virtual ~StateObserver() {}
+
+    /**
+     * @param[in] component whose state was merged
+     * @param[in] partialState as passed to setState()
+     * @param[in] prevState
+     */
+    virtual void componentDidSetState(Component &component,
+                                      const State &partialState,
+                                      const State &prevState) = 0;
+  };
+  typedef std::shared_ptr<StateObserver> SharedStateObserver;
+
+#pragma mark - Hash
+  /**
+   * 64-bit structural hashing of keys and JSON values.
+   * Object members are combined independently of their iteration order.
+   */
+  class Hash {
+  public:
+    static const uint64_t kSeed = 0xcbf29ce484222325ULL;
+
+    static inline uint64_t bytes(const void *data, size_t size, uint64_t seed = kSeed) {
+      auto p = static_cast<const unsigned char*>(data);
+      uint64_t h = seed;
+      for (size_t i = 0; i < size; ++i) {h = (h ^ p[i]) * 0x100000001b3ULL;}
+      return mix(h);
+    }
+    static inline uint64_t string(const std::string &value, uint64_t seed = kSeed) {
+      return bytes(value.data(), value.size(), seed);
+    }
+    static inline uint64_t combine(uint64_t seed, uint64_t value) {
+      return mix(seed ^ (value + 0x9e3779b97f4a7c15ULL + (seed << 6) + (seed >> 2)));
+    }
+    static inline uint64_t mix(uint64_t h) {
+      h ^= h >> 33; h *= 0xff51afd7ed558ccdULL;
+      h ^= h >> 33; h *= 0xc4ceb9fe1a85ec53ULL;
+      return h ^ (h >> 33);
+    }
+
+    static inline uint64_t json(const JSON &value) {
+      uint64_t h = mix(static_cast<uint64_t>(value.type()) + 1);
+      switch (value.type()) {
+        case JSON::value_t::object: {
+          uint64_t members = 0;
+          for (auto it = value.begin(); it != value.end(); ++it) {
+            members += combine(string(it.key()), json(it.value()));
+          }
+          return combine(h, members);
+        }
+        case JSON::value_t::array:
+          for (auto &element : value) {h = combine(h, json(element));}
+          return combine(h, value.size());
+        case JSON::value_t::string:
+          return string(*value.get_ptr<const std::string*>(), h);
+        case JSON::value_t::boolean:
+          return combine(h, value.get<bool>() ? 1 : 0);
+        case JSON::value_t::number_integer:
+          return combine(h, static_cast<uint64_t>(value.get<int64_t>()));
+        case JSON::value_t::number_float: {
+          double number = value.get<double>();
+          if (number == 0) number = 0; // -0.0 == 0.0
+          // Integral floats hash as the integer they equal, as 1 == 1.0.
+          if (number >= -0x1p63 && number < 0x1p63 && std::trunc(number) == number) {
+            return combine(mix(static_cast<uint64_t>(JSON::value_t::number_integer) + 1),
+                           static_cast<uint64_t>(static_cast<int64_t>(number)));
+          }
+          return bytes(&number, sizeof(number), h);
+        }
+        default:
+          return h;
+      }
+    }
+  };
+
+#pragma mark - Key
+  /**
+   * A component key: string | boolean | number | null.
+   *
+   * Strings are interned once in a process-wide table and the key holds a
+   * pointer to the shared copy, so equality and hashing are O(1) and reading
+   * the string takes no lock. Entries are reference-counted by the keys that
+   * hold them and dropped with the last one, so the table only holds strings
+   * of live keys. Integers and booleans are stored inline and never allocate.
+   */
+  class Key {
+  public:
+    enum class Type : uint8_t {Null, String, Integer, Boolean};
+
+    Key() : _type(Type::Null), _integer(0) {}
+    Key(const std::string &value) : _type(Type::String), _string(intern(value)) {}
+    Key(const char *value) : Key(std::string(value)) {}
+    template <typename T, typename std::enable_if<std::is_integral<T>::value &&
+                                                  !std::is_same<T, bool>::value,
+                                                  int>::type = 0>
+    Key(T value) : _type(Type::Integer), _integer(static_cast<int64_t>(value)) {}
+    Key(bool value) : _type(Type::Boolean), _integer(value ? 1 : 0) {}
+
+    Key(const Key &other) : _type(other._type) {
+      if (_type == Type::String) {
+        _string = other._string;
+        _string->refs.fetch_add(1, std::memory_order_relaxed);
+      } else {
+        _integer = other._integer;
+      }
+    }
+    Key(Key &&other) noexcept : _type(other._type) {
+      if (_type == Type::String) {
+        _string = other._string;
+        other._type = Type::Null;
+        other._integer = 0;
+      } else {
+        _integer = other._integer;
+      }
+    }
+    ~Key() {if (_type == Type::String) release(_string);}
+
+    inline Key &operator=(const Key &other) {
+      if (this != &other) *this = Key(other);
+      return *this;
+    }
+    inline Key &operator=(Key &&other) noexcept {
+      if (this != &other) {
+        if (_type == Type::String) release(_string);
+        _type = other._type;
+        if (_type == Type::String) {
+          _string = other._string;
+          other._type = Type::Null;
+          other._integer = 0;
+        } else {
+          _integer = other._integer;
+        }
+      }
+      return *this;
+    }
+
+    /**
+     * @throws std::invalid_argument for JSON types that can't be keys
+     */
+    static inline Key fromJSON(const JSON &value) {
+      switch (value.type()) {
+        case JSON::value_t::null: return Key();
+        case JSON::value_t::string: return Key(*value.get_ptr<const std::string*>());
+        case JSON::value_t::number_integer: return Key(value.get<int64_t>());
+        case JSON::value_t::boolean: return Key(value.get<bool>());
+        default: throw std::invalid_argument("invalid component key: " + value.dump());
+      }
+    }
+    inline JSON toJSON() const {
+      switch (_type) {
+        case Type::String: return JSON(_string->string);
+        case Type::Integer: return JSON(_integer);
+        case Type::Boolean: return JSON(_integer != 0);
+        default: return JSON();
+      }
+    }
+
+    inline Type type() const {return _type;}
+    inline bool isString() const {return _type == Type::String;}
+    /**
+     * The interned string of a string key; empty for other types.
+     */
+    inline const std::string &string() const {
+      static const std::string empty;
+      return _type == Type::String ? _string->string : empty;
+    }
+    /**
+     * @returns the key formatted as a string ("true", "42", "" for null)
+     */
+    inline std::string str() const {
+      switch (_type) {
+        case Type::String: return _string->string;
+        case Type::Integer: return std::to_string(_integer);
+        case Type::Boolean: return _integer ? "true" : "false";
+        default: return "";
+      }
+    }
+    inline operator std::string() const {return str();}
+
+    /**
+     * Content-based, so it's stable across processes.
+     */
+    inline uint64_t hash() const {
+      switch (_type) {
+        case Type::String: return _string->hash;
+        case Type::Null: return Hash::mix(0);
+        default: return Hash::combine(static_cast<uint64_t>(_type),
+                                      static_cast<uint64_t>(_integer));
+      }
+    }
+
+    inline bool operator==(const Key &other) const {
+      return _type == other._type &&
+        (_type == Type::String ? _string == other._string : _integer == other._integer);
+    }
+    inline bool operator!=(const Key &other) const {return !(*this == other);}
+    // Compare with strings without interning them.
+    inline bool operator==(const std::string &other) const {
+      return _type == Type::String && _string->string == other;
+    }
+    inline bool operator!=(const std::string &other) const {return !(*this == other);}
+    inline bool operator==(const char *other) const {
+      return _type == Type::String && _string->string == other;
+    }
+    inline bool operator!=(const char *other) const {return !(*this == other);}
+
+    /**
+     * @returns the number of distinct strings held by live keys
+     */
+    static inline size_t interned() {
+      auto &table = Key::table();
+      std::unique_lock<std::mutex> lock(table.mutex, std::defer_lock);
+      if (depth() == 0) lock.lock();
+      return table.size;
+    }
+
+    /**
+     * Holds the intern table's lock for its lifetime, so string keys this
+     * thread creates meanwhile don't lock one by one. Other threads creating
+     * string keys wait, so keep batches short. Batches nest.
+     */
+    class Batch {
+    public:
+      Batch() {if (depth()++ == 0) table().mutex.lock();}
+      Batch(const Batch&) = delete;
+      Batch &operator=(const Batch&) = delete;
+      ~Batch() {if (--depth() == 0) table().mutex.unlock();}
+    };
+
+  private:
+    friend class Snapshot;
+
+    // Interned string, its hash and the number of keys holding it.
+    struct Interned {
+      Interned(const char *data, size_t size, uint64_t hash) :
+      string(data, size), hash(hash), refs(1) {}
+      std::string string;
+      uint64_t hash;
+      std::atomic<size_t> refs;
+    };
+
+    /**
+     * Open-addressing index of (hash, entry) over a deque of entries, so a
+     * lookup hashes the string once and touches the entry only on a hash
+     * match. Elements of a deque never move, so entry pointers stay valid;
+     * released entries go on a free list for the next new string.
+     */
+    struct Table {
+      std::mutex mutex;
+      std::deque<Interned> entries;
+      std::vector<Interned*> free;
+      std::vector<std::pair<uint64_t, Interned*>> slots;
+      size_t size = 0; // live entries
+    };
+
+    // A string for intern(std::vector<Pending>&) to assign to *key.
+    struct Pending {
+      const char *data;
+      size_t size;
+      Key *key;
+      uint64_t hash;
+    };
+
+    explicit Key(Interned *entry) : _type(Type::String), _string(entry) {}
+
+    // Never destroyed, so keys in static storage can still release at exit.
+    static inline Table &table() {
+      static Table *table = new Table;
+      return *table;
+    }
+    static inline unsigned &depth() {
+      static thread_local unsigned depth = 0;
+      return depth;
+    }
+
+    static inline Interned *intern(const std::string &value) {
+      auto &table = Key::table();
+      auto hash = Hash::string(value);
+      std::unique_lock<std::mutex> lock(table.mutex, std::defer_lock);
+      if (depth() == 0) lock.lock();
+      reserve(table, 1);
+      return insert(table, value.data(), value.size(), hash);
+    }
+
+    /**
+     * Interns every pending string, overlapping their table lookups: all
+     * home slots are prefetched before the first probe, and the entries they
+     * point at before the first comparison.
+     */
+    static inline void intern(std::vector<Pending> &pending) {
+      if (pending.empty()) return;
+      auto &table = Key::table();
+      std::unique_lock<std::mutex> lock(table.mutex, std::defer_lock);
+      if (depth() == 0) lock.lock();
+      reserve(table, pending.size());
+      auto mask = table.slots.size() - 1;
+      for (auto &string : pending) {
+        string.hash = Hash::bytes(string.data, string.size);
+        prefetch(&table.slots[string.hash & mask]);
+      }
+      for (auto &string : pending) {
+        if (auto entry = table.slots[string.hash & mask].second) prefetch(entry);
+      }
+      for (auto &string : pending) {
+        *string.key = Key(insert(table, string.data, string.size, string.hash));
+      }
+    }
+
+    // Makes room for count more entries.
+    static inline void reserve(Table &table, size_t count) {
+      if ((table.size + count) * 2 <= table.slots.size()) return;
+      auto size = std::max<size_t>(64, table.slots.size());
+      while ((table.size + count) * 2 > size) size *= 2;
+      std::vector<std::pair<uint64_t, Interned*>> slots(size, {0, nullptr});
+      auto mask = slots.size() - 1;
+      for (auto &slot : table.slots) {
+        if (!slot.second) continue;
+        auto i = slot.first & mask;
+        while (slots[i].second) i = (i + 1) & mask;
+        slots[i] = slot;
+      }
+      table.slots.swap(slots);
+    }
+
+    // Takes a reference to the entry of the string, adding it if it's new.
+    static inline Interned *insert(Table &table, const char *data, size_t size, uint64_t hash) {
+      auto mask = table.slots.size() - 1;
+      auto i = hash & mask;
+      for (; table.slots[i].second; i = (i + 1) & mask) {
+        auto entry = table.slots[i].second;
+        if (table.slots[i].first == hash && entry->string.size() == size &&
+            entry->string.compare(0, size, data, size) == 0) {
+          entry->refs.fetch_add(1, std::memory_order_relaxed);
+          return entry;
+        }
+      }
+      Interned *entry;
+      if (table.free.empty()) {
+        table.entries.emplace_back(data, size, hash);
+        entry = &table.entries.back();
+      } else {
+        entry = table.free.back();
+        table.free.pop_back();
+        entry->string.assign(data, size);
+        entry->hash = hash;
+        entry->refs.store(1, std::memory_order_relaxed);
+      }
+      table.slots[i] = {hash, entry};
+      ++table.size;
+      return entry;
+    }
+
+    static inline void prefetch(const void *address) {
+#if defined(__GNUC__) || defined(__clang__)
+      __builtin_prefetch(address);
+#else
+      (void)address;
+#endif
+    }
+
+    /**
+     * Drops a key's reference to entry. Only the last reference is dropped
+     * under the table's lock, so intern() never hands out a released entry.
+     */
+    static inline void release(Interned *entry) {
+      auto refs = entry->refs.load(std::memory_order_relaxed);
+      while (refs > 1) {
+        if (entry->refs.compare_exchange_weak(refs, refs - 1, std::memory_order_acq_rel)) {
+          return;
+        }
+      }
+      auto &table = Key::table();
+      std::unique_lock<std::mutex> lock(table.mutex, std::defer_lock);
+      if (depth() == 0) lock.lock();
+      if (entry->refs.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+
+      // Remove its slot, shifting later entries of the probe run back over
+      // the hole unless that would move them before their home slot.
+      auto mask = table.slots.size() - 1;
+      auto i = entry->hash & mask;
+      while (table.slots[i].second != entry) i = (i + 1) & mask;
+      for (auto j = (i + 1) & mask; table.slots[j].second; j = (j + 1) & mask) {
+        auto home = table.slots[j].first & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+          table.slots[i] = table.slots[j];
+          i = j;
+        }
+      }
+      table.slots[i] = {0, nullptr};
+      std::string().swap(entry->string);
+      table.free.push_back(entry);
+      --table.size;
+    }
+
+    Type _type;
+    union {
+      Interned *_string;
+      int64_t _integer;
+    };
+  };
+
+  inline std::ostream &operator<<(std::ostream &out, const Key &key) {
+    return out << key.str();
+  }
+}}
+
+namespace std {
+  template <>
+  struct hash<jgod::reactive::Key> {
+    inline size_t operator()(const jgod::reactive::Key &key) const {
+      return static_cast<size_t>(key.hash());
+    }
+  };
+}
+
+namespace jgod { namespace reactive {
+#pragma mark - RenderCache
+  /**
+   * LRU cache of render output keyed by a fingerprint of a component's type,
+   * props and state, bounded by an approximate byte budget.
+   * Share one cache between components that render the same (props, state)
+   * combinations, e.g. the rows of a list.
+   */
+  class RenderCache {
+  public:
+    struct Stats {
+      uint64_t hits = 0;
+      uint64_t misses = 0;
+      uint64_t evictions = 0;
+    };
+
+    explicit RenderCache(size_t byteBudget = 4 * 1024 * 1024) : _budget(byteBudget) {}
+
+    /**
+     * @returns the cached output for fingerprint, or nullptr on a miss
+     */
+    inline const JSON *find(uint64_t fingerprint) {
+      auto it = _index.find(fingerprint);
+      if (it == std::end(_index)) {
+        ++_stats.misses;
+        return nullptr;
+      }
+      ++_stats.hits;
+      _entries.splice(std::begin(_entries), _entries, it->second);
+      return &it->second->output;
+    }
+    inline void insert(uint64_t fingerprint, const JSON &output) {
+      auto bytes = approximateSize(output);
+      if (bytes > _budget) return;
+      auto it = _index.find(fingerprint);
+      if (it != std::end(_index)) {
+        _bytes -= it->second->bytes;
+        _entries.erase(it->second);
+        _index.erase(it);
+      }
+      _entries.push_front(Entry{fingerprint, output, bytes});
+      _index[fingerprint] = std::begin(_entries);
+      _bytes += bytes;
+      while (_bytes > _budget) {
+        auto &last = _entries.back();
+        _bytes -= last.bytes;
+        _index.erase(last.fingerprint);
+        _entries.pop_back();
+        ++_stats.evictions;
+      }
+    }
+    inline void clear() {
+      _entries.clear();
+      _index.clear();
+      _bytes = 0;
+    }
+
+    inline const Stats &getStats() const {return _stats;}
+    inline size_t size() const {return _entries.size();}
+    inline size_t bytes() const {return _bytes;}
+    inline size_t budget() const {return _budget;}
+
+    static inline size_t approximateSize(const JSON &value) {
+      size_t bytes = sizeof(JSON);
+      switch (value.type()) {
+        case JSON::value_t::object:
+          for (auto it = value.begin(); it != value.end(); ++it) {
+            // Key storage plus a map node's bookkeeping.
+            bytes += sizeof(std::string) + it.key().size() + 4 * sizeof(void*);
+            bytes += approximateSize(it.value());
+          }
+          break;
+        case JSON::value_t::array:
+          for (auto &element : value) {bytes += approximateSize(element);}
+          break;
+        case JSON::value_t::string:
+          bytes += sizeof(std::string) + value.get_ptr<const std::string*>()->size();
+          break;
+        default:
+          break;
+      }
+      return bytes;
+    }
+
+  private:
+    struct Entry {
+      uint64_t fingerprint;
+      JSON output;
+      size_t bytes;
+    };
+
+    size_t _budget;
+    size_t _bytes = 0;
+    std::list<Entry> _entries; // most recently used first
+    std::unordered_map<uint64_t, std::list<Entry>::iterator> _index;
+    Stats _stats;
+  };
+  typedef std::shared_ptr<RenderCache> SharedRenderCache;
+
+#pragma mark - PropsPool
+  /**
+   * Hash-consing of props: identical props are stored once, immutable and
+   * refcounted, and shared by every component constructed with them, so
+   * thousands of list rows with the same configuration hold one copy.
+   * Props interned by the same pool are equal exactly when their pointers
+   * are; each pool has a process-unique id() so components can tell.
+   *
+   * Sharing is per props value; sub-objects of distinct props can't be shared
+   * because JSON values own their members.
+   *
+   * Pools are opt-in: components constructed on a thread while a Scope is
+   * alive intern their props (Registry does this when it has a pool), and
+   * intern() can be called directly for the Component(key, SharedProps, ...)
+   * constructor.
+   */
+  class PropsPool {
+  public:
+    struct Stats {
+      uint64_t hits = 0;
+      uint64_t misses = 0;
+    };
+
+    /**
+     * Routes props of components constructed on this thread through a pool
+     * for the lifetime of the scope.
+     */
+    class Scope {
+    public:
+      explicit Scope(PropsPool *pool) : _previous(current()) {current() = pool;}
+      Scope(const Scope&) = delete;
+      Scope &operator=(const Scope&) = delete;
+      ~Scope() {current() = _previous;}
+    private:
+      PropsPool *_previous;
+    };
+
+    /**
+     * @returns the pool of the innermost Scope on this thread, or nullptr
+     */
+    static inline PropsPool *&current() {
+      static thread_local PropsPool *pool = nullptr;
+      return pool;
+    }
+    /**
+     * @returns the id() of the current pool, or 0 if there is none
+     */
+    static inline uint64_t currentId() {
+      auto pool = current();
+      return pool ? pool->id() : 0;
+    }
+
+    /**
+     * @returns a nonzero id no other pool in the process shares, even after
+     * this one is destroyed
+     */
+    inline uint64_t id() const {return _id;}
+
+    /**
+     * @returns the shared copy of props, adding it if it's new
+     */
+    inline SharedProps intern(Props props) {
+      auto hash = Hash::json(props);
+      std::lock_guard<std::mutex> lock(_mutex);
+      auto range = _entries.equal_range(hash);
+      for (auto it = range.first; it != range.second;) {
+        auto shared = it->second.lock();
+        if (!shared) {
+          it = _entries.erase(it);
+        } else if (*shared == props) {
+          ++_stats.hits;
+          return shared;
+        } else {
+          ++it;
+        }
+      }
+      ++_stats.misses;
+      auto shared = std::make_shared<const Props>(std::move(props));
+      _entries.insert({hash, shared});
+      if (_entries.size() >= 2 * _sweepSize) sweep();
+      return shared;
+    }
+
+    /**
+     * Drops entries whose props are no longer used by any component.
+     */
+    inline void collect() {
+      std::lock_guard<std::mutex> lock(_mutex);
+      sweep();
+    }
+    inline size_t size() const {
+      std::lock_guard<std::mutex> lock(_mutex);
+      return _entries.size();
+    }
+    inline Stats getStats() const {
+      std::lock_guard<std::mutex> lock(_mutex);
+      return _stats;
+    }
+
+    /**
+     * Interns props through the current pool, if any. Null props are always
+     * the one shared empty instance.
+     */
+    static inline SharedProps share(Props props) {
+      static const SharedProps empty = std::make_shared<const Props>();
+      if (props.is_null()) return empty;
+      auto pool = current();
+      return pool ? pool->intern(std::move(props))
+                  : std::make_shared<const Props>(std::move(props));
+    }
+
+  private:
+    inline void sweep() {
+      for (auto it = std::begin(_entries); it != std::end(_entries);) {
+        if (it->second.expired()) {
+          it = _entries.erase(it);
+        } else {
+          ++it;
+        }
+      }
+      _sweepSize = std::max<size_t>(_entries.size(), 1024);
+    }
+
+    static inline uint64_t nextId() {
+      static std::atomic<uint64_t> next(1);
+      return next++;
+    }
+
+    const uint64_t _id = nextId();
+    mutable std::mutex _mutex;
+    std::unordered_multimap<uint64_t, std::weak_ptr<const Props>> _entries;
+    size_t _sweepSize = 1024;
+    Stats _stats;
+  };
+  typedef std::shared_ptr<PropsPool> SharedPropsPool;
+
+#pragma mark - StateEpoch
+  /**
+   * A component's state as published for readers on other threads.
+   */
+  struct PublishedState {
+    SharedState state;
+    uint64_t version;
+  };
+
+  /**
+   * Epoch-based reclamation of published states. Readers pin the current
+   * epoch with a Guard, which is two atomic stores and takes no lock; a state
+   * replaced by setState() is retired rather than freed, and only freed once
+   * every reader pinned at or before its retirement has unpinned.
+   *
+   * Each thread keeps its own list of retired states and advances the epoch
+   * with a single atomic increment, so retiring takes no lock either. Freed
+   * PublishedStates are kept for reuse by the thread's next publish(). States
+   * a thread leaves retired when it exits are handed to the next thread that
+   * reclaims.
+   */
+  class StateEpoch {
+    struct ThreadSlot;
+  public:
+    enum : size_t {kReclaimThreshold = 64};
+
+    /**
+     * Pins the calling thread's epoch for its lifetime. Guards nest.
+     */
+    class Guard {
+    public:
+      inline Guard();
+      Guard(const Guard&) = delete;
+      Guard &operator=(const Guard&) = delete;
+      inline ~Guard();
+    private:
+      ThreadSlot &_slot;
+    };
+
+    static inline StateEpoch &global() {
+      // Leaked so it outlives thread-local slot holders at exit
+      static auto epoch = new StateEpoch();
+      return *epoch;
+    }
+
+    /**
+     * @returns a PublishedState for state, reusing one this thread freed
+     */
+    inline const PublishedState *publish(SharedState state, uint64_t version);
+
+    /**
+     * Frees published once no reader can still be using it.
+     */
+    inline void retire(const PublishedState *published);
+
+    /**
+     * Frees every state retired on the calling thread, or left by exited
+     * threads, that no reader is still using.
+     */
+    inline void collect();
+
+    /**
+     * @returns how many states retired on the calling thread, or left by
+     * exited threads, aren't freed yet
+     */
+    inline size_t retired() const;
+
+  private:
+    struct Slot {
+      std::atomic<uint64_t> epoch{0}; // 0 while the thread isn't reading
+      std::atomic<bool> used{true};
+      Slot *next = nullptr;
+    };
+    typedef std::pair<uint64_t, const PublishedState*> Retired;
+
+    StateEpoch() {}
+
+    static inline ThreadSlot &local();
+    // Set once the calling thread's slot is destroyed, as it exits.
+    static inline bool &detached() {
+      static thread_local bool detached = false;
+      return detached;
+    }
+
+    /**
+     * Claims a released slot or links in a new one, without locking.
+     */
+    inline Slot *acquireSlot() {
+      for (auto slot = _slots.load(); slot; slot = slot->next) {
+        bool expected = false;
+        if (slot->used.compare_exchange_strong(expected, true)) return slot;
+      }
+      auto slot = new Slot();
+      slot->next = _slots.load();
+      while (!_slots.compare_exchange_weak(slot->next, slot)) {}
+      return slot;
+    }
+
+    inline void reclaim(ThreadSlot &local);
+    inline void orphan(std::vector<Retired> &retired) {
+      if (retired.empty()) return;
+      std::lock_guard<std::mutex> lock(_mutex);
+      _orphans.insert(std::end(_orphans), std::begin(retired), std::end(retired));
+      _orphaned.store(_orphans.size());
+      retired.clear();
+    }
+
+    std::atomic<uint64_t> _epoch{1};
+    std::atomic<Slot*> _slots{nullptr};
+    mutable std::mutex _mutex; // guards _orphans
+    std::vector<Retired> _orphans; // left by exited threads
+    std::atomic<size_t> _orphaned{0};
+  };
+
+  /**
+   * The calling thread's reader slot and retired states, released when the
+   * thread exits.
+   */
+  struct StateEpoch::ThreadSlot {
+    ThreadSlot() : slot(global().acquireSlot()) {}
+    ~ThreadSlot() {
+      auto &epoch = global();
+      epoch.reclaim(*this);
+      epoch.orphan(retired);
+      for (auto published : spare) delete published;
+      detached() = true;
+      slot->used.store(false);
+    }
+    Slot *slot;
+    unsigned depth = 0;
+    std::vector<Retired> retired;
+    size_t reclaimAt = kReclaimThreshold;
+    std::vector<PublishedState*> spare; // freed, for reuse
+  };
+
+  inline StateEpoch::ThreadSlot &StateEpoch::local() {
+    static thread_local ThreadSlot slot;
+    return slot;
+  }
+
+  inline const PublishedState *StateEpoch::publish(SharedState state, uint64_t version) {
+    if (!detached()) {
+      auto &spare = local().spare;
+      if (!spare.empty()) {
+        auto published = spare.back();
+        spare.pop_back();
+        published->state = std::move(state);
+        published->version = version;
+        return published;
+      }
+    }
+    return new PublishedState{std::move(state), version};
+  }
+
+  inline void StateEpoch::retire(const PublishedState *published) {
+    Retired retired{_epoch.load(), published};
+    if (detached()) {
+      std::vector<Retired> orphaned{retired};
+      orphan(orphaned);
+      return;
+    }
+    auto &local = StateEpoch::local();
+    local.retired.push_back(retired);
+    if (local.retired.size() >= local.reclaimAt) {
+      reclaim(local);
+      local.reclaimAt = std::max<size_t>(kReclaimThreshold, 2 * local.retired.size());
+    }
+  }
+
+  inline void StateEpoch::collect() {
+    if (!detached()) reclaim(local());
+  }
+
+  inline size_t StateEpoch::retired() const {
+    return (detached() ? 0 : local().retired.size()) + _orphaned.load();
+  }
+
+  inline void StateEpoch::reclaim(ThreadSlot &local) {
+    if (_orphaned.load() != 0) {
+      std::lock_guard<std::mutex> lock(_mutex);
+      local.retired.insert(std::end(local.retired), std::begin(_orphans), std::end(_orphans));
+      _orphans.clear();
+      _orphaned.store(0);
+    }
+    _epoch.fetch_add(1);
+    auto oldest = std::numeric_limits<uint64_t>::max();
+    for (auto slot = _slots.load(); slot; slot = slot->next) {
+      auto epoch = slot->epoch.load();
+      if (epoch != 0) oldest = std::min(oldest, epoch);
+    }
+    auto kept = std::begin(local.retired);
+    for (auto it = std::begin(local.retired); it != std::end(local.retired); ++it) {
+      if (it->first >= oldest) {
+        *kept++ = *it;
+        continue;
+      }
+      // Published states are only ever created non-const, by publish().
+      auto published = const_cast<PublishedState*>(it->second);
+      if (local.spare.size() < kReclaimThreshold) {
+        published->state.reset();
+        local.spare.push_back(published);
+      } else {
+        delete published;
+      }
+    }
+    local.retired.erase(kept, std::end(local.retired));
+  }
+
+  inline StateEpoch::Guard::Guard() : _slot(local()) {
+    if (_slot.depth++ == 0) _slot.slot->epoch.store(global()._epoch.load());
+  }
+  inline StateEpoch::Guard::~Guard() {
+    if (--_slot.depth == 0) _slot.slot->epoch.store(0);
+  }
+
+#pragma mark - ComponentPool
+  /**
+   * Per-type pools of removed components, reused for new keys to avoid
+   * allocator churn in views that constantly mount and unmount rows.
+   *
+   * Components created by a Registry with a pool return to it when removeChild()
+   * or removeChildren() drops the last reference to them; their children are
+   * released along with them. Registry::create() takes from the pool first and
+   * resets the instance with Component::recycle().
+   */
+  class ComponentPool : public std::enable_shared_from_this<ComponentPool> {
+  public:
+    struct Stats {
+      uint64_t reused = 0;
+      uint64_t released = 0;
+      uint64_t dropped = 0; // still referenced elsewhere, or the pool was full
+    };
+
+    explicit ComponentPool(size_t capacityPerType = 256) : _capacity(capacityPerType) {}
+
+    inline void setCapacity(size_t capacityPerType) {
+      _capacity = capacityPerType;
+      for (auto &free : _free) {
+        if (free.second.size() > _capacity) free.second.resize(_capacity);
+      }
+    }
+    inline size_t getCapacity() const {return _capacity;}
+
+    /**
+     * Returns components to the pool from now on when they are removed.
+     */
+    inline void adopt(Component &component);
+
+    /**
+     * Takes component if nothing else references it and there is room.
+     * Its children are detached and appended to orphans, for the caller to
+     * release in turn. Its state observers and disposal queue are dropped.
+     * @returns whether it was pooled
+     */
+    inline bool release(SharedComponent &component, NodeList &orphans);
+
+    /**
+     * @returns a pooled instance of type, not yet recycled, or nullptr
+     */
+    inline SharedComponent acquire(const std::type_index &type) {
+      auto it = _free.find(type);
+      if (it == std::end(_free) || it->second.empty()) return nullptr;
+      auto component = std::move(it->second.back());
+      it->second.pop_back();
+      ++_stats.reused;
+      return component;
+    }
+
+    inline size_t size(const std::type_index &type) const {
+      auto it = _free.find(type);
+      return it == std::end(_free) ? 0 : it->second.size();
+    }
+    inline void clear() {_free.clear();}
+    inline void clear(const std::type_index &type) {_free.erase(type);}
+    inline const Stats &getStats() const {return _stats;}
+
+  private:
+    size_t _capacity;
+    std::unordered_map<std::type_index, NodeList> _free;
+    Stats _stats;
+  };
+  typedef std::shared_ptr<ComponentPool> SharedComponentPool;
+
+#pragma mark - DisposalQueue
+  /**
+   * Takes ownership of removed subtrees and destroys them off the update path,
+   * one component at a time, so dropping a large subtree doesn't run thousands
+   * of destructors inside removeChild().
+   *
+   * In Incremental mode call drain() with a time budget when the loop is idle.
+   * In Background mode a worker thread destroys components as they arrive;
+   * destructors then run on that thread. So that the worker only touches
+   * components nothing else can reach, push() prepares the subtree on the
+   * calling thread: a component still referenced elsewhere is released
+   * instead of queued, descendants referenced elsewhere are cut out, and
+   * components with live WeakComponent handles, e.g. pending deferred or
+   * scheduled updates and running animations, are destroyed right there once
+   * their children are queued. Tasks of the queued components are cancelled
+   * there too.
+   *
+   * Attach a queue to a component (usually the root) with
+   * Component::setDisposalQueue(); children removed anywhere below it go there.
+   */
+  class DisposalQueue {
+  public:
+    enum class Mode {Incremental, Background};
+
+    explicit DisposalQueue(Mode mode = Mode::Incremental) : _mode(mode) {
+      if (_mode == Mode::Background) {
+        _worker = std::thread([this] {work();});
+      }
+    }
+    DisposalQueue(const DisposalQueue&) = delete;
+    DisposalQueue &operator=(const DisposalQueue&) = delete;
+    ~DisposalQueue() {
+      if (_worker.joinable()) {
+        {
+          std::lock_guard<std::mutex> lock(_mutex);
+          _stopping = true;
+        }
+        _ready.notify_one();
+        _worker.join();
+      }
+      drainAll();
+    }
+
+    inline void push(SharedComponent component) {
+      if (!component) return;
+      if (_mode == Mode::Background) {
+        if (component.use_count() != 1) return; // its last owner destroys it
+        NodeList safe, kept; // kept are destroyed on this thread, on return
+        prepare(std::move(component), safe, kept);
+        if (safe.empty()) return;
+        {
+          std::lock_guard<std::mutex> lock(_mutex);
+          for (auto &root : safe) _pending.push_back(std::move(root));
+        }
+        _ready.notify_one();
+        return;
+      }
+      std::lock_guard<std::mutex> lock(_mutex);
+      _pending.push_back(std::move(component));
+    }
+
+    /**
+     * Destroys queued components until budget runs out.
+     * @returns how many components were destroyed
+     */
+    inline size_t drain(std::chrono::microseconds budget);
+    inline size_t drainAll() {return drain(std::chrono::microseconds::max());}
+
+    inline size_t pending() const {
+      std::lock_guard<std::mutex> lock(_mutex);
+      return _pending.size();
+    }
+    inline uint64_t destroyed() const {
+      std::lock_guard<std::mutex> lock(_mutex);
+      return _destroyed;
+    }
+
+  private:
+    static const size_t kClockInterval = 32;
+
+    /**
+     * Splits root's subtree, on the thread that removed it, into subtrees
+     * the worker may destroy (safe) and weakly referenced components to
+     * destroy here (kept, already emptied). Descendants referenced elsewhere
+     * are cut out; tasks of the rest are cancelled.
+     */
+    inline void prepare(SharedComponent root, NodeList &safe, NodeList &kept);
+
+    inline void work() {
+      std::unique_lock<std::mutex> lock(_mutex);
+      for (;;) {
+        _ready.wait(lock, [this] {return _stopping || !_pending.empty();});
+        if (_stopping) return;
+        lock.unlock();
+        drainAll();
+        lock.lock();
+      }
+    }
+
+    Mode _mode;
+    mutable std::mutex _mutex;
+    std::condition_variable _ready;
+    NodeList _pending;
+    uint64_t _destroyed = 0;
+    bool _stopping = false;
+    std::thread _worker;
+  };
+  typedef std::shared_ptr<DisposalQueue> SharedDisposalQueue;
+
+#pragma mark - Coroutines
+#ifdef JGOD_REACTIVE_COROUTINES
+  /**
+   * Coroutine owned by a component through Component::spawn(). It starts
+   * running as soon as it's called; destroying the Task cancels it wherever
+   * it is suspended, running the destructors of its locals.
+   *
+   * An exception escaping the coroutine is rethrown by whatever resumed it:
+   * spawn() for the part before its first suspension, commitWork() or
+   * Deferred::resolve() afterwards.
+   */
+  class Task {
+  public:
+    struct promise_type {
+      inline Task get_return_object() {
+        return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+      }
+      inline std::suspend_never initial_suspend() noexcept {return {};}
+      inline std::suspend_always final_suspend() noexcept {return {};}
+      inline void return_void() {}
+      inline void unhandled_exception() {exception = std::current_exception();}
+      std::exception_ptr exception;
+      Component *owner = nullptr; // set by Component::spawn()
+    };
+    typedef std::coroutine_handle<promise_type> Handle;
+
+    Task() {}
+    Task(Task &&other) noexcept : _handle(other._handle) {other._handle = nullptr;}
+    Task &operator=(Task &&other) noexcept {
+      if (this != &other) {
+        cancel();
+        _handle = other._handle;
+        other._handle = nullptr;
+      }
+      return *this;
+    }
+    Task(const Task&) = delete;
+    Task &operator=(const Task&) = delete;
+    ~Task() {cancel();}
+
+    inline bool done() const {return !_handle || _handle.done();}
+    inline void cancel() {
+      if (_handle) _handle.destroy();
+      _handle = nullptr;
+    }
+
+    /**
+     * Resumes the tasks suspended on each awaiter in queue, then rethrows the
+     * first exception one of them let escape. Awaiters of tasks cancelled
+     * meanwhile take themselves out of queue. Tasks that finish are dropped
+     * by their component right away, releasing what their frames hold.
+     */
+    template<class Awaiter>
+    static inline void resume(std::vector<Awaiter*> &queue);
+
+  private:
+    friend class Component;
+    explicit Task(Handle handle) : _handle(handle) {}
+
+    Handle _handle;
+  };
+
+  /**
+   * One-shot value for Tasks to co_await, resolved by whatever produces it
+   * (a response handler, a cache, another task). Awaiting tasks resume
+   * inside resolve() or reject(), on the resolving thread; copies share the
+   * same value.
+   */
+  template<class T>
+  class Deferred {
+    struct Shared;
+  public:
+    class Awaiter {
+    public:
+      explicit Awaiter(std::shared_ptr<Shared> shared) : _shared(std::move(shared)) {}
+      Awaiter(const Awaiter&) = delete;
+      Awaiter &operator=(const Awaiter&) = delete;
+      ~Awaiter() {
+        // Cancelled while suspended
+        if (_handle) {
+          for (auto waiters : {&_shared->waiters, &_shared->resuming}) {
+            waiters->erase(std::remove(std::begin(*waiters), std::end(*waiters), this),
+                           std::end(*waiters));
+          }
+        }
+      }
+      inline bool await_ready() const {return _shared->settled();}
+      inline void await_suspend(Task::Handle handle) {
+        _handle = handle;
+        _shared->waiters.push_back(this);
+      }
+      /**
+       * @throws the exception passed to reject()
+       */
+      inline T await_resume() {
+        _handle = nullptr;
+        if (_shared->error) std::rethrow_exception(_shared->error);
+        return *_shared->value;
+      }
+    private:
+      friend class Task;
+      std::shared_ptr<Shared> _shared;
+      Task::Handle _handle;
+    };
+
+    Deferred() : _shared(std::make_shared<Shared>()) {}
+
+    inline void resolve(T value) {
+      if (_shared->settled()) return;
+      _shared->value.emplace(std::move(value));
+      wake();
+    }
+    inline void reject(std::exception_ptr error) {
+      if (_shared->settled()) return;
+      _shared->error = error;
+      wake();
+    }
+    inline bool settled() const {return _shared->settled();}
+    inline Awaiter operator co_await() const {return Awaiter(_shared);}
+
+  private:
+    struct Shared {
+      std::optional<T> value;
+      std::exception_ptr error;
+      std::vector<Awaiter*> waiters;
+      std::vector<Awaiter*> resuming;
+      inline bool settled() const {return value.has_value() || error;}
+    };
+
+    inline void wake() {
+      auto shared = _shared; // resumed tasks may drop the last other reference
+      shared->resuming.insert(std::end(shared->resuming),
+                              std::begin(shared->waiters), std::end(shared->waiters));
+      shared->waiters.clear();
+      Task::resume(shared->resuming);
+    }
+
+    std::shared_ptr<Shared> _shared;
+  };
+#endif
+
+#pragma mark - WeakComponent
+  /**
+   * Weak reference to a component for holders that may lock() it while it's
+   * being removed, as UpdateQueue, Scheduler and Animator do. The component
+   * counts the live handles; a background DisposalQueue doesn't hand it to
+   * its worker while any exist. Release the handle as soon as it's no longer
+   * needed so the component can be disposed in the background again.
+   */
+  class WeakComponent {
+  public:
+    WeakComponent() {}
+    WeakComponent(const SharedComponent &component);
+    WeakComponent(const WeakComponent &other) : WeakComponent(other.lock()) {}
+    WeakComponent(WeakComponent &&other) noexcept : _component(std::move(other._component)) {}
+    ~WeakComponent() {reset();}
+
+    inline WeakComponent &operator=(const WeakComponent &other) {
+      if (this != &other) *this = WeakComponent(other);
+      return *this;
+    }
+    inline WeakComponent &operator=(WeakComponent &&other) noexcept {
+      if (this != &other) {
+        reset();
+        _component = std::move(other._component);
+      }
+      return *this;
+    }
+
+    inline SharedComponent lock() const {return _component.lock();}
+    inline bool expired() const {return _component.expired();}
+    inline void reset();
+
+  private:
+    std::weak_ptr<Component> _component;
+  };
+
+#pragma mark - UpdateQueue
+  /**
+   * Defers setState() calls made while this thread is already inside an
+   * update: from render(), componentWillUpdate(), componentDidUpdate() or a
+   * state observer. Deferred updates are applied in order once the outermost
+   * update has committed, so a cascade runs iteratively instead of recursing
+   * through the lifecycle, and a nested update merges into committed state
+   * instead of being overwritten by the render it interrupted.
+   *
+   * A cascade that applies more than the cascade limit of deferred updates
+   * is taken to be a loop: the rest are discarded and std::runtime_error is
+   * thrown. Updates set off by an update that throws, or by a render that
+   * Component::abortWork() discards, are dropped as well.
+   */
+  class UpdateQueue {
+  public:
+    enum : size_t {kDefaultCascadeLimit = 1000};
+
+    struct Stats {
+      uint64_t deferred = 0; // setState() calls queued behind another update
+      uint64_t applied = 0; // deferred updates applied
+      uint64_t aborted = 0; // cascades that exceeded the limit
+      uint64_t expired = 0; // deferred updates dropped with their component
+      uint64_t superseded = 0; // deferred updates dropped for a stale token
+      size_t longestCascade = 0;
+    };
+
+    /**
+     * Marks this thread as inside an update for the lifetime of the batch.
+     */
+    class Batch {
+    public:
+      explicit Batch(UpdateQueue &queue) : _queue(queue) {++_queue._depth;}
+      Batch(const Batch&) = delete;
+      Batch &operator=(const Batch&) = delete;
+      ~Batch() {--_queue._depth;}
+    private:
+      UpdateQueue &_queue;
+    };
+
+    UpdateQueue() {active() = this;}
+    UpdateQueue(const UpdateQueue&) = delete;
+    UpdateQueue &operator=(const UpdateQueue&) = delete;
+    ~UpdateQueue() {active() = nullptr;}
+
+    /**
+     * @returns this thread's queue
+     */
+    static inline UpdateQueue &current() {
+      static thread_local UpdateQueue queue;
+      return queue;
+    }
+    /**
+     * @returns this thread's queue, or nullptr if it isn't constructed yet
+     * or is already destroyed
+     */
+    static inline UpdateQueue *&active() {
+      static thread_local UpdateQueue *queue = nullptr;
+      return queue;
+    }
+
+    /**
+     * @returns whether setState() would be deferred
+     */
+    inline bool busy() const {return _depth > 0 || _draining;}
+    inline size_t size() const {return _updates.size();}
+
+    inline void setCascadeLimit(size_t limit) {_limit = limit;}
+    inline size_t getCascadeLimit() const {return _limit;}
+    inline const Stats &getStats() const {return _stats;}
+
+  private:
+    friend class Component;
+    friend class RenderPool;
+
+    struct Update {
+      // Components owned by a shared_ptr can be destroyed on another thread,
+      // e.g. by a background DisposalQueue, so they're only weakly referenced
+      WeakComponent owner;
+      Component *component; // used directly only if it isn't shared
+      bool shared;
+      State nextState;
+      ReturnedUpdateCb updateCb; // evaluated when applied, if set
+      UpdateCb cb;
+      UpdateToken token; // checked again when applied
+    };
+
+    inline void clear() {_updates.clear();}
+    /**
+     * Moves the updates queued on another thread's queue behind this one's.
+     */
+    inline void adopt(UpdateQueue &other) {
+      for (auto &update : other._updates) _updates.push_back(std::move(update));
+      other.clear();
+    }
+    inline void push(Component &component,
+                     const State &nextState,
+                     const ReturnedUpdateCb &updateCb,
+                     const UpdateCb &cb,
+                     const UpdateToken &token = UpdateToken());
+    /**
+     * Drops the updates queued for a component destroyed on this thread.
+     */
+    inline void forget(const Component *component) {
+      _updates.erase(std::remove_if(std::begin(_updates), std::end(_updates),
+                                    [component](const Update &update) {
+                                      return update.component == component;
+                                    }),
+                     std::end(_updates));
+    }
+    /**
+     * Applies queued updates, and the ones they queue in turn, until none
+     * are left. Does nothing inside an update; the outermost one drains.
+     *
+     * @throws std::runtime_error if the cascade exceeds the limit
+     */
+    inline void drain();
+
+    std::deque<Update> _updates;
+    size_t _depth = 0;
+    bool _draining = false;
+    size_t _limit = kDefaultCascadeLimit;
+    Stats _stats;
+  };
+
+#pragma mark - Component
+  class Component : public std::enable_shared_from_this<Component> {
+  public:
+    Component() : Component("", Props(), NodeList()){}
+    Component(Key key,
+              Props props,
+              NodeList children) :
+    _key(std::move(key)), _props(PropsPool::share(std::move(props))),
+    _propsPoolId(PropsPool::currentId()) {
+      addChildren(std::move(children));
+    } // componentDidMount()
+    Component(Key key,
+              SharedProps props,
+              NodeList children) :
+    _key(std::move(key)), _props(props ? std::move(props) : PropsPool::share(Props())) {
+      addChildren(std::move(children));
+    } // componentDidMount()
+    virtual ~Component() { // componentWillUnmount()
+#ifdef JGOD_REACTIVE_COROUTINES
+      releaseTasks();
+#endif
+      // Tear the subtree down iteratively: descendants nothing else references
+      // are emptied before they are destroyed, so deep chains don't recurse.
+      NodeList stack;
+      stack.swap(_children);
+      for (auto &child : stack) {
+        if (child && child->_parent == this) child->_parent = nullptr;
+      }
+      while (!stack.empty()) {
+        auto component = std::move(stack.back());
+        stack.pop_back();
+        if (!component || component.use_count() != 1) continue;
+        for (auto &child : component->_children) {
+          if (!child) continue;
+          if (child->_parent == component.get()) child->_parent = nullptr;
+          stack.push_back(std::move(child));
+        }
+        component->_children.clear();
+      }
+      if (auto published = _published.exchange(nullptr)) {
+        StateEpoch::global().retire(published);
+      }
+      if (auto queue = UpdateQueue::active()) {
+        if (queue->size()) queue->forget(this);
+      }
+    }
+
+#pragma mark - Updating
+    ////////////////////////////////////////////////////////////////////////////////////
+    /**
+     * Invoked before rendering when new props or state are being received.
+     * This method is not called for the initial render or when forceUpdate is used.
+     * Use this as an opportunity to return false when you're certain that the
+     * transition to the new props and state will not require a component update.
+     *
+     * If shouldComponentUpdate returns false, then render() will be completely
+     * skipped until the next state change.
+     * In addition, componentWillUpdate and componentDidUpdate will not be called.
+     *
+     * By default, shouldComponentUpdate always returns true to prevent subtle bugs
+     * when state is mutated in place, but if you are careful to always treat state
+     * as immutable and to read only from props and state in render() then you can
+     * override shouldComponentUpdate with an implementation that compares the old
+     * props and state to their replacements.
+     *
+     * If performance is a bottleneck, especially with dozens or hundreds of components,
+     * use shouldComponentUpdate to speed up your app.
+     *
+     * @param[in] nextProps
+     * @param[in] nextState
+     * @returns bool
+     * @see https://facebook.github.io/react/docs/component-specs.html#updating-shouldcomponentupdate
+     */
+    virtual bool shouldComponentUpdate(const Props&, const State&) {return true;}
+
+    /**
+     * Invoked immediately before rendering when new props or state are being received.
+     * This method is not called for the initial render.
+     * Use this as an opportunity to perform preparation before an update occurs.
+     * A render discarded by abortWork() isn't followed by componentDidUpdate().
+     *
+     * @param[in] nextProps
+     * @param[in] nextState
+     * @see https://facebook.github.io/react/docs/component-specs.html#updating-componentwillupdate
+     */
+    virtual void componentWillUpdate(const Props&, const State&){}
+
+    /**
+     * Invoked immediately after the component's updates are flushed to the DOM.
+     * This method is not called for the initial render.
+     * Use this as an opportunity to operate on the DOM when the component has been updated.
+     *
+     * @param[in] prevProps
+     * @param[in] prevState
+     * @see https://facebook.github.io/react/docs/component-specs.html#updating-componentdidupdate
+     */
+    virtual void componentDidUpdate(const Props&, const State&){}
+
+    inline void forceUpdate() {render(true);}
+    ////////////////////////////////////////////////////////////////////////////
+
+#pragma mark - State
+    ////////////////////////////////////////////////////////////////////////////
+    /**
+     * Performs a shallow merge of nextState into current state.
+     * This is the primary method you use to trigger UI updates from event handlers
+     * and server request callbacks.
+     * Work left by prepareState() is committed along with it.
+     * Called during another update on this thread, the merge is deferred
+     * until that update commits; see UpdateQueue.
+     *
+     * @param[in] nextState
+     * @param[in] cb(prevState, currentProps)
+     * @throws std::runtime_error if the updates it sets off exceed the
+     * cascade limit
+     * @see https://facebook.github.io/react/docs/component-api.html#setstate
+     */
+    inline void setState(const State &nextState,
+                         const UpdateCb &cb = [](const State&,
+                                                 const Props&){}) {
+      auto &queue = UpdateQueue::current();
+      if (queue.busy()) {
+        queue.push(*this, nextState, nullptr, cb);
+        return;
+      }
+      try {
+        UpdateQueue::Batch batch(queue);
+        applyState(nextState, cb);
+      } catch (...) {
+        queue.clear(); // updates a failed update set off go with it
+        throw;
+      }
+      queue.drain();
+    }
+    /**
+     * Performs a shallow merge of nextState into current state.
+     * This is the primary method you use to trigger UI updates from event handlers
+     * and server request callbacks.
+     *
+     * @see https://facebook.github.io/react/docs/component-api.html#setstate
+     */
+    inline void setState(const ReturnedUpdateCb &updateCb,
+                         const UpdateCb &cb = [](const State&, const Props&){}) {
+      auto &queue = UpdateQueue::current();
+      if (queue.busy()) {
+        // Deferred updaters see the state committed before them
+        queue.push(*this, State(), updateCb, cb);
+        return;
+      }
+      setState(updateCb(*_state, *_props), cb);
+    }
+
+    /**
+     * Starts a request on channel, superseding the requests started on it
+     * before. Pass the token to setStateIfCurrent() or Scheduler::schedule()
+     * when the response arrives so a slow, stale response can't overwrite a
+     * newer one. Call on the thread that owns this component.
+     *
+     * @param[in] channel
+     * @returns a token for the new request
+     */
+    inline UpdateToken beginUpdate(const std::string &channel = "") {
+      UpdateToken token;
+      token.channel = channel;
+      token.generation = ++generation(channel);
+      return token;
+    }
+    /**
+     * @returns whether no later beginUpdate() or cancelUpdates() superseded token
+     */
+    inline bool isCurrent(const UpdateToken &token) const {
+      if (token.generation == 0) return true;
+      for (auto &channel : _generations) {
+        if (channel.first == token.channel) return channel.second == token.generation;
+      }
+      return false;
+    }
+    /**
+     * Supersedes every token issued so far.
+     */
+    inline void cancelUpdates() {
+      for (auto &channel : _generations) ++channel.second;
+    }
+    /**
+     * setState() for the response to the request token was issued for.
+     *
+     * @param[in] token
+     * @param[in] nextState
+     * @param[in] cb(prevState, currentProps)
+     * @returns false, without merging nextState or calling cb, if token was superseded;
+     * deferred during another update, it is dropped if token is superseded
+     * before it applies
+     */
+    inline bool setStateIfCurrent(const UpdateToken &token,
+                                  const State &nextState,
+                                  const UpdateCb &cb = [](const State&,
+                                                          const Props&){}) {
+      if (!isCurrent(token)) return false;
+      auto &queue = UpdateQueue::current();
+      if (queue.busy()) {
+        queue.push(*this, nextState, nullptr, cb, token);
+        return true;
+      }
+      setState(nextState, cb);
+      return true;
+    }
+
+    /**
+     * Render phase of setState(): shallowly merges nextState into a
+     * work-in-progress copy of the state and, if shouldComponentUpdate()
+     * agrees, runs componentWillUpdate() and renders it. While render() runs,
+     * getState() and setRendered() use the work in progress; the visible
+     * state, output and version, the observers and componentDidUpdate() are
+     * untouched, so the work can be abandoned with abortWork() or extended by
+     * calling this again.
+     *
+     * A non-empty nextState whose every key already holds the same value is
+     * a no-op: nothing is merged or rendered and shouldComponentUpdate() isn't
+     * asked, so repeating an update doesn't cost a render or notify observers.
+     *
+     * @param[in] nextState
+     * @returns whether render() ran; false when the render cache had its output
+     */
+    inline bool prepareState(const State &nextState) {
+      if (isNoOp(nextState)) return false;
+      if (!_work) {
+        _work.reset(new Work());
+        _work->rendered = _rendered;
+      }
+      auto &work = *_work;
+      auto newState = std::make_shared<State>(work.state ? *work.state : *_state);
+      for (auto it = std::begin(nextState); it != std::end(nextState); ++it) {
+        (*newState)[it.key()] = it.value();
+        work.partial[it.key()] = it.value();
+      }
+      work.state = std::move(newState);
+      return renderWork();
+    }
+
+    /**
+     * @returns whether prepareState() left work for commitWork()
+     */
+    inline bool hasPendingWork() const {return static_cast<bool>(_work);}
+
+    /**
+     * Discards the work in progress, along with the updates its render set
+     * off; rendering it again sets them off again.
+     */
+    inline void abortWork() {
+      _work.reset();
+      auto &queue = UpdateQueue::current();
+      if (!queue.busy()) queue.clear();
+    }
+
+    /**
+     * Commit phase of setState(): applies the work in progress, then runs
+     * componentDidUpdate() and the state observers.
+     * Updates they set off, or render() set off while preparing the work,
+     * are applied afterwards.
+     */
+    inline void commitWork() {
+      if (!_work) return;
+      auto &queue = UpdateQueue::current();
+      try {
+        UpdateQueue::Batch batch(queue);
+        commitLifecycle();
+      } catch (...) {
+        queue.clear();
+        throw;
+      }
+      queue.drain();
+    }
+    ////////////////////////////////////////////////////////////////////////////
+
+#ifdef JGOD_REACTIVE_COROUTINES
+#pragma mark - Tasks
+    /**
+     * Adopts task, which is cancelled when this component is removed from its
+     * parent, recycled or destroyed. Spawning under a non-empty slot cancels
+     * the task spawned under that slot before, so a newer request supersedes
+     * a stale one. A task must not remove or destroy its own component, and
+     * one holding a SharedComponent to it keeps it alive until it finishes.
+     *
+     * @param[in] task
+     * @param[in] slot
+     * @throws what task threw before it first suspended
+     */
+    inline void spawn(Task task, const std::string &slot = "") {
+      if (task._handle && task._handle.promise().exception) {
+        std::rethrow_exception(task._handle.promise().exception);
+      }
+      if (!slot.empty()) {
+        for (auto &running : _tasks) {
+          if (running.first == slot) running.second.cancel();
+        }
+      }
+      pruneTasks();
+      if (task.done()) return;
+      task._handle.promise().owner = this;
+      _tasks.emplace_back(slot, std::move(task));
+    }
+    /**
+     * Drops finished and cancelled tasks.
+     */
+    inline void pruneTasks() {
+      _tasks.erase(std::remove_if(std::begin(_tasks), std::end(_tasks),
+                                  [](const std::pair<std::string, Task> &task) {
+                                    return task.second.done();
+                                  }),
+                   std::end(_tasks));
+    }
+    inline void cancelTasks() {
+      auto tasks = std::move(_tasks);
+      _tasks.clear();
+    }
+    /**
+     * Cancels tasks and lets go of tasks awaiting this component's next
+     * commit, which then stay suspended until they're cancelled.
+     */
+    inline void releaseTasks() {
+      cancelTasks();
+      for (auto waiters : {&_commitWaiters, &_resuming}) {
+        for (auto waiter : *waiters) waiter->_component = nullptr;
+        waiters->clear();
+      }
+    }
+    inline size_t runningTasks() const {
+      size_t count = 0;
+      for (auto &task : _tasks) {if (!task.second.done()) ++count;}
+      return count;
+    }
+
+    /**
+     * Suspends a Task until commitWork() next applies an update to this
+     * component. If the component is destroyed first, the task stays
+     * suspended until it's cancelled.
+     */
+    class CommitAwaiter {
+    public:
+      explicit CommitAwaiter(Component &component) : _component(&component) {}
+      CommitAwaiter(const CommitAwaiter&) = delete;
+      CommitAwaiter &operator=(const CommitAwaiter&) = delete;
+      ~CommitAwaiter() {
+        // Cancelled while suspended
+        if (_handle && _component) {
+          for (auto waiters : {&_component->_commitWaiters, &_component->_resuming}) {
+            waiters->erase(std::remove(std::begin(*waiters), std::end(*waiters), this),
+                           std::end(*waiters));
+          }
+        }
+      }
+      inline bool await_ready() const {return false;}
+      inline void await_suspend(Task::Handle handle) {
+        _handle = handle;
+        _component->_commitWaiters.push_back(this);
+      }
+      /**
+       * @returns the committed state
+       */
+      inline SharedState await_resume() {return _component->_state;}
+    private:
+      friend class Component;
+      friend class Task;
+      Component *_component;
+      Task::Handle _handle;
+    };
+    inline CommitAwaiter nextCommit() {return CommitAwaiter(*this);}
+#endif
+
+#pragma mark - Observers
+    /**
+     * Observers see setState() on this component and all of its descendants.
+     */
+    inline void addStateObserver(SharedStateObserver const observer) {
+      if (observer) _observers.push_back(observer);
+    }
+    inline void removeStateObserver(SharedStateObserver const observer) {
+      _observers.erase(std::remove(std::begin(_observers),
+                                   std::end(_observers),
+                                   observer),
+                       std::end(_observers));
+    }
+
+#pragma mark - Rendering
+    virtual void render(bool force = false) = 0;
+
+    /**
+     * Output of the last render(), for components that render to a value.
+     * render() publishes it with setRendered(); it's what RenderCache stores.
+     */
+    inline const JSON &getRendered() const {return _rendering ? _rendering->rendered : _rendered;}
+
+    /**
+     * Opts into memoized rendering: when setState() produces a (props, state)
+     * combination already in cache, the stored output is reused and the
+     * update lifecycle is skipped: shouldComponentUpdate(), componentWillUpdate(),
+     * render() and componentDidUpdate() don't run. State observers still do.
+     * Which hooks run therefore depends on what the cache holds.
+     * Only use this for components whose render() is a pure function of props
+     * and state that publishes its result through setRendered().
+     */
+    inline void setRenderCache(SharedRenderCache const cache) {_renderCache = cache;}
+    inline const SharedRenderCache &getRenderCache() const {return _renderCache;}
+
+    /**
+     * Lets RenderPool render this component and its subtree on a worker
+     * thread. Only return true if render(), shouldComponentUpdate() and
+     * componentWillUpdate() touch nothing but this component's own props,
+     * state and rendered output.
+     */
+    virtual bool isParallelSafe() const {return false;}
+
+#pragma mark - Children
+    inline void addChild(SharedComponent const component) {
+      if (!component) return;
+      // Don't allow duplicates.
+      auto it = std::find_if(std::begin(_children),
+                             std::end(_children),
+                             [&](const SharedComponent &c) {
+        return (c && c->getKey() == component->getKey());
+      });
+      component->setParent(this);
+      if (it == std::end(_children)) {
+        _children.push_back(component);
+      } else {
+        auto replaced = std::move(*it);
+        *it = component;
+        // Adding a mounted child again leaves it mounted
+        if (replaced != component) release(replaced, findDisposalQueue());
+      }
+      invalidateHash();
+    }
+    inline void addChildren(NodeList components) {
+      if (components.empty()) return;
+      _children.reserve(_children.size() + components.size());
+      if (_children.size() + components.size() < kIndexedAddThreshold) {
+        for (auto &child : components) {addChild(child);}
+        return;
+      }
+      invalidateHash();
+      ChildIndex index(_children, _children.size() + components.size());
+      for (auto &child : components) {
+        if (!child) continue;
+        auto &key = child->getKey();
+        auto hash = key.hash();
+        auto &slot = index.slot(key, hash);
+        child->setParent(this);
+        if (!slot.second) {
+          slot = {hash, _children.size() + 1};
+          _children.push_back(std::move(child));
+        } else {
+          auto replaced = std::move(_children[slot.second - 1]);
+          auto same = replaced == child;
+          _children[slot.second - 1] = std::move(child);
+          if (!same) release(replaced, findDisposalQueue());
+        }
+      }
+    }
+    inline void removeChild(const SharedComponent &component) {
+      if (!component) return;
+      removeChild(component->getKey());
+    }
+    inline void removeChild(const Key &key) {
+      if (_children.empty()) return;
+      NodeList removed;
+      auto kept = std::begin(_children);
+      for (auto &c : _children) {
+        if (c && c->getKey() == key) {
+          removed.push_back(std::move(c));
+        } else {
+          *kept++ = std::move(c);
+        }
+      }
+      _children.erase(kept, std::end(_children));
+      invalidateHash();
+      auto disposal = findDisposalQueue();
+      for (auto &c : removed) {release(c, disposal);}
+    }
+    inline void removeChildren() {
+      NodeList removed;
+      removed.swap(_children);
+      invalidateHash();
+      auto disposal = findDisposalQueue();
+      for (auto &c : removed) {release(c, disposal);}
+    }
+
+    /**
+     * Defers destruction of children removed from this subtree to queue.
+     */
+    inline void setDisposalQueue(SharedDisposalQueue const queue) {_disposal = queue;}
+    inline const SharedDisposalQueue &getDisposalQueue() const {return _disposal;}
+
+#pragma mark - Props
+    /**
+     * Replaces props, keeping the key, state, children and render output, as
+     * a parent passing new props would. Equal props are left alone, so the
+     * subtree hash stays valid. Nothing renders until the next render pass.
+     */
+    inline void setProps(Props props) {
+      if (*_props == props) return;
+      _props = PropsPool::share(std::move(props));
+      _propsPoolId = PropsPool::currentId();
+      _propsHashValid = false;
+      invalidateHash();
+    }
+
+#pragma mark - Recycling
+    /**
+     * Invoked before a component is reused for a new key by recycle().
+     * Use this as an opportunity to reset members of derived classes.
+     */
+    virtual void componentWillRecycle() {}
+
+    /**
+     * Resets this component under a new key and props, so an instance that
+     * scrolled out of view can stand in for a new one in the same place.
+     * State, render output and children are cleared; state observers, the
+     * disposal queue and the render cache are kept, as VirtualList relies on.
+     * Instances reused from a ComponentPool lost their observers and disposal
+     * queue when pooled.
+     */
+    inline void recycle(Key key, Props props) {
+      auto poolId = PropsPool::currentId();
+      recycle(std::move(key), PropsPool::share(std::move(props)));
+      _propsPoolId = poolId;
+    }
+    /**
+     * recycle() with props shared with other components instead of copied.
+     */
+    inline void recycle(Key key, SharedProps props) {
+      componentWillRecycle();
+      _key = std::move(key);
+      _props = props ? std::move(props) : PropsPool::share(Props());
+      _propsPoolId = 0;
+      _work.reset();
+      cancelUpdates();
+#ifdef JGOD_REACTIVE_COROUTINES
+      cancelTasks();
+#endif
+      commitState(emptyState());
+      _rendered = JSON();
+      _children.clear();
+      _propsHashValid = false;
+      invalidateHash();
+    }
+
+#pragma mark - Hashing
+    /**
+     * Merkle hash of this component's key, props, state and children's subtree
+     * hashes. Cached and recomputed only along paths invalidated by setState(),
+     * addChild() or removeChild(), so comparing two subtrees is O(1) once hashed.
+     */
+    inline uint64_t subtreeHash() const {
+      // Post-order over the invalid part of the subtree, with an explicit stack.
+      std::vector<std::pair<const Component*, size_t>> stack;
+      if (!_hashValid) stack.emplace_back(this, 0);
+      while (!stack.empty()) {
+        auto &top = stack.back();
+        const auto &children = top.first->_children;
+        while (top.second < children.size() &&
+               (!children[top.second] || children[top.second]->_hashValid)) {
+          ++top.second;
+        }
+        if (top.second < children.size()) {
+          auto child = children[top.second++].get();
+          stack.emplace_back(child, 0);
+          continue;
+        }
+        auto component = top.first;
+        uint64_t h = component->nodeHash();
+        for (auto &child : children) {
+          if (child) h = Hash::combine(h, child->_hash);
+        }
+        component->_hash = Hash::combine(h, children.size());
+        component->_hashValid = true;
+        stack.pop_back();
+      }
+      return _hash;
+    }
+    /**
+     * Hash of this component's key, props and state, excluding children.
+     */
+    inline uint64_t nodeHash() const {
+      return Hash::combine(Hash::combine(_key.hash(), propsHash()),
+                           Hash::json(*_state));
+    }
+
+#pragma mark - Getters and Setters
+    // Props shouldn't be modified directly!
+    inline const Props &getProps() const {return *_props;}
+    inline const SharedProps &getSharedProps() const {return _props;}
+    /**
+     * O(1) when both components' props were interned by the same PropsPool,
+     * as then only identical pointers are equal; otherwise props that aren't
+     * shared are compared deeply.
+     */
+    inline bool hasSameProps(const Component &other) const {
+      if (_props == other._props) return true;
+      if (_propsPoolId != 0 && _propsPoolId == other._propsPoolId) return false;
+      return *_props == *other._props;
+    }
+    inline const Key &getKey() const {return _key;}
+    // State shouldn't be modified directly!
+    // The reference is valid until the next state change; use getSharedState()
+    // to keep a snapshot.
+    inline const State &getState() const {return _rendering ? *_rendering->state : *_state;}
+    /**
+     * @returns the current state, immutable and O(1) to keep
+     */
+    inline const SharedState &getSharedState() const {return _state;}
+    /**
+     * @returns a number that increases every time this component's state
+     * changes, so consumers can detect changes without comparing states
+     */
+    inline uint64_t getStateVersion() const {return _stateVersion;}
+    /**
+     * Safe to call from any thread while another one runs setState(), without
+     * locking; the caller must keep the component itself alive.
+     *
+     * @returns the latest committed state and its version
+     */
+    inline PublishedState loadState() const {
+      StateEpoch::Guard guard;
+      auto published = _published.load();
+      return published ? *published : PublishedState{emptyState(), 0};
+    }
+    inline const NodeList &getChildren() const {return _children;}
+    inline SharedComponent getChild(const Key &key) const {
+      for (auto &child : _children) {
+        if (child && child->getKey() == key) return child;
+      }
+      return nullptr;
+    }
+    /**
+     * @param[in] root to stop at; the topmost ancestor if null
+     * @returns JSON array of keys from root down to this component
+     */
+    inline JSON getKeyPath(const Component *root = nullptr) const {
+      std::vector<const Key*> keys;
+      for (const Component *c = this; c; c = c->_parent) {
+        keys.push_back(&c->_key);
+        if (c == root) break;
+      }
+      JSON path = JSON::array();
+      for (auto it = keys.rbegin(); it != keys.rend(); ++it) {path.push_back((*it)->toJSON());}
+      return path;
+    }
+    /**
+     * Inverse of getKeyPath(), starting at this component.
+     * @returns the component at path, or nullptr if there is none
+     */
+    inline Component *findByKeyPath(const JSON &path) {
+      if (!path.is_array() || path.empty() || Key::fromJSON(path[0]) != _key) return nullptr;
+      Component *component = this;
+      for (size_t i = 1; i < path.size() && component; ++i) {
+        component = component->getChild(Key::fromJSON(path[i])).get();
+      }
+      return component;
+    }
+    inline Component* const getParent() const {return _parent;}
+    inline void setParent(Component* const parent) {_parent = parent;}
+
+  protected:
+    static const size_t kIndexedAddThreshold = 32;
+
+    /**
+     * Index of a child list's keys, for matching many keys against wide lists
+     * instead of scanning for every one: a flat open-addressing table of
+     * (key hash, child index + 1).
+     */
+    class ChildIndex {
+    public:
+      /**
+       * @param[in] children to index; must outlive the index
+       * @param[in] expected how many children it will hold
+       */
+      ChildIndex(const NodeList &children, size_t expected) : _children(children) {
+        size_t capacity = 64;
+        while (capacity < 2 * expected) capacity *= 2;
+        _slots.assign(capacity, {0, 0});
+        _mask = capacity - 1;
+        for (size_t i = 0; i < children.size(); ++i) {
+          if (!children[i]) continue;
+          auto &key = children[i]->getKey();
+          auto hash = key.hash();
+          slot(key, hash) = {hash, i + 1};
+        }
+      }
+      /**
+       * @returns key's slot, whose index is 0 if key isn't indexed; fill it in
+       * when adding a child
+       */
+      inline std::pair<uint64_t, size_t> &slot(const Key &key, uint64_t hash) {
+        auto i = hash & _mask;
+        while (_slots[i].second && (_slots[i].first != hash ||
+                                    _children[_slots[i].second - 1]->getKey() != key)) {
+          i = (i + 1) & _mask;
+        }
+        return _slots[i];
+      }
+    private:
+      const NodeList &_children;
+      std::vector<std::pair<uint64_t, size_t>> _slots;
+      size_t _mask;
+    };
+
+    inline void setRendered(JSON output) {
+      (_rendering ? _rendering->rendered : _rendered) = std::move(output);
+    }
+
+    /**
+     * Ancestors of an invalid hash are always invalid, so this stops early.
+     */
+    inline void invalidateHash() {
+      for (Component *c = this; c && c->_hashValid; c = c->_parent) {
+        c->_hashValid = false;
+      }
+    }
+
+    Key _key = ""; // string | boolean | number | null; primary key
+    NodeList _children;
+    Component *_parent = nullptr;
+
+  private:
+    friend class Snapshot;
+    friend class WriteAheadLog;
+    friend class TreeSync;
+    friend class ComponentPool;
+    friend class DisposalQueue;
+    friend class UpdateQueue;
+    friend class RenderPool;
+    friend class VirtualList;
+    friend class WeakComponent;
+
+    /**
+     * Detaches a child dropped from _children and hands it to its pool, or
+     * failing that to disposal, if any. Pooled components' children are
+     * released the same way.
+     */
+    inline void release(SharedComponent &child, DisposalQueue *disposal) {
+      if (!child) return;
+      if (child->_parent == this) child->_parent = nullptr;
+      NodeList work;
+      work.push_back(std::move(child));
+      while (!work.empty()) {
+        auto component = std::move(work.back());
+        work.pop_back();
+#ifdef JGOD_REACTIVE_COROUTINES
+        component->cancelTasks();
+#endif
+        auto pool = component->_pool.lock();
+        if (pool && pool->release(component, work)) continue;
+        if (disposal) disposal->push(std::move(component));
+      }
+    }
+    inline DisposalQueue *findDisposalQueue() const {
+      for (const Component *c = this; c; c = c->_parent) {
+        if (c->_disposal) return c->_disposal.get();
+      }
+      return nullptr;
+    }
+
+    /**
+     * Work in progress between prepareState() and commitWork().
+     */
+    struct Work {
+      SharedState state;
+      State partial; // merged partial states, for observers
+      JSON rendered;
+      bool updated = false; // rendered since the last commit
+      bool cached = false; // output taken from the render cache since
+    };
+
+    inline bool isNoOp(const State &nextState) const {
+      if (!nextState.is_object() || nextState.empty()) return false;
+      auto &base = _work && _work->state ? *_work->state : *_state;
+      for (auto it = std::begin(nextState); it != std::end(nextState); ++it) {
+        auto found = base.find(it.key());
+        if (found == std::end(base) || *found != it.value()) return false;
+      }
+      return true;
+    }
+    inline uint64_t &generation(const std::string &channel) {
+      for (auto &entry : _generations) {
+        if (entry.first == channel) return entry.second;
+      }
+      _generations.emplace_back(channel, 0);
+      return _generations.back().second;
+    }
+
+    inline void applyState(const State &nextState, const UpdateCb &cb) {
+      auto prevState = _state;
+      try {
+        prepareState(nextState);
+      } catch (...) {
+        abortWork(); // a failed render leaves the visible state as it was
+        throw;
+      }
+      commitWork();
+      cb(*prevState, *_props);
+    }
+    inline bool renderWork() {
+      auto &work = *_work;
+      uint64_t fingerprint = 0;
+      if (_renderCache) {
+        fingerprint = renderFingerprint(*work.state);
+        if (auto output = _renderCache->find(fingerprint)) {
+          // Same (props, state) rendered before: skip the lifecycle entirely.
+          work.rendered = *output;
+          work.cached = true;
+          return false;
+        }
+      }
+      if (!shouldComponentUpdate(*_props, *work.state)) return false;
+      UpdateQueue::Batch batch(UpdateQueue::current());
+      componentWillUpdate(*_props, *work.state);
+      _rendering = &work;
+      try {
+        render(true);
+      } catch (...) {
+        _rendering = nullptr;
+        throw;
+      }
+      _rendering = nullptr;
+      work.updated = true;
+      work.cached = false;
+      if (_renderCache) _renderCache->insert(fingerprint, work.rendered);
+      return true;
+    }
+    /**
+     * Render phase of a RenderPool pass: renders the work in progress, or the
+     * current state, into work for commitWork(). Unless force is set,
+     * shouldComponentUpdate() may decline.
+     *
+     * @returns whether render() ran
+     */
+    inline bool prepareRender(bool force) {
+      auto &state = _work && _work->state ? *_work->state : *_state;
+      if (!force && !shouldComponentUpdate(*_props, state)) return false;
+      if (!_work) {
+        _work.reset(new Work());
+        _work->rendered = _rendered;
+      }
+      if (!_work->state) _work->state = _state;
+      UpdateQueue::Batch batch(UpdateQueue::current());
+      componentWillUpdate(*_props, *_work->state);
+      _rendering = _work.get();
+      try {
+        render(force);
+      } catch (...) {
+        _rendering = nullptr;
+        throw;
+      }
+      _rendering = nullptr;
+      _work->updated = true;
+      return true;
+    }
+    inline void commitLifecycle() {
+      std::unique_ptr<Work> work(std::move(_work));
+      auto prevState = _state;
+      auto changed = work->state != _state; // else only rendered
+      _rendered = std::move(work->rendered);
+      if (changed) commitState(std::move(work->state));
+      if (work->updated && !work->cached) componentDidUpdate(*_props, *prevState);
+      invalidateHash();
+      if (changed) notifyStateObservers(work->partial, *prevState);
+#ifdef JGOD_REACTIVE_COROUTINES
+      if (changed && !_commitWaiters.empty()) {
+        _resuming.insert(std::end(_resuming), std::begin(_commitWaiters), std::end(_commitWaiters));
+        _commitWaiters.clear();
+        Task::resume(_resuming);
+      }
+#endif
+    }
+
+    inline void commitState(SharedState state) {
+      _state = std::move(state);
+      ++_stateVersion;
+      auto &epoch = StateEpoch::global();
+      auto published = _published.exchange(epoch.publish(_state, _stateVersion));
+      if (published) epoch.retire(published);
+    }
+    static inline const SharedState &emptyState() {
+      static const SharedState empty = std::make_shared<const State>();
+      return empty;
+    }
+    inline uint64_t propsHash() const {
+      if (!_propsHashValid) {
+        _propsHash = Hash::json(*_props);
+        _propsHashValid = true;
+      }
+      return _propsHash;
+    }
+    inline uint64_t renderFingerprint(const State &state) const {
+      return Hash::combine(Hash::combine(typeid(*this).hash_code(), propsHash()),
+                           Hash::json(state));
+    }
+
+    inline void notifyStateObservers(const State &partialState,
+                                     const State &prevState) {
+      for (Component *c = this; c; c = c->_parent) {
+        for (auto &observer : c->_observers) {
+          observer->componentDidSetState(*this, partialState, prevState);
+        }
+      }
+    }
+
+    // Read through getProps() and getState(), which also see the work in
+    // progress while render() runs.
+    SharedProps _props; // Use for static properties; immutable, possibly shared
+    SharedState _state = emptyState(); // Use for dynamic properties; copy-on-write
+    std::vector<SharedStateObserver> _observers;
+    SharedRenderCache _renderCache;
+    JSON _rendered;
+    std::weak_ptr<ComponentPool> _pool;
+    SharedDisposalQueue _disposal;
+    uint64_t _stateVersion = 0;
+    std::vector<std::pair<std::string, uint64_t>> _generations; // per beginUpdate() channel
+    std::unique_ptr<Work> _work;
+    Work *_rendering = nullptr; // work render() is filling in, if any
+#ifdef JGOD_REACTIVE_COROUTINES
+    std::vector<std::pair<std::string, Task>> _tasks;
+    std::vector<CommitAwaiter*> _commitWaiters;
+    std::vector<CommitAwaiter*> _resuming; // being resumed by commitWork()
+#endif
+    std::atomic<const PublishedState*> _published{nullptr};
+    std::atomic<size_t> _weakHandles{0}; // live WeakComponents
+    mutable uint64_t _hash = 0;
+    mutable uint64_t _propsHash = 0;
+    uint64_t _propsPoolId = 0; // PropsPool::id() of the pool that interned _props
+    mutable bool _hashValid = false;
+    mutable bool _propsHashValid = false;
+  };
+
+#pragma mark - WeakComponent
+  inline WeakComponent::WeakComponent(const SharedComponent &component) : _component(component) {
+    if (component) ++component->_weakHandles;
+  }
+
+  inline void WeakComponent::reset() {
+    if (auto component = _component.lock()) --component->_weakHandles;
+    _component.reset();
+  }
+
+#pragma mark - UpdateQueue
+  inline void UpdateQueue::push(Component &component,
+                                const State &nextState,
+                                const ReturnedUpdateCb &updateCb,
+                                const UpdateCb &cb,
+                                const UpdateToken &token) {
+    Update update;
+    try { // throws for components not owned by a shared_ptr
+      update.owner = WeakComponent(component.shared_from_this());
+      update.shared = true;
+    } catch (const std::bad_weak_ptr&) {
+      update.shared = false;
+    }
+    update.component = &component;
+    update.nextState = nextState;
+    update.updateCb = updateCb;
+    update.cb = cb;
+    update.token = token;
+    _updates.push_back(std::move(update));
+    ++_stats.deferred;
+  }
+
+  inline void UpdateQueue::drain() {
+    if (busy() || _updates.empty()) return;
+    _draining = true;
+    size_t cascade = 0;
+    try {
+      while (!_updates.empty()) {
+        auto update = std::move(_updates.front());
+        _updates.pop_front();
+        auto owner = update.owner.lock(); // keeps it alive while it updates
+        if (update.shared && !owner) {
+          ++_stats.expired;
+          continue;
+        }
+        if (!update.component->isCurrent(update.token)) {
+          ++_stats.superseded;
+          continue;
+        }
+        if (cascade == _limit) {
+          auto key = update.component->getKey().str();
+          clear();
+          ++_stats.aborted;
+          throw std::runtime_error("update cascade exceeded " + std::to_string(_limit) +
+                                   " updates at component \"" + key + "\"");
+        }
+        ++cascade;
+        ++_stats.applied;
+        _stats.longestCascade = std::max(_stats.longestCascade, cascade);
+        auto &component = *update.component;
+        auto nextState = update.updateCb ? update.updateCb(*component._state, *component._props)
+                                         : std::move(update.nextState);
+        component.applyState(nextState, update.cb);
+      }
+    } catch (...) {
+      clear(); // the rest of a failed cascade would apply to half-updated state
+      _draining = false;
+      throw;
+    }
+    _draining = false;
+  }
+
+#ifdef JGOD_REACTIVE_COROUTINES
+  template<class Awaiter>
+  inline void Task::resume(std::vector<Awaiter*> &queue) {
+    std::exception_ptr error;
+    while (!queue.empty()) {
+      auto awaiter = queue.front();
+      queue.erase(std::begin(queue));
+      auto handle = awaiter->_handle;
+      awaiter->_handle = nullptr;
+      handle.resume();
+      if (!handle.done()) continue;
+      if (handle.promise().exception && !error) error = handle.promise().exception;
+      if (auto owner = handle.promise().owner) owner->pruneTasks();
+    }
+    if (error) std::rethrow_exception(error);
+  }
+#endif
+
+#pragma mark - Traversal
+  /**
+   * Non-recursive traversals of a component and its descendants, driven by
+   * explicit stacks (or a queue), so tree depth isn't limited by the call stack.
+   *
+   *   for (auto &component : preOrder(*root)) {...}
+   *
+   * Adding or removing children of visited components while iterating
+   * invalidates the traversal.
+   */
+  class ComponentIterator {
+  public:
+    typedef std::forward_iterator_tag iterator_category;
+    typedef Component value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef Component *pointer;
+    typedef Component &reference;
+  };
+
+  class PreOrderIterator : public ComponentIterator {
+  public:
+    PreOrderIterator() {}
+    explicit PreOrderIterator(Component *root) {if (root) _stack.push_back(root);}
+
+    inline Component &operator*() const {return *_stack.back();}
+    inline Component *operator->() const {return _stack.back();}
+    inline PreOrderIterator &operator++() {
+      auto component = _stack.back();
+      _stack.pop_back();
+      const auto &children = component->getChildren();
+      for (auto it = children.rbegin(); it != children.rend(); ++it) {
+        if (*it) _stack.push_back(it->get());
+      }
+      return *this;
+    }
+    inline PreOrderIterator operator++(int) {auto copy = *this; ++*this; return copy;}
+    inline bool operator==(const PreOrderIterator &other) const {return _stack == other._stack;}
+    inline bool operator!=(const PreOrderIterator &other) const {return !(*this == other);}
+
+  private:
+    std::vector<Component*> _stack;
+  };
+
+  class PostOrderIterator : public ComponentIterator {
+  public:
+    PostOrderIterator() {}
+    explicit PostOrderIterator(Component *root) {if (root) descend(root);}
+
+    inline Component &operator*() const {return *_stack.back().first;}
+    inline Component *operator->() const {return _stack.back().first;}
+    inline PostOrderIterator &operator++() {
+      _stack.pop_back();
+      if (!_stack.empty()) {
+        auto &top = _stack.back();
+        const auto &children = top.first->getChildren();
+        while (top.second < children.size() && !children[top.second]) ++top.second;
+        if (top.second < children.size()) descend(children[top.second++].get());
+      }
+      return *this;
+    }
+    inline PostOrderIterator operator++(int) {auto copy = *this; ++*this; return copy;}
+    inline bool operator==(const PostOrderIterator &other) const {return _stack == other._stack;}
+    inline bool operator!=(const PostOrderIterator &other) const {return !(*this == other);}
+
+  private:
+    // Pushes component and its first children down to a leaf.
+    inline void descend(Component *component) {
+      for (;;) {
+        _stack.emplace_back(component, 0);
+        auto &top = _stack.back();
+        const auto &children = component->getChildren();
+        while (top.second < children.size() && !children[top.second]) ++top.second;
+        if (top.second == children.size()) return;
+        component = children[top.second++].get();
+      }
+    }
+
+    std::vector<std::pair<Component*, size_t>> _stack; // component, next child
+  };
+
+  class LevelOrderIterator : public ComponentIterator {
+  public:
+    LevelOrderIterator() {}
+    explicit LevelOrderIterator(Component *root) {if (root) _queue.push_back(root);}
+
+    inline Component &operator*() const {return *_queue[_head];}
+    inline Component *operator->() const {return _queue[_head];}
+    inline LevelOrderIterator &operator++() {
+      for (auto &child : _queue[_head]->getChildren()) {
+        if (child) _queue.push_back(child.get());
+      }
+      if (++_head == _queue.size()) {
+        _queue.clear();
+        _head = 0;
+      } else if (_head >= kCompactThreshold && _head * 2 >= _queue.size()) {
+        _queue.erase(_queue.begin(), _queue.begin() + static_cast<std::ptrdiff_t>(_head));
+        _head = 0;
+      }
+      return *this;
+    }
+    inline LevelOrderIterator operator++(int) {auto copy = *this; ++*this; return copy;}
+    inline bool operator==(const LevelOrderIterator &other) const {
+      return _queue.size() - _head == other._queue.size() - other._head &&
+        std::equal(_queue.begin() + static_cast<std::ptrdiff_t>(_head), _queue.end(),
+                   other._queue.begin() + static_cast<std::ptrdiff_t>(other._head));
+    }
+    inline bool operator!=(const LevelOrderIterator &other) const {return !(*this == other);}
+
+  private:
+    static const size_t kCompactThreshold = 1024;
+
+    std::vector<Component*> _queue;
+    size_t _head = 0;
+  };
+
+  template <typename Iterator>
+  class Traversal {
+  public:
+    explicit Traversal(Component &root) : _root(&root) {}
+    inline Iterator begin() const {return Iterator(_root);}
+    inline Iterator end() const {return Iterator();}
+  private:
+    Component *_root;
+  };
+
+  inline Traversal<PreOrderIterator> preOrder(Component &root) {
+    return Traversal<PreOrderIterator>(root);
+  }
+  inline Traversal<PostOrderIterator> postOrder(Component &root) {
+    return Traversal<PostOrderIterator>(root);
+  }
+  inline Traversal<LevelOrderIterator> levelOrder(Component &root) {
+    return Traversal<LevelOrderIterator>(root);
+  }
+
+#pragma mark - FlatTree
+  /**
+   * Structure-of-arrays copy of a tree's shape. Nodes are stored in pre-order in
+   * contiguous arrays (parent, first child, next sibling, subtree end, key,
+   * dirty bits) and components are referenced by index, so whole
+   * tree passes such as dirty propagation and hashing stream through memory
+   * instead of chasing shared_ptrs.
+   *
+   * The store doesn't own the components; rebuild() it after adding or removing
+   * children. Pre-order means a parent's index is always below its children's,
+   * and a subtree occupies the index range [i, subtreeEnd(i)).
+   */
+  class FlatTree {
+  public:
+    typedef uint32_t Index;
+    enum : Index {kNone = 0xffffffff};
+
+    enum Flags : uint8_t {
+      kDirty = 1 << 0, // the component itself changed
+      kSubtreeDirty = 1 << 1 // it or a descendant changed
+    };
+
+    FlatTree() {}
+    explicit FlatTree(Component &root) {rebuild(root);}
+
+    inline void rebuild(Component &root) {
+      clear();
+      std::vector<Component*> stack(1, &root);
+      std::vector<Index> parents(1, kNone);
+      while (!stack.empty()) {
+        auto component = stack.back();
+        auto parent = parents.back();
+        stack.pop_back();
+        parents.pop_back();
+
+        auto index = static_cast<Index>(_components.size());
+        _components.push_back(component);
+        _parents.push_back(parent);
+        _firstChildren.push_back(kNone);
+        _nextSiblings.push_back(kNone);
+        _subtreeEnds.push_back(index + 1);
+        _keys.push_back(component->getKey());
+        _flags.push_back(0);
+        _hashes.push_back(0);
+        _nodeHashes.push_back(0);
+        _indices[component] = index;
+
+        const auto &children = component->getChildren();
+        for (auto it = children.rbegin(); it != children.rend(); ++it) {
+          if (!*it) continue;
+          stack.push_back(it->get());
+          parents.push_back(index);
+        }
+      }
+      // Link siblings and close subtree ranges bottom-up.
+      for (Index i = static_cast<Index>(_components.size()); i-- > 1;) {
+        auto parent = _parents[i];
+        _nextSiblings[i] = _firstChildren[parent];
+        _firstChildren[parent] = i;
+        _subtreeEnds[parent] = std::max(_subtreeEnds[parent], _subtreeEnds[i]);
+      }
+    }
+    inline void clear() {
+      _components.clear();
+      _parents.clear();
+      _firstChildren.clear();
+      _nextSiblings.clear();
+      _subtreeEnds.clear();
+      _keys.clear();
+      _flags.clear();
+      _hashes.clear();
+      _nodeHashes.clear();
+      _indices.clear();
+      _hashed = false;
+    }
+
+    inline size_t size() const {return _components.size();}
+    inline Component &component(Index i) const {return *_components[i];}
+    inline Index parent(Index i) const {return _parents[i];}
+    inline Index firstChild(Index i) const {return _firstChildren[i];}
+    inline Index nextSibling(Index i) const {return _nextSiblings[i];}
+    inline Index subtreeEnd(Index i) const {return _subtreeEnds[i];}
+    inline const Key &key(Index i) const {return _keys[i];}
+    inline const State &state(Index i) const {return _components[i]->getState();}
+    /**
+     * @returns the index of component, or kNone if it isn't in the store
+     */
+    inline Index indexOf(const Component &component) const {
+      auto it = _indices.find(&component);
+      return it == std::end(_indices) ? kNone : it->second;
+    }
+
+#pragma mark Dirty tracking
+    inline void markDirty(Index i) {_flags[i] |= kDirty | kSubtreeDirty;}
+    inline bool isDirty(Index i) const {return (_flags[i] & kDirty) != 0;}
+    inline bool isSubtreeDirty(Index i) const {return (_flags[i] & kSubtreeDirty) != 0;}
+    /**
+     * Marks every ancestor of a dirty component in a single backwards pass.
+     */
+    inline void propagateDirty() {
+      for (Index i = static_cast<Index>(_flags.size()); i-- > 1;) {
+        if (_flags[i] & kSubtreeDirty) _flags[_parents[i]] |= kSubtreeDirty;
+      }
+    }
+    inline void clearDirty() {std::fill(std::begin(_flags), std::end(_flags), 0);}
+
+#pragma mark Hashing
+    /**
+     * Brings every node's subtree hash up to date bottom-up; they equal
+     * Component::subtreeHash() for the same tree. After the first pass only
+     * nodes marked dirty rehash their state, only their ancestors recombine,
+     * and clean subtrees keep their hashes. Dirty bits are propagated along
+     * the way and cleared afterwards.
+     */
+    inline void hashAll() {
+      for (Index i = static_cast<Index>(_components.size()); i-- > 0;) {
+        if (_hashed && !(_flags[i] & kSubtreeDirty)) continue;
+        if (!_hashed || (_flags[i] & kDirty)) _nodeHashes[i] = _components[i]->nodeHash();
+        uint64_t h = _nodeHashes[i];
+        size_t count = 0;
+        for (Index c = _firstChildren[i]; c != kNone; c = _nextSiblings[c], ++count) {
+          h = Hash::combine(h, _hashes[c]);
+        }
+        _hashes[i] = Hash::combine(h, count);
+        if (i > 0) _flags[_parents[i]] |= kSubtreeDirty;
+      }
+      _hashed = true;
+      clearDirty();
+    }
+    inline uint64_t hash(Index i) const {return _hashes[i];}
+
+  private:
+    std::vector<Component*> _components;
+    std::vector<Index> _parents;
+    std::vector<Index> _firstChildren;
+    std::vector<Index> _nextSiblings;
+    std::vector<Index> _subtreeEnds;
+    std::vector<Key> _keys;
+    std::vector<uint8_t> _flags;
+    std::vector<uint64_t> _hashes;
+    std::vector<uint64_t> _nodeHashes;
+    std::unordered_map<const Component*, Index> _indices;
+    bool _hashed = false;
+  };
+
+#pragma mark - RenderPool
+  /**
+   * Renders whole subtrees on a work-stealing thread pool. A component is
+   * rendered before its children. Children whose isParallelSafe() is true
+   * become tasks that any worker may steal; all other components render on
+   * the thread that called render(), which also takes tasks while it waits.
+   * Workers only run the render phase, including componentWillUpdate() right
+   * before each render(): once the whole subtree has rendered, the calling
+   * thread commits it, so componentDidUpdate() and observers never run on a
+   * worker or see a partly rendered tree. setState() calls made by
+   * render() are deferred, as in any update, and applied on the calling
+   * thread after the commit.
+   */
+  class RenderPool {
+  public:
+    struct Stats {
+      uint64_t rendered = 0;
+      uint64_t stolen = 0;
+      uint64_t declined = 0; // by shouldComponentUpdate()
+    };
+
+    /**
+     * @param[in] threads including the calling thread; 0 means one per core
+     */
+    explicit RenderPool(unsigned threads = 0) {
+      if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+      for (unsigned i = 0; i < threads; ++i) {
+        _queues.emplace_back(new Queue());
+      }
+      for (unsigned i = 1; i < threads; ++i) {
+        _threads.emplace_back([this, i] {work(i);});
+      }
+    }
+    RenderPool(const RenderPool&) = delete;
+    RenderPool &operator=(const RenderPool&) = delete;
+    ~RenderPool() {
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+      }
+      _wake.notify_all();
+      for (auto &thread : _threads) thread.join();
+    }
+
+    /**
+     * Renders root and every descendant with render(force) into work in
+     * progress, then commits it with commitWork(), parents before children,
+     * on the calling thread. Unless force is set, a component whose
+     * shouldComponentUpdate() declines is skipped along with its subtree.
+     * Calls on one pool are serialized.
+     *
+     * @throws the first exception thrown by a render(), after the others
+     * finish; then no work of the pass is committed
+     */
+    inline void render(Component &root, bool force = true) {
+      std::lock_guard<std::mutex> rendering(_renderMutex);
+      _force = force;
+      _error = nullptr;
+      pushSerial(&root);
+      for (;;) {
+        Component *task = nullptr;
+        if (popSerial(task) || take(0, task)) {
+          run(task, 0);
+          continue;
+        }
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (_pending == 0) break;
+        _wake.wait(lock, [this] {
+          return _pending == 0 || _queued > 0 || !_serial.empty();
+        });
+      }
+      std::unordered_set<Component*> prepared;
+      auto &updates = UpdateQueue::current();
+      for (auto &queue : _queues) {
+        prepared.insert(std::begin(queue->prepared), std::end(queue->prepared));
+        queue->prepared.clear();
+        // setState() calls from renders on workers apply here, after the commit
+        if (queue->updates && queue->updates != &updates) updates.adopt(*queue->updates);
+      }
+      if (_error) {
+        for (auto component : prepared) component->abortWork();
+        if (!updates.busy()) updates.clear();
+        std::rethrow_exception(_error);
+      }
+      {
+        UpdateQueue::Batch batch(updates);
+        commit(root, prepared);
+      }
+      updates.drain();
+    }
+
+    inline unsigned size() const {return static_cast<unsigned>(_queues.size());}
+    inline Stats getStats() const {
+      Stats stats;
+      stats.rendered = _rendered;
+      stats.stolen = _stolen;
+      stats.declined = _declined;
+      return stats;
+    }
+
+  private:
+    struct Queue {
+      std::mutex mutex;
+      std::deque<Component*> tasks;
+      std::vector<Component*> prepared; // only touched by its own thread
+      UpdateQueue *updates = nullptr; // its thread's, once it ran a task
+    };
+
+    /**
+     * Commits the pass in pre-order. The components are collected, and held,
+     * first, since commit hooks may change the tree.
+     */
+    inline void commit(Component &root, const std::unordered_set<Component*> &prepared) {
+      if (!prepared.count(&root)) return; // declined, along with its subtree
+      NodeList order;
+      NodeList stack;
+      auto push = [&](const Component &parent) {
+        auto &children = parent.getChildren();
+        for (auto it = children.rbegin(); it != children.rend(); ++it) {
+          if (*it && prepared.count(it->get())) stack.push_back(*it);
+        }
+      };
+      push(root);
+      while (!stack.empty()) {
+        auto component = std::move(stack.back());
+        stack.pop_back();
+        push(*component);
+        order.push_back(std::move(component));
+      }
+      root.commitWork();
+      for (auto &component : order) component->commitWork();
+    }
+
+    inline void work(size_t self) {
+      for (;;) {
+        Component *task = nullptr;
+        if (take(self, task)) {
+          run(task, self);
+          continue;
+        }
+        std::unique_lock<std::mutex> lock(_mutex);
+        _wake.wait(lock, [this] {return _stop || _queued > 0;});
+        if (_stop) return;
+      }
+    }
+
+    inline void run(Component *component, size_t self) {
+      auto &prepared = _queues[self]->prepared;
+      _queues[self]->updates = &UpdateQueue::current();
+      try {
+        prepared.push_back(component); // so a failed pass aborts its work
+        if (component->prepareRender(_force)) {
+          ++_rendered;
+          for (auto &child : component->getChildren()) {
+            if (!child) continue;
+            if (child->isParallelSafe() && _queues.size() > 1) {
+              push(self, child.get());
+            } else {
+              pushSerial(child.get());
+            }
+          }
+        } else {
+          prepared.pop_back();
+          ++_declined;
+        }
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (!_error) _error = std::current_exception();
+      }
+      if (--_pending == 0) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _wake.notify_all();
+      }
+    }
+
+    inline void push(size_t self, Component *component) {
+      ++_pending;
+      ++_queued;
+      {
+        std::lock_guard<std::mutex> lock(_queues[self]->mutex);
+        _queues[self]->tasks.push_back(component);
+      }
+      std::lock_guard<std::mutex> lock(_mutex);
+      _wake.notify_all();
+    }
+    inline void pushSerial(Component *component) {
+      ++_pending;
+      std::lock_guard<std::mutex> lock(_mutex);
+      _serial.push_back(component);
+      _wake.notify_all();
+    }
+    inline bool popSerial(Component *&component) {
+      std::lock_guard<std::mutex> lock(_mutex);
+      if (_serial.empty()) return false;
+      component = _serial.back();
+      _serial.pop_back();
+      return true;
+    }
+
+    /**
+     * Pops the newest task of self's queue, or steals the oldest of another's.
+     */
+    inline bool take(size_t self, Component *&component) {
+      if (_queued == 0) return false;
+      for (size_t i = 0; i < _queues.size(); ++i) {
+        auto &queue = *_queues[(self + i) % _queues.size()];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty()) continue;
+        if (i == 0) {
+          component = queue.tasks.back();
+          queue.tasks.pop_back();
+        } else {
+          component = queue.tasks.front();
+          queue.tasks.pop_front();
+          ++_stolen;
+        }
+        --_queued;
+        return true;
+      }
+      return false;
+    }
+
+    std::vector<std::unique_ptr<Queue>> _queues;
+    std::vector<std::thread> _threads;
+    std::mutex _renderMutex;
+    std::mutex _mutex;
+    std::condition_variable _wake;
+    std::vector<Component*> _serial;
+    std::atomic<size_t> _pending{0};
+    std::atomic<size_t> _queued{0};
+    std::atomic<uint64_t> _rendered{0};
+    std::atomic<uint64_t> _stolen{0};
+    std::atomic<uint64_t> _declined{0};
+    std::exception_ptr _error;
+    bool _force = true;
+    bool _stop = false;
+  };
+
+#pragma mark - ComponentPool
+  inline void ComponentPool::adopt(Component &component) {
+    component._pool = shared_from_this();
+  }
+
+  inline bool ComponentPool::release(SharedComponent &component, NodeList &orphans) {
+    if (!component) return false;
+    if (component.use_count() != 1) {
+      ++_stats.dropped;
+      return false;
+    }
+    auto &free = _free[std::type_index(typeid(*component))];
+    if (free.size() >= _capacity) {
+      ++_stats.dropped;
+      return false;
+    }
+    // Hand the subtree back too, so pooled instances don't pin their children.
+    for (auto &child : component->_children) {
+      if (!child) continue;
+      if (child->_parent == component.get()) child->_parent = nullptr;
+      orphans.push_back(std::move(child));
+    }
+    component->_children.clear();
+    component->invalidateHash();
+    // It comes back for an unrelated key, maybe under another parent.
+    component->_observers.clear();
+    component->_disposal.reset();
+    free.push_back(std::move(component));
+    ++_stats.released;
+    return true;
+  }
+
+#pragma mark - DisposalQueue
+  inline void DisposalQueue::prepare(SharedComponent root, NodeList &safe, NodeList &kept) {
+    NodeList roots(1, std::move(root));
+    std::vector<Component*> stack;
+    while (!roots.empty()) {
+      auto subtree = std::move(roots.back());
+      roots.pop_back();
+      auto weak = subtree->_weakHandles.load() != 0;
+      stack.push_back(subtree.get());
+      if (weak) {
+        kept.push_back(std::move(subtree));
+      } else {
+        safe.push_back(std::move(subtree));
+      }
+      while (!stack.empty()) {
+        auto component = stack.back();
+        stack.pop_back();
+#ifdef JGOD_REACTIVE_COROUTINES
+        component->releaseTasks();
+#endif
+        // A weakly referenced component gives up all of its children; the
+        // others only the weakly referenced ones.
+        auto emptied = component->_weakHandles.load() != 0;
+        for (auto &child : component->_children) {
+          if (!child) continue;
+          if (child.use_count() != 1) {
+            if (child->_parent == component) child->_parent = nullptr;
+            child.reset();
+          } else if (emptied || child->_weakHandles.load() != 0) {
+            if (child->_parent == component) child->_parent = nullptr;
+            roots.push_back(std::move(child));
+          } else {
+            stack.push_back(child.get());
+          }
+        }
+        if (emptied) component->_children.clear();
+      }
+    }
+  }
+
+  inline size_t DisposalQueue::drain(std::chrono::microseconds budget) {
+    auto start = std::chrono::steady_clock::now();
+    size_t count = 0;
+    for (;;) {
+      SharedComponent component;
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_pending.empty()) break;
+        component = std::move(_pending.back());
+        _pending.pop_back();
+      }
+      // Queue the children first, so destroying this component is O(1).
+      NodeList children;
+      if (component.use_count() == 1) {
+        children.swap(component->_children);
+        for (auto &child : children) {
+          if (child && child->_parent == component.get()) child->_parent = nullptr;
+        }
+      }
+      component.reset();
+      ++count;
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        for (auto &child : children) {
+          if (child) _pending.push_back(std::move(child));
+        }
+        ++_destroyed;
+      }
+      if (count % kClockInterval == 0 &&
+          std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start) >= budget) break;
+    }
+    return count;
+  }
+
+#pragma mark - Registry
+  /**
+   * Maps type names to component factories, so trees can be described as data
+   * (e.g. cached prebuilt layouts) and instantiated in a single pass.
+   *
+   * A descriptor is a JSON object of the form
+   * {"type": "Name", "key": "k", "props": {...}, "children": [...]},
+   * where everything but "type" is optional.
+   */
+  class Registry {
+  public:
+    typedef std::function<SharedComponent(Key &&key,
+                                          Props &&props,
+                                          NodeList &&children)> Factory;
+    typedef std::function<SharedComponent(Key &&key,
+                                          SharedProps &&props,
+                                          NodeList &&children)> SharedFactory;
+
+    /**
+     * Registers T under type. T must be constructible from (key, props, children);
+     * arguments are passed as rvalues, so constructors taking them by value and
+     * moving them into Component avoid copies. If T is also constructible
+     * from (key, SharedProps, children), create() with SharedProps uses that.
+     */
+    template <typename T>
+    inline void add(const std::string &type) {
+      add(type, [](Key &&key, Props &&props, NodeList &&children) {
+        return SharedComponent(std::make_shared<T>(std::move(key),
+                                                   std::move(props),
+                                                   std::move(children)));
+      });
+      addShared<T>(type, std::is_constructible<T, Key&&, SharedProps&&, NodeList&&>());
+      _names[std::type_index(typeid(T))] = type;
+      _types.insert({type, std::type_index(typeid(T))});
+    }
+    /**
+     * Registers factory under type, replacing what was registered under it.
+     * typeOf() doesn't know the components it creates.
+     */
+    inline void add(const std::string &type, Factory factory) {
+      forget(type);
+      _factories[type] = std::move(factory);
+      _sharedFactories.erase(type);
+    }
+    inline bool has(const std::string &type) const {
+      return _factories.find(type) != std::end(_factories);
+    }
+
+    inline SharedComponent create(const std::string &type,
+                                  Key key,
+                                  Props props = Props(),
+                                  NodeList children = NodeList()) const {
+      return create(resolve(type), std::move(key), std::move(props), std::move(children));
+    }
+    /**
+     * create() for props already shared by another component, e.g. one being
+     * cloned: instances recycled from the pool, and types registered with
+     * add<T>() that take SharedProps, share them; other types get a copy.
+     */
+    inline SharedComponent create(const std::string &type,
+                                  Key key,
+                                  SharedProps props,
+                                  NodeList children = NodeList()) const {
+      if (!props) return create(type, std::move(key), Props(), std::move(children));
+      auto it = _factories.find(type);
+      if (it == std::end(_factories)) {
+        throw std::out_of_range("unknown component type: " + type);
+      }
+      if (_pool) {
+        auto t = _types.find(type);
+        auto component = t == std::end(_types) ? nullptr : _pool->acquire(t->second);
+        if (component) {
+          component->recycle(std::move(key), std::move(props));
+          component->addChildren(std::move(children));
+          return component;
+        }
+      }
+      auto shared = _sharedFactories.find(type);
+      if (shared == std::end(_sharedFactories)) {
+        return create(type, std::move(key), Props(*props), std::move(children));
+      }
+      auto component = shared->second(std::move(key), std::move(props), std::move(children));
+      if (_pool && component) _pool->adopt(*component);
+      return component;
+    }
+
+    /**
+     * Reuses removed components of types registered with add<T>() from pool.
+     */
+    inline void setPool(SharedComponentPool const pool) {_pool = pool;}
+    inline const SharedComponentPool &getPool() const {return _pool;}
+
+    /**
+     * Interns the props of every component created through this registry.
+     */
+    inline void setPropsPool(SharedPropsPool const propsPool) {_propsPool = propsPool;}
+    inline const SharedPropsPool &getPropsPool() const {return _propsPool;}
+
+    /**
+     * @returns the name component's dynamic type was registered under via add<T>(),
+     * or an empty string if it is unknown.
+     */
+    inline const std::string &typeOf(const Component &component) const {
+      static const std::string unknown;
+      auto it = _names.find(std::type_index(typeid(component)));
+      return it == std::end(_names) ? unknown : it->second;
+    }
+
+    /**
+     * Instantiates the hierarchy described by descriptor, children first.
+     * The const overload reads the descriptor in place and copies only each
+     * node's props; the rvalue overload moves them out instead.
+     */
+    inline SharedComponent build(const JSON &descriptor) const {return buildFrom(descriptor);}
+    inline SharedComponent build(JSON &&descriptor) const {return buildFrom(descriptor);}
+
+  private:
+    // Descriptor is JSON or const JSON.
+    template <typename Descriptor>
+    inline SharedComponent buildFrom(Descriptor &descriptor) const {
+      // Post-order with an explicit stack, so deep hierarchies don't recurse.
+      std::vector<BuildFrame<Descriptor>> stack;
+      stack.push_back(frameOf(descriptor));
+      SharedComponent root;
+      while (!stack.empty()) {
+        auto &top = stack.back();
+        if (top.list && top.next < top.list->size()) {
+          auto &child = (*top.list)[top.next++];
+          stack.push_back(frameOf(child));
+          continue;
+        }
+        auto &node = *top.descriptor;
+        Key key("");
+        auto k = node.find("key");
+        if (k != node.end()) key = Key::fromJSON(*k);
+        Props props;
+        auto p = node.find("props");
+        if (p != node.end()) props = takeProps(*p);
+
+        auto component = create(*node.find("type")->template get_ptr<const std::string*>(),
+                                std::move(key),
+                                std::move(props),
+                                std::move(top.children));
+        stack.pop_back();
+        if (stack.empty()) {
+          root = std::move(component);
+        } else {
+          stack.back().children.push_back(std::move(component));
+        }
+      }
+      return root;
+    }
+
+    static inline Props takeProps(const JSON &props) {return props;}
+    static inline Props takeProps(JSON &props) {return std::move(props);}
+
+    friend class Snapshot;
+
+    // A type name looked up once, for creating many components of it.
+    struct Resolved {
+      const Factory *factory;
+      const std::type_index *type; // the class add<T>() registered, if any
+    };
+
+    /**
+     * @throws std::out_of_range if type is not registered
+     */
+    inline Resolved resolve(const std::string &type) const {
+      auto it = _factories.find(type);
+      if (it == std::end(_factories)) {
+        throw std::out_of_range("unknown component type: " + type);
+      }
+      auto t = _types.find(type);
+      return {&it->second, t == std::end(_types) ? nullptr : &t->second};
+    }
+
+    inline SharedComponent create(const Resolved &type,
+                                  Key key,
+                                  Props props,
+                                  NodeList children) const {
+      PropsPool::Scope scope(_propsPool ? _propsPool.get() : PropsPool::current());
+      if (_pool && type.type) {
+        if (auto component = _pool->acquire(*type.type)) {
+          component->recycle(std::move(key), std::move(props));
+          component->addChildren(std::move(children));
+          return component;
+        }
+      }
+      auto component = (*type.factory)(std::move(key), std::move(props), std::move(children));
+      if (_pool && component) _pool->adopt(*component);
+      return component;
+    }
+
+    /**
+     * Drops the class add<T>() registered under type. Unless another name
+     * still creates that class, typeOf() stops knowing it and its pooled
+     * instances are discarded, so they can't stand in for the new type.
+     */
+    inline void forget(const std::string &type) {
+      auto t = _types.find(type);
+      if (t == std::end(_types)) return;
+      auto old = t->second;
+      _types.erase(t);
+      auto name = _names.find(old);
+      for (auto &other : _types) {
+        if (other.second != old) continue;
+        if (name != std::end(_names) && name->second == type) name->second = other.first;
+        return;
+      }
+      if (name != std::end(_names)) _names.erase(name);
+      if (_pool) _pool->clear(old);
+    }
+
+    template <typename T>
+    inline void addShared(const std::string &type, std::true_type) {
+      _sharedFactories[type] = [](Key &&key, SharedProps &&props, NodeList &&children) {
+        return SharedComponent(std::make_shared<T>(std::move(key),
+                                                   std::move(props),
+                                                   std::move(children)));
+      };
+    }
+    template <typename T>
+    inline void addShared(const std::string &type, std::false_type) {
+      _sharedFactories.erase(type);
+    }
+
+    // A descriptor whose component waits for its children.
+    template <typename Descriptor>
+    struct BuildFrame {
+      Descriptor *descriptor;
+      Descriptor *list; // "children", if it's an array
+      size_t next;
+      NodeList children;
+    };
+
+    template <typename Descriptor>
+    static inline BuildFrame<Descriptor> frameOf(Descriptor &descriptor) {
+      if (!descriptor.is_object()) {
+        throw std::invalid_argument("component descriptor must be an object");
+      }
+      auto type = descriptor.find("type");
+      if (type == descriptor.end() || !type->is_string()) {
+        throw std::invalid_argument("component descriptor is missing a type");
+      }
+      BuildFrame<Descriptor> frame{&descriptor, nullptr, 0, NodeList()};
+      auto list = descriptor.find("children");
+      if (list != descriptor.end() && list->is_array()) {
+        frame.list = &*list;
+        frame.children.reserve(list->size());
+      }
+      return frame;
+    }
+
+    std::unordered_map<std::string, Factory> _factories;
+    std::unordered_map<std::string, SharedFactory> _sharedFactories;
+    std::unordered_map<std::type_index, std::string> _names;
+    std::unordered_map<std::string, std::type_index> _types;
+    SharedComponentPool _pool;
+    SharedPropsPool _propsPool;
+  };
+
+#pragma mark - MessagePack
+  /**
+   * Compact binary encoding of JSON values (the MessagePack subset JSON needs).
+   * Decoding builds values directly from the bytes, without a text parser.
+   */
+  class MessagePack {
+  public:
+    static inline void encode(const JSON &value, std::string &out) {
+      switch (value.type()) {
+        case JSON::value_t::object: {
+          writeHeader(out, value.size(), 0x80, 0xde, 0xdf);
+          for (auto it = value.begin(); it != value.end(); ++it) {
+            writeString(out, it.key());
+            encode(it.value(), out);
+          }
+          break;
+        }
+        case JSON::value_t::array: {
+          writeHeader(out, value.size(), 0x90, 0xdc, 0xdd);
+          for (auto &element : value) {encode(element, out);}
+          break;
+        }
+        case JSON::value_t::string:
+          writeString(out, *value.get_ptr<const std::string*>());
+          break;
+        case JSON::value_t::boolean:
+          out.push_back(value.get<bool>() ? '\xc3' : '\xc2');
+          break;
+        case JSON::value_t::number_integer:
+          writeInteger(out, value.get<int64_t>());
+          break;
+        case JSON::value_t::number_float: {
+          double number = value.get<double>();
+          uint64_t bits;
+          std::memcpy(&bits, &number, sizeof(bits));
+          out.push_back('\xcb');
+          writeBigEndian(out, bits, 8);
+          break;
+        }
+        default:
+          out.push_back('\xc0');
+          break;
+      }
+    }
+    static inline std::string encode(const JSON &value) {
+      std::string out;
+      encode(value, out);
+      return out;
+    }
+
+    /**
+     * Decodes one value starting at cursor and advances cursor past it.
+     * @throws std::invalid_argument on truncated or unsupported input
+     */
+    static inline JSON decode(const char *&cursor, const char *end) {
+      uint8_t byte = readByte(cursor, end);
+      if (byte <= 0x7f) return JSON(static_cast<int64_t>(byte));
+      if (byte >= 0xe0) return JSON(static_cast<int64_t>(static_cast<int8_t>(byte)));
+      if ((byte & 0xf0) == 0x80) return decodeObject(cursor, end, byte & 0x0f);
+      if ((byte & 0xf0) == 0x90) return decodeArray(cursor, end, byte & 0x0f);
+      if ((byte & 0xe0) == 0xa0) return decodeString(cursor, end, byte & 0x1f);
+
+      switch (byte) {
+        case 0xc0: return JSON();
+        case 0xc2: return JSON(false);
+        case 0xc3: return JSON(true);
+        case 0xca: {
+          uint32_t bits = static_cast<uint32_t>(readBigEndian(cursor, end, 4));
+          float number;
+          std::memcpy(&number, &bits, sizeof(number));
+          return JSON(static_cast<double>(number));
+        }
+        case 0xcb: {
+          uint64_t bits = readBigEndian(cursor, end, 8);
+          double number;
+          std::memcpy(&number, &bits, sizeof(number));
+          return JSON(number);
+        }
+        case 0xcc: return JSON(static_cast<int64_t>(readBigEndian(cursor, end, 1)));
+        case 0xcd: return JSON(static_cast<int64_t>(readBigEndian(cursor, end, 2)));
+        case 0xce: return JSON(static_cast<int64_t>(readBigEndian(cursor, end, 4)));
+        case 0xcf: return JSON(static_cast<int64_t>(readBigEndian(cursor, end, 8)));
+        case 0xd0: return JSON(static_cast<int64_t>(
+          static_cast<int8_t>(readBigEndian(cursor, end, 1))));
+        case 0xd1: return JSON(static_cast<int64_t>(
+          static_cast<int16_t>(readBigEndian(cursor, end, 2))));
+        case 0xd2: return JSON(static_cast<int64_t>(
+          static_cast<int32_t>(readBigEndian(cursor, end, 4))));
+        case 0xd3: return JSON(static_cast<int64_t>(readBigEndian(cursor, end, 8)));
+        case 0xd9: return decodeString(cursor, end, readBigEndian(cursor, end, 1));
+        case 0xda: return decodeString(cursor, end, readBigEndian(cursor, end, 2));
+        case 0xdb: return decodeString(cursor, end, readBigEndian(cursor, end, 4));
+        case 0xdc: return decodeArray(cursor, end, readBigEndian(cursor, end, 2));
+        case 0xdd: return decodeArray(cursor, end, readBigEndian(cursor, end, 4));
+        case 0xde: return decodeObject(cursor, end, readBigEndian(cursor, end, 2));
+        case 0xdf: return decodeObject(cursor, end, readBigEndian(cursor, end, 4));
+        default: throw std::invalid_argument("unsupported MessagePack type");
+      }
+    }
+    static inline JSON decode(const std::string &data) {
+      const char *cursor = data.data();
+      return decode(cursor, data.data() + data.size());
+    }
+
+    static inline void writeString(std::string &out, const std::string &value) {
+      auto size = value.size();
+      if (size < 32) {
+        out.push_back(static_cast<char>(0xa0 | size));
+      } else if (size <= 0xff) {
+        out.push_back('\xd9'); writeBigEndian(out, size, 1);
+      } else if (size <= 0xffff) {
+        out.push_back('\xda'); writeBigEndian(out, size, 2);
+      } else {
+        out.push_back('\xdb'); writeBigEndian(out, size, 4);
+      }
+      out.append(value);
+    }
+    static inline std::string readString(const char *&cursor, const char *end) {
+      const char *data;
+      auto size = readString(cursor, end, data);
+      return std::string(data, size);
+    }
+    /**
+     * Reads a string without copying it: data points into the input.
+     * @returns its size
+     */
+    static inline size_t readString(const char *&cursor, const char *end, const char *&data) {
+      uint8_t byte = readByte(cursor, end);
+      size_t size;
+      if ((byte & 0xe0) == 0xa0) {
+        size = byte & 0x1f;
+      } else {
+        switch (byte) {
+          case 0xd9: size = readBigEndian(cursor, end, 1); break;
+          case 0xda: size = readBigEndian(cursor, end, 2); break;
+          case 0xdb: size = readBigEndian(cursor, end, 4); break;
+          default: throw std::invalid_argument("expected a MessagePack string");
+        }
+      }
+      if (static_cast<size_t>(end - cursor) < size) {
+        throw std::invalid_argument("truncated MessagePack data");
+      }
+      data = cursor;
+      cursor += size;
+      return size;
+    }
+
+    static inline void writeInteger(std::string &out, int64_t value) {
+      if (value >= 0) {
+        if (value <= 0x7f) {
+          out.push_back(static_cast<char>(value));
+        } else if (value <= 0xff) {
+          out.push_back('\xcc'); writeBigEndian(out, value, 1);
+        } else if (value <= 0xffff) {
+          out.push_back('\xcd'); writeBigEndian(out, value, 2);
+        } else if (value <= 0xffffffffLL) {
+          out.push_back('\xce'); writeBigEndian(out, value, 4);
+        } else {
+          out.push_back('\xcf'); writeBigEndian(out, value, 8);
+        }
+      } else {
+        if (value >= -32) {
+          out.push_back(static_cast<char>(value));
+        } else if (value >= INT8_MIN) {
+          out.push_back('\xd0'); writeBigEndian(out, value, 1);
+        } else if (value >= INT16_MIN) {
+          out.push_back('\xd1'); writeBigEndian(out, value, 2);
+        } else if (value >= INT32_MIN) {
+          out.push_back('\xd2'); writeBigEndian(out, value, 4);
+        } else {
+          out.push_back('\xd3'); writeBigEndian(out, value, 8);
+        }
+      }
+    }
+    static inline uint64_t readUnsigned(const char *&cursor, const char *end) {
+      if (cursor != end && static_cast<uint8_t>(*cursor) <= 0x7f) { // positive fixint
+        return static_cast<uint8_t>(*cursor++);
+      }
+      JSON value = decode(cursor, end);
+      if (!value.is_number_integer() || value.get<int64_t>() < 0) {
+        throw std::invalid_argument("expected a MessagePack unsigned integer");
+      }
+      return static_cast<uint64_t>(value.get<int64_t>());
+    }
+
+    static inline void writeBigEndian(std::string &out, uint64_t value, size_t bytes) {
+      for (size_t i = bytes; i > 0; --i) {
+        out.push_back(static_cast<char>((value >> ((i - 1) * 8)) & 0xff));
+      }
+    }
+    static inline uint64_t readBigEndian(const char *&cursor, const char *end, size_t bytes) {
+      if (static_cast<size_t>(end - cursor) < bytes) {
+        throw std::invalid_argument("truncated MessagePack data");
+      }
+      uint64_t value = 0;
+      for (size_t i = 0; i < bytes; ++i) {
+        value = (value << 8) | static_cast<uint8_t>(*cursor++);
+      }
+      return value;
+    }
+
+  private:
+    static inline uint8_t readByte(const char *&cursor, const char *end) {
+      return static_cast<uint8_t>(readBigEndian(cursor, end, 1));
+    }
+    static inline void writeHeader(std::string &out, size_t size,
+                                   uint8_t fix, uint8_t marker16, uint8_t marker32) {
+      if (size < 16) {
+        out.push_back(static_cast<char>(fix | size));
+      } else if (size <= 0xffff) {
+        out.push_back(static_cast<char>(marker16)); writeBigEndian(out, size, 2);
+      } else {
+        out.push_back(static_cast<char>(marker32)); writeBigEndian(out, size, 4);
+      }
+    }
+    // Values are built in place: no temporary strings, keys moved into members
+    static inline JSON decodeString(const char *&cursor, const char *end, size_t size) {
+      if (static_cast<size_t>(end - cursor) < size) {
+        throw std::invalid_argument("truncated MessagePack data");
+      }
+      JSON value(JSON::value_t::string);
+      value.get_ptr<JSON::string_t*>()->assign(cursor, size);
+      cursor += size;
+      return value;
+    }
+    static inline JSON decodeArray(const char *&cursor, const char *end, size_t size) {
+      JSON array(JSON::value_t::array);
+      auto elements = array.get_ptr<JSON::array_t*>();
+      // Every element takes at least a byte, so size can't reserve past the input
+      elements->reserve(std::min(size, static_cast<size_t>(end - cursor)));
+      for (size_t i = 0; i < size; ++i) {elements->push_back(decode(cursor, end));}
+      return array;
+    }
+    static inline JSON decodeObject(const char *&cursor, const char *end, size_t size) {
+      JSON object(JSON::value_t::object);
+      auto members = object.get_ptr<JSON::object_t*>();
+      for (size_t i = 0; i < size; ++i) {
+        auto member = members->emplace(readString(cursor, end), JSON()).first;
+        member->second = decode(cursor, end); // the last of duplicate keys wins
+      }
+      return object;
+    }
+  };
+
+#pragma mark - Snapshot
+  /**
+   * Binary snapshots of whole component trees.
+   *
+   * Layout: the magic "RSNP", a format version byte, then every node in pre-order
+   * as MessagePack values: type name, key (a string, integer, boolean or nil),
+   * props, state and child count.
+   * Restoring decodes the values straight from the buffer and rehydrates each
+   * node through a Registry; state is assigned without running the lifecycle.
+   * Type names are looked up once per snapshot, and string keys are interned
+   * a batch of nodes at a time.
+   */
+  class Snapshot {
+  public:
+    static const uint8_t kVersion = 1;
+
+    /**
+     * Appends a snapshot of root to out.
+     * @throws std::out_of_range if a component's type is not registered
+     */
+    static inline void save(const Component &root, const Registry &registry,
+                            std::string &out) {
+      out.append("RSNP", 4);
+      out.push_back(static_cast<char>(kVersion));
+      saveNode(root, registry, out);
+    }
+    static inline std::string save(const Component &root, const Registry &registry) {
+      std::string out;
+      save(root, registry, out);
+      return out;
+    }
+
+    /**
+     * Restores the tree saved at cursor and advances cursor past it.
+     * @throws std::invalid_argument on malformed data
+     */
+    static inline SharedComponent restore(const char *&cursor, const char *end,
+                                          const Registry &registry) {
+      if (end - cursor < 5 || std::string(cursor, 4) != "RSNP") {
+        throw std::invalid_argument("not a component snapshot");
+      }
+      if (static_cast<uint8_t>(cursor[4]) != kVersion) {
+        throw std::invalid_argument("unsupported snapshot version");
+      }
+      cursor += 5;
+      return restoreNode(cursor, end, registry);
+    }
+    static inline SharedComponent restore(const std::string &data,
+                                          const Registry &registry) {
+      const char *cursor = data.data();
+      return restore(cursor, data.data() + data.size(), registry);
+    }
+
+  private:
+    static inline void saveNode(const Component &root, const Registry &registry,
+                                std::string &out) {
+      std::vector<const Component*> stack(1, &root);
+      while (!stack.empty()) {
+        auto component = stack.back();
+        stack.pop_back();
+        const auto &type = registry.typeOf(*component);
+        if (type.empty()) {
+          throw std::out_of_range(std::string("unregistered component type: ") +
+                                  typeid(*component).name());
+        }
+        MessagePack::writeString(out, type);
+        MessagePack::encode(component->_key.toJSON(), out);
+        MessagePack::encode(*component->_props, out);
+        MessagePack::encode(*component->_state, out);
+
+        size_t count = 0;
+        for (auto &child : component->_children) {if (child) ++count;}
+        MessagePack::writeInteger(out, static_cast<int64_t>(count));
+        const auto &children = component->_children;
+        for (auto it = children.rbegin(); it != children.rend(); ++it) {
+          if (*it) stack.push_back(it->get());
+        }
+      }
+    }
+
+    enum : size_t {kBatchSize = 256}; // nodes read before their keys are interned
+
+    // A node whose header has been read, waiting for its children.
+    struct Frame {
+      size_t type; // index into the snapshot's Types
+      Key key;
+      Props props;
+      State state;
+      uint64_t count;
+      NodeList children;
+    };
+
+    // The type names of a snapshot, each looked up in the Registry once.
+    class Types {
+    public:
+      explicit Types(const Registry &registry) : _registry(registry) {}
+
+      inline size_t read(const char *&cursor, const char *end) {
+        const char *data;
+        auto size = MessagePack::readString(cursor, end, data);
+        // Siblings usually share a type
+        if (_last < _names.size() && _names[_last].compare(0, std::string::npos, data, size) == 0) {
+          return _last;
+        }
+        std::string name(data, size);
+        auto it = _indices.find(name);
+        if (it == std::end(_indices)) {
+          _resolved.push_back(_registry.resolve(name));
+          _names.push_back(name);
+          it = _indices.emplace(std::move(name), _names.size() - 1).first;
+        }
+        return _last = it->second;
+      }
+      inline const Registry::Resolved &operator[](size_t type) const {return _resolved[type];}
+
+    private:
+      const Registry &_registry;
+      std::vector<Registry::Resolved> _resolved;
+      std::vector<std::string> _names;
+      std::unordered_map<std::string, size_t> _indices;
+      size_t _last = 0;
+    };
+
+    /**
+     * Reads frame's key. String keys are left for Key::intern() to fill in
+     * with the rest of the batch.
+     */
+    static inline void readKey(const char *&cursor, const char *end, Frame &frame,
+                               std::vector<Key::Pending> &pending) {
+      if (cursor == end) throw std::invalid_argument("truncated MessagePack data");
+      auto byte = static_cast<uint8_t>(*cursor);
+      if ((byte & 0xe0) == 0xa0 || (byte >= 0xd9 && byte <= 0xdb)) {
+        Key::Pending string;
+        string.size = MessagePack::readString(cursor, end, string.data);
+        string.key = &frame.key;
+        pending.push_back(string);
+        return;
+      }
+      frame.key = Key::fromJSON(MessagePack::decode(cursor, end));
+    }
+
+    static inline SharedComponent restoreNode(const char *&cursor, const char *end,
+                                              const Registry &registry) {
+      Types types(registry);
+      std::vector<Frame> stack, frames;
+      std::vector<Key::Pending> pending;
+      frames.reserve(kBatchSize); // pending points at their keys
+      SharedComponent root;
+      uint64_t remaining = 1; // nodes counted by their parents but not read yet
+      while (remaining > 0) {
+        // Read a batch of nodes, then intern their keys in one go...
+        do {
+          frames.emplace_back();
+          auto &frame = frames.back();
+          frame.type = types.read(cursor, end);
+          readKey(cursor, end, frame, pending);
+          frame.props = MessagePack::decode(cursor, end);
+          frame.state = MessagePack::decode(cursor, end);
+          frame.count = MessagePack::readUnsigned(cursor, end);
+          if (frame.count > static_cast<uint64_t>(end - cursor)) {
+            throw std::invalid_argument("truncated component snapshot");
+          }
+          remaining = remaining - 1 + frame.count;
+        } while (remaining > 0 && frames.size() < kBatchSize);
+        Key::intern(pending);
+        pending.clear();
+
+        // ...then construct them.
+        for (auto &frame : frames) {
+          frame.children.reserve(static_cast<size_t>(frame.count));
+          stack.push_back(std::move(frame));
+
+          // Create every node whose children are complete, bottom-up.
+          while (!stack.empty() && stack.back().children.size() == stack.back().count) {
+            auto &top = stack.back();
+            auto component = registry.create(types[top.type], std::move(top.key),
+                                             std::move(top.props), std::move(top.children));
+            if (!top.state.is_null()) { // else it's as constructed: nothing to publish
+              component->commitState(std::make_shared<const State>(std::move(top.state)));
+            }
+            stack.pop_back();
+            if (stack.empty()) {
+              root = std::move(component);
+            } else {
+              stack.back().children.push_back(std::move(component));
+            }
+          }
+        }
+        frames.clear();
+      }
+      return root;
+    }
+  };
+
+#pragma mark - WriteAheadLog
+  /**
+   * Opt-in durability for component state.
+   *
+   * Once attached to a root, every merged partial state in the tree is appended
+   * to a binary log as [length][crc32][sequence, key path, partial state], the
+   * payload encoded with MessagePack. Records are buffered and flushed with one
+   * write() and fsync() per group: once a group fills up, or at the latest
+   * groupCommitInterval after its first record, by a background thread if no
+   * further record arrives. Checkpoints store a Snapshot of the whole tree
+   * and truncate the log; recover() restores the last checkpoint and replays the
+   * intact records logged after it.
+   *
+   * Only state is logged: adding or removing children becomes durable at the
+   * next checkpoint().
+   */
+  class WriteAheadLog : public StateObserver,
+                        public std::enable_shared_from_this<WriteAheadLog> {
+  public:
+    struct Options {
+      size_t groupCommitRecords = 128;
+      size_t groupCommitBytes = 64 * 1024;
+      // Longest a record stays buffered; zero commits every record, max()
+      // leaves it to commit() and full groups
+      std::chrono::milliseconds groupCommitInterval = std::chrono::milliseconds(10);
+      size_t checkpointRecords = 100000; // 0 disables automatic checkpoints
+    };
+    struct Stats {
+      uint64_t records = 0;
+      uint64_t commits = 0;
+      uint64_t checkpoints = 0;
+    };
+
+    /**
+     * @throws std::system_error if the log can't be opened
+     */
+    WriteAheadLog(std::string logPath,
+                  std::string checkpointPath,
+                  const Registry &registry) :
+    WriteAheadLog(std::move(logPath), std::move(checkpointPath), registry, Options()) {}
+    WriteAheadLog(std::string logPath,
+                  std::string checkpointPath,
+                  const Registry &registry,
+                  Options options) :
+    _logPath(std::move(logPath)), _checkpointPath(std::move(checkpointPath)),
+    _registry(registry), _options(options),
+    _lastCommit(std::chrono::steady_clock::now()) {
+      _fd = ::open(_logPath.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+      if (_fd < 0) throwSystemError("open " + _logPath);
+      if (_options.groupCommitInterval > std::chrono::milliseconds::zero() &&
+          _options.groupCommitInterval != std::chrono::milliseconds::max()) {
+        _flusher = std::thread([this] {flushLoop();});
+      }
+    }
+    WriteAheadLog(const WriteAheadLog&) = delete;
+    WriteAheadLog &operator=(const WriteAheadLog&) = delete;
+    virtual ~WriteAheadLog() {
+      if (_flusher.joinable()) {
+        {
+          std::lock_guard<std::mutex> lock(_mutex);
+          _closing = true;
+        }
+        _due.notify_one();
+        _flusher.join();
+      }
+      try {commit();} catch (...) {}
+      ::close(_fd);
+    }
+
+    /**
+     * Starts logging root's subtree and writes an initial checkpoint, which
+     * replayed records are applied on top of.
+     * The log must be owned by a std::shared_ptr.
+     */
+    inline void attach(SharedComponent const root) {
+      detach();
+      _root = root;
+      root->addStateObserver(shared_from_this());
+      checkpoint();
+    }
+    inline void detach() {
+      auto root = _root.lock();
+      if (root) root->removeStateObserver(shared_from_this());
+      _root.reset();
+    }
+
+    virtual void componentDidSetState(Component &component,
+                                      const State &partialState,
+                                      const State&) override {
+      auto root = _root.lock();
+      if (!root) return;
+
+      std::string payload;
+      MessagePack::writeInteger(payload, static_cast<int64_t>(++_sequence));
+      MessagePack::encode(component.getKeyPath(root.get()), payload);
+      MessagePack::encode(partialState, payload);
+
+      std::unique_lock<std::mutex> lock(_mutex);
+      rethrowFlushError();
+      if (_buffer.empty()) {
+        _firstBuffered = std::chrono::steady_clock::now();
+        _due.notify_one();
+      }
+      MessagePack::writeBigEndian(_buffer, payload.size(), 4);
+      MessagePack::writeBigEndian(_buffer, crc32(payload), 4);
+      _buffer.append(payload);
+      ++_pendingRecords;
+      ++_stats.records;
+      ++_recordsSinceCheckpoint;
+
+      if (_options.checkpointRecords &&
+          _recordsSinceCheckpoint >= _options.checkpointRecords) {
+        lock.unlock();
+        checkpoint();
+      } else if (_pendingRecords >= _options.groupCommitRecords ||
+                 _buffer.size() >= _options.groupCommitBytes ||
+                 std::chrono::steady_clock::now() - _lastCommit >=
+                 _options.groupCommitInterval) {
+        commitLocked();
+      }
+    }
+
+    /**
+     * Writes and fsyncs all buffered records.
+     * Call this before acknowledging a change to make it durable right away;
+     * otherwise it is at most groupCommitInterval away.
+     *
+     * @throws std::system_error if this or a background commit failed
+     */
+    inline void commit() {
+      std::lock_guard<std::mutex> lock(_mutex);
+      rethrowFlushError();
+      commitLocked();
+    }
+
+    /**
+     * Atomically replaces the checkpoint with a snapshot of the attached tree,
+     * then truncates the log.
+     */
+    inline void checkpoint() {
+      auto root = _root.lock();
+      if (!root) return;
+      std::lock_guard<std::mutex> lock(_mutex);
+      rethrowFlushError();
+      commitLocked();
+
+      std::string data;
+      MessagePack::writeInteger(data, static_cast<int64_t>(_sequence));
+      Snapshot::save(*root, _registry, data);
+
+      auto tmpPath = _checkpointPath + ".tmp";
+      int fd = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (fd < 0) throwSystemError("open " + tmpPath);
+      try {
+        writeAll(fd, data, tmpPath);
+        if (::fsync(fd) != 0) throwSystemError("fsync " + tmpPath);
+      } catch (...) {
+        ::close(fd);
+        throw;
+      }
+      ::close(fd);
+      if (std::rename(tmpPath.c_str(), _checkpointPath.c_str()) != 0) {
+        throwSystemError("rename " + tmpPath);
+      }
+      // The rename is only durable once its directory is; until then a crash
+      // could bring back the old checkpoint, so truncating the log must wait.
+      syncDirectory(_checkpointPath);
+      // Records up to the checkpoint's sequence are skipped on replay, so a
+      // crash before the truncation below is harmless.
+      if (::ftruncate(_fd, 0) != 0) throwSystemError("ftruncate " + _logPath);
+      if (::fsync(_fd) != 0) throwSystemError("fsync " + _logPath);
+      _recordsSinceCheckpoint = 0;
+      ++_stats.checkpoints;
+    }
+
+    /**
+     * Restores the tree from the last checkpoint plus the log tail.
+     * State is merged without running the update lifecycle. Replay stops at the
+     * first torn or corrupt record, which is cut off so new records follow valid
+     * ones.
+     *
+     * @returns the restored root, or nullptr if there is no checkpoint
+     */
+    inline SharedComponent recover() {
+      std::string data;
+      if (!readFile(_checkpointPath, data)) return nullptr;
+      const char *cursor = data.data();
+      const char *end = data.data() + data.size();
+      uint64_t checkpointSequence = MessagePack::readUnsigned(cursor, end);
+      auto root = Snapshot::restore(cursor, end, _registry);
+      _sequence = checkpointSequence;
+
+      std::string log;
+      readFile(_logPath, log);
+      size_t offset = 0;
+      while (log.size() - offset >= 8) {
+        const char *header = log.data() + offset;
+        auto length = MessagePack::readBigEndian(header, header + 4, 4);
+        auto checksum = MessagePack::readBigEndian(header, header + 4, 4);
+        if (log.size() - offset - 8 < length) break;
+        std::string payload = log.substr(offset + 8, static_cast<size_t>(length));
+        if (crc32(payload) != checksum) break;
+        try {
+          replay(*root, payload);
+        } catch (const std::invalid_argument&) {
+          break;
+        }
+        offset += 8 + static_cast<size_t>(length);
+      }
+      std::lock_guard<std::mutex> lock(_mutex);
+      if (offset < log.size() && ::ftruncate(_fd, static_cast<off_t>(offset)) != 0) {
+        throwSystemError("ftruncate " + _logPath);
+      }
+      return root;
+    }
+
+    inline Stats getStats() const {
+      std::lock_guard<std::mutex> lock(_mutex);
+      return _stats;
+    }
+
+  private:
+    inline void commitLocked() {
+      if (_buffer.empty()) return;
+      writeAll(_fd, _buffer, _logPath);
+      if (::fsync(_fd) != 0) throwSystemError("fsync " + _logPath);
+      _buffer.clear();
+      _pendingRecords = 0;
+      _lastCommit = std::chrono::steady_clock::now();
+      ++_stats.commits;
+    }
+    inline void rethrowFlushError() {
+      if (!_flushError) return;
+      auto error = _flushError;
+      _flushError = nullptr;
+      std::rethrow_exception(error);
+    }
+    /**
+     * Commits a group once its first record has waited groupCommitInterval,
+     * so the last records before a pause don't wait for the next one.
+     * Failures are rethrown on the owning thread by its next call.
+     */
+    inline void flushLoop() {
+      std::unique_lock<std::mutex> lock(_mutex);
+      while (!_closing) {
+        if (_buffer.empty() || _flushError) {
+          _due.wait(lock);
+          continue;
+        }
+        auto due = _firstBuffered + _options.groupCommitInterval;
+        if (std::chrono::steady_clock::now() < due) {
+          _due.wait_until(lock, due);
+          continue;
+        }
+        try {
+          commitLocked();
+        } catch (...) {
+          _flushError = std::current_exception();
+        }
+      }
+    }
+
+    inline void replay(Component &root, const std::string &payload) {
+      const char *cursor = payload.data();
+      const char *end = payload.data() + payload.size();
+      uint64_t sequence = MessagePack::readUnsigned(cursor, end);
+      JSON keys = MessagePack::decode(cursor, end);
+      State partialState = MessagePack::decode(cursor, end);
+      if (sequence <= _sequence) return;
+      _sequence = sequence;
+
+      // The component may have been removed after the checkpoint.
+      Component *component = root.findByKeyPath(keys);
+      if (!component) return;
+      auto state = std::make_shared<State>(*component->_state);
+      for (auto it = partialState.begin(); it != partialState.end(); ++it) {
+        (*state)[it.key()] = it.value();
+      }
+      component->commitState(std::move(state));
+      component->invalidateHash();
+    }
+
+    static inline uint32_t crc32(const std::string &data) {
+      static const std::vector<uint32_t> table = [] {
+        std::vector<uint32_t> t(256);
+        for (uint32_t i = 0; i < 256; ++i) {
+          uint32_t c = i;
+          for (int k = 0; k < 8; ++k) {c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;}
+          t[i] = c;
+        }
+        return t;
+      }();
+      uint32_t crc = 0xffffffffu;
+      for (unsigned char byte : data) {crc = table[(crc ^ byte) & 0xff] ^ (crc >> 8);}
+      return crc ^ 0xffffffffu;
+    }
+    static inline void writeAll(int fd, const std::string &data, const std::string &path) {
+      size_t written = 0;
+      while (written < data.size()) {
+        auto n = ::write(fd, data.data() + written, data.size() - written);
+        if (n < 0) {
+          if (errno == EINTR) continue;
+          throwSystemError("write " + path);
+        }
+        written += static_cast<size_t>(n);
+      }
+    }
+    static inline bool readFile(const std::string &path, std::string &out) {
+      std::ifstream file(path, std::ios::binary);
+      if (!file) return false;
+      out.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+      return true;
+    }
+    static inline void throwSystemError(const std::string &what) {
+      throw std::system_error(errno, std::generic_category(), what);
+    }
+    /**
+     * fsyncs the directory containing path.
+     */
+    static inline void syncDirectory(const std::string &path) {
+      auto slash = path.rfind('/');
+      auto directory = slash == std::string::npos ? std::string(".") :
+                       slash == 0 ? std::string("/") : path.substr(0, slash);
+      int fd = ::open(directory.c_str(), O_RDONLY);
+      if (fd < 0) throwSystemError("open " + directory);
+      // EINVAL: the file system doesn't sync directories.
+      if (::fsync(fd) != 0 && errno != EINVAL) {
+        auto error = errno;
+        ::close(fd);
+        errno = error;
+        throwSystemError("fsync " + directory);
+      }
+      ::close(fd);
+    }
+
+    std::string _logPath;
+    std::string _checkpointPath;
+    const Registry &_registry;
+    Options _options;
+    int _fd = -1;
+    std::string _buffer;
+    size_t _pendingRecords = 0;
+    size_t _recordsSinceCheckpoint = 0;
+    uint64_t _sequence = 0;
+    std::chrono::steady_clock::time_point _lastCommit;
+    std::chrono::steady_clock::time_point _firstBuffered; // of the buffered group
+    std::weak_ptr<Component> _root;
+    Stats _stats;
+    mutable std::mutex _mutex; // the buffer, the log file and stats
+    std::condition_variable _due;
+    std::exception_ptr _flushError;
+    bool _closing = false;
+    std::thread _flusher;
+  };
+
+#pragma mark - Patch
+  /**
+   * Structural diff and patch of JSON values using RFC 6902 (JSON Patch)
+   * operations addressed by RFC 6901 (JSON Pointer) paths.
+   * @see https://tools.ietf.org/html/rfc6902
+   */
+  class Patch {
+  public:
+    /**
+     * @returns an array of operations turning source into target
+     */
+    static inline JSON diff(const JSON &source, const JSON &target,
+                            const std::string &path = "") {
+      JSON operations = JSON::array();
+      diff(source, target, path, operations);
+      return operations;
+    }
+    /**
+     * Appends the operations turning source into target to operations.
+     */
+    static inline void diff(const JSON &source, const JSON &target,
+                            const std::string &path, JSON &operations) {
+      if (source.type() != target.type()) {
+        operations.push_back(operation("replace", path, target));
+        return;
+      }
+      switch (source.type()) {
+        case JSON::value_t::object: {
+          for (auto it = source.begin(); it != source.end(); ++it) {
+            auto key = it.key();
+            auto other = target.find(key);
+            if (other == target.end()) {
+              operations.push_back(operation("remove", path + "/" + escape(key)));
+            } else {
+              diff(it.value(), *other, path + "/" + escape(key), operations);
+            }
+          }
+          for (auto it = target.begin(); it != target.end(); ++it) {
+            auto key = it.key();
+            if (source.find(key) == source.end()) {
+              operations.push_back(operation("add", path + "/" + escape(key), it.value()));
+            }
+          }
+          break;
+        }
+        case JSON::value_t::array: {
+          size_t common = std::min(source.size(), target.size());
+          for (size_t i = 0; i < common; ++i) {
+            diff(source[i], target[i], path + "/" + std::to_string(i), operations);
+          }
+          // Remove from the back so earlier indices stay valid.
+          for (size_t i = source.size(); i > common; --i) {
+            operations.push_back(operation("remove", path + "/" + std::to_string(i - 1)));
+          }
+          for (size_t i = common; i < target.size(); ++i) {
+            operations.push_back(operation("add", path + "/-", target[i]));
+          }
+          break;
+        }
+        default:
+          if (source != target) operations.push_back(operation("replace", path, target));
+          break;
+      }
+    }
+
+    /**
+     * Applies patch to document in place.
+     * Supports add, remove, replace, move, copy and test.
+     *
+     * @throws std::invalid_argument for malformed operations or failed tests
+     * @throws std::out_of_range for paths that don't exist
+     */
+    static inline void apply(JSON &document, const JSON &patch) {
+      if (!patch.is_array()) throw std::invalid_argument("patch must be an array");
+      for (auto &op : patch) {
+        if (!op.is_object()) throw std::invalid_argument("malformed patch operation");
+        auto name = member(op, "op");
+        auto path = member(op, "path");
+        if (name == "add") {
+          add(document, path, value(op));
+        } else if (name == "remove") {
+          remove(document, path);
+        } else if (name == "replace") {
+          auto &replacement = value(op);
+          remove(document, path);
+          add(document, path, replacement);
+        } else if (name == "move" || name == "copy") {
+          auto fromPath = member(op, "from");
+          JSON moved = resolve(document, fromPath);
+          if (name == "move") remove(document, fromPath);
+          add(document, path, std::move(moved));
+        } else if (name == "test") {
+          if (resolve(document, path) != value(op)) {
+            throw std::invalid_argument("patch test failed at " + path);
+          }
+        } else {
+          throw std::invalid_argument("unknown patch operation: " + name);
+        }
+      }
+    }
+    static inline JSON applied(JSON document, const JSON &patch) {
+      apply(document, patch);
+      return document;
+    }
+
+    static inline std::string escape(const std::string &token) {
+      std::string escaped;
+      escaped.reserve(token.size());
+      for (char c : token) {
+        if (c == '~') escaped += "~0";
+        else if (c == '/') escaped += "~1";
+        else escaped += c;
+      }
+      return escaped;
+    }
+    static inline std::string unescape(const std::string &token) {
+      std::string unescaped;
+      unescaped.reserve(token.size());
+      for (size_t i = 0; i < token.size(); ++i) {
+        if (token[i] == '~' && i + 1 < token.size()) {
+          unescaped += token[++i] == '1' ? '/' : '~';
+        } else {
+          unescaped += token[i];
+        }
+      }
+      return unescaped;
+    }
+
+  private:
+    static inline JSON operation(const char *name, const std::string &path) {
+      JSON op = JSON::object();
+      op["op"] = name;
+      op["path"] = path;
+      return op;
+    }
+    static inline JSON operation(const char *name, const std::string &path,
+                                 const JSON &value) {
+      JSON op = operation(name, path);
+      op["value"] = value;
+      return op;
+    }
+    static inline const JSON &value(const JSON &op) {
+      auto it = op.find("value");
+      if (it == op.end()) throw std::invalid_argument("patch operation is missing value");
+      return *it;
+    }
+    static inline const std::string &member(const JSON &op, const char *name) {
+      auto it = op.find(name);
+      if (it == op.end() || !it->is_string()) {
+        throw std::invalid_argument(std::string("patch operation is missing ") + name);
+      }
+      return *it->get_ptr<const std::string*>();
+    }
+
+    static inline std::vector<std::string> split(const std::string &path) {
+      std::vector<std::string> tokens;
+      if (path.empty()) return tokens;
+      if (path[0] != '/') throw std::invalid_argument("invalid JSON pointer: " + path);
+      size_t start = 1;
+      for (;;) {
+        auto slash = path.find('/', start);
+        tokens.push_back(unescape(path.substr(start, slash - start)));
+        if (slash == std::string::npos) break;
+        start = slash + 1;
+      }
+      return tokens;
+    }
+    static inline size_t index(const JSON &array, const std::string &token, bool append) {
+      if (append && token == "-") return array.size();
+      if (token.empty() || token.find_first_not_of("0123456789") != std::string::npos) {
+        throw std::out_of_range("invalid array index: " + token);
+      }
+      size_t i = std::stoul(token);
+      if (i > array.size() || (!append && i == array.size())) {
+        throw std::out_of_range("array index out of range: " + token);
+      }
+      return i;
+    }
+    static inline JSON &step(JSON &value, const std::string &token) {
+      if (value.is_object()) {
+        auto it = value.find(token);
+        if (it == value.end()) throw std::out_of_range("no such key: " + token);
+        return *it;
+      }
+      if (value.is_array()) return value[index(value, token, false)];
+      throw std::out_of_range("can't descend into a primitive at " + token);
+    }
+    static inline JSON &resolve(JSON &document, const std::string &path) {
+      JSON *value = &document;
+      for (auto &token : split(path)) {value = &step(*value, token);}
+      return *value;
+    }
+    static inline void add(JSON &document, const std::string &path, JSON value) {
+      auto tokens = split(path);
+      if (tokens.empty()) {
+        document = std::move(value);
+        return;
+      }
+      JSON *parent = &document;
+      for (size_t i = 0; i + 1 < tokens.size(); ++i) {parent = &step(*parent, tokens[i]);}
+      auto &last = tokens.back();
+      if (parent->is_object()) {
+        (*parent)[last] = std::move(value);
+      } else if (parent->is_array()) {
+        auto i = index(*parent, last, true);
+        parent->insert(parent->begin() + static_cast<std::ptrdiff_t>(i), std::move(value));
+      } else {
+        throw std::out_of_range("can't add to a primitive at " + path);
+      }
+    }
+    static inline void remove(JSON &document, const std::string &path) {
+      auto tokens = split(path);
+      if (tokens.empty()) {
+        document = JSON();
+        return;
+      }
+      JSON *parent = &document;
+      for (size_t i = 0; i + 1 < tokens.size(); ++i) {parent = &step(*parent, tokens[i]);}
+      auto &last = tokens.back();
+      if (parent->is_object()) {
+        if (!parent->erase(last)) throw std::out_of_range("no such key: " + last);
+      } else if (parent->is_array()) {
+        parent->erase(index(*parent, last, false));
+      } else {
+        throw std::out_of_range("can't remove from a primitive at " + path);
+      }
+    }
+  };
+
+#pragma mark - StateReplicator
+  /**
+   * Mirrors state changes of a subtree to another process as JSON Patch deltas.
+   *
+   * Only the keys named in each setState() are diffed, so the cost scales with
+   * the size of the change rather than the size of the state. Every change is
+   * handed to the sink as {"path": [keys from the root], "patch": [...]};
+   * serializing and shipping it (e.g. with MessagePack) is up to the sink.
+   * On the receiving side, apply() patches the mirrored tree through setState().
+   */
+  class StateReplicator : public StateObserver {
+  public:
+    typedef std::function<void(const JSON &delta)> Sink;
+
+    StateReplicator(Sink sink, const Component *root = nullptr) :
+    _sink(std::move(sink)), _root(root) {}
+
+    virtual void componentDidSetState(Component &component,
+                                      const State &partialState,
+                                      const State &prevState) override {
+      JSON patch = JSON::array();
+      const auto &state = component.getState();
+      for (auto it = partialState.begin(); it != partialState.end(); ++it) {
+        auto key = it.key();
+        auto path = "/" + Patch::escape(key);
+        auto prev = prevState.find(key);
+        auto next = state.find(key);
+        if (next == state.end()) continue;
+        if (prev == prevState.end()) {
+          JSON op = JSON::object();
+          op["op"] = "add";
+          op["path"] = path;
+          op["value"] = *next;
+          patch.push_back(std::move(op));
+        } else {
+          Patch::diff(*prev, *next, path, patch);
+        }
+      }
+      if (patch.empty()) return;
+
+      JSON delta = JSON::object();
+      delta["path"] = component.getKeyPath(_root);
+      delta["patch"] = std::move(patch);
+      _sink(delta);
+    }
 
-#pragma mark - Component
-  class Component {
+    /**
+     * Applies a delta produced by a replicator to the mirrored tree under root.
+     * @returns false if the target component doesn't exist
+     * @throws std::invalid_argument for malformed deltas, and what
+     * Patch::apply() throws
+     */
+    static inline bool apply(Component &root, const JSON &delta) {
+      if (!delta.is_object()) throw std::invalid_argument("malformed state delta");
+      auto keyPath = delta.find("path");
+      auto patch = delta.find("patch");
+      if (keyPath == delta.end() || patch == delta.end()) {
+        throw std::invalid_argument("malformed state delta");
+      }
+      auto component = root.findByKeyPath(*keyPath);
+      if (!component) return false;
+      const auto &state = component->getState();
+      State patched = state.is_null() ? State::object() : state;
+      Patch::apply(patched, *patch);
+      if (!patched.is_object()) throw std::invalid_argument("state delta replaced the state");
+
+      State partialState = State::object();
+      for (auto &op : *patch) {
+        auto &path = *op.find("path")->get_ptr<const std::string*>(); // checked by Patch::apply
+        if (path.empty()) { // the whole state
+          partialState = patched;
+          break;
+        }
+        auto key = Patch::unescape(path.substr(1, path.find('/', 1) - 1));
+        auto it = patched.find(key);
+        if (it != patched.end()) partialState[key] = *it;
+      }
+      component->setState(partialState);
+      return true;
+    }
+
+  private:
+    Sink _sink;
+    const Component *_root;
+  };
+
+#pragma mark - VirtualList
+  /**
+   * A list of getItemCount() logical rows that only materializes children for
+   * the visible window plus overscan. Rows leaving the window are recycled for
+   * rows entering it, so memory is proportional to the window, not the dataset.
+   *
+   * Rows are keyed by their (integer) index. getChildren() holds the materialized rows in
+   * index order, starting at getFirstMaterialized().
+   */
+  class VirtualList : public Component {
   public:
-    Component() : Component("", {}, {}){}
-    Component(const std::string key,
-              const Props props,
-              const NodeList children) :
-    _key(key), _props(props) {addChildren(children);} // componentDidMount()
-    virtual ~Component() {} // componentWillUnmount()
+    typedef std::function<SharedComponent(Key key, Props props)> RowFactory;
+    typedef std::function<Props(size_t index)> RowProps;
+    struct Stats {
+      uint64_t created = 0;
+      uint64_t recycled = 0;
+    };
+
+    VirtualList(Key key,
+                RowFactory factory,
+                RowProps rowProps,
+                Props props = Props()) :
+    Component(std::move(key), std::move(props), NodeList()),
+    _factory(std::move(factory)), _rowProps(std::move(rowProps)) {}
+
+    virtual void render(bool) override {}
+
+    inline void setItemCount(size_t count) {
+      _itemCount = count;
+      materialize();
+    }
+    inline size_t getItemCount() const {return _itemCount;}
 
-#pragma mark - Updating
-    ////////////////////////////////////////////////////////////////////////////////////
     /**
-     * Invoked before rendering when new props or state are being received.
-     * This method is not called for the initial render or when forceUpdate is used.
-     * Use this as an opportunity to return false when you're certain that the
-     * transition to the new props and state will not require a component update.
-     *
-     * If shouldComponentUpdate returns false, then render() will be completely
-     * skipped until the next state change.
-     * In addition, componentWillUpdate and componentDidUpdate will not be called.
-     *
-     * By default, shouldComponentUpdate always returns true to prevent subtle bugs
-     * when state is mutated in place, but if you are careful to always treat state
-     * as immutable and to read only from props and state in render() then you can
-     * override shouldComponentUpdate with an implementation that compares the old
-     * props and state to their replacements.
-     *
-     * If performance is a bottleneck, especially with dozens or hundreds of components,
-     * use shouldComponentUpdate to speed up your app.
+     * @param[in] first index of the first visible row
+     * @param[in] count of visible rows
+     */
+    inline void setWindow(size_t first, size_t count) {
+      _first = first;
+      _count = count;
+      materialize();
+    }
+    inline void setOverscan(size_t overscan) {
+      _overscan = overscan;
+      materialize();
+    }
+    inline size_t getFirstMaterialized() const {return _begin;}
+
+    /**
+     * Re-reads props for every materialized row, e.g. after the data changed.
+     * Rows keep their state; see Component::setProps().
+     */
+    inline void refresh() {
+      for (size_t i = 0; i < _children.size(); ++i) {
+        _children[i]->setProps(_rowProps(_begin + i));
+      }
+    }
+
+    inline const Stats &getStats() const {return _stats;}
+
+  private:
+    inline void materialize() {
+      size_t begin = std::min(_itemCount, _first > _overscan ? _first - _overscan : 0);
+      size_t end = std::min(_itemCount, _first + _count + _overscan);
+      if (begin == _begin && end == _begin + _children.size()) return;
+
+      // Rows outside the new range become spares for the ones entering it.
+      // Detached, so late updates and tasks can't reach the list through them.
+      size_t oldBegin = _begin, oldEnd = _begin + _children.size();
+      for (size_t i = oldBegin; i < oldEnd; ++i) {
+        if (i >= begin && i < end) continue;
+        auto &row = _children[i - oldBegin];
+        row->setParent(nullptr);
+        row->cancelUpdates();
+#ifdef JGOD_REACTIVE_COROUTINES
+        row->cancelTasks();
+#endif
+        _spares.push_back(std::move(row));
+      }
+
+      NodeList rows;
+      rows.reserve(end - begin);
+      for (size_t i = begin; i < end; ++i) {
+        if (i >= oldBegin && i < oldEnd) {
+          rows.push_back(std::move(_children[i - oldBegin]));
+        } else if (!_spares.empty()) {
+          rows.push_back(std::move(_spares.back()));
+          _spares.pop_back();
+          rows.back()->recycle(Key(i), _rowProps(i));
+          rows.back()->setParent(this);
+          ++_stats.recycled;
+        } else {
+          rows.push_back(_factory(Key(i), _rowProps(i)));
+          rows.back()->setParent(this);
+          ++_stats.created;
+        }
+      }
+      _children = std::move(rows);
+      _begin = begin;
+      // Keep no more spares than one window's worth.
+      while (_spares.size() > _children.size()) {
+        auto spare = std::move(_spares.back());
+        _spares.pop_back();
+        release(spare, findDisposalQueue());
+      }
+      invalidateHash();
+    }
+
+    RowFactory _factory;
+    RowProps _rowProps;
+    size_t _itemCount = 0;
+    size_t _first = 0;
+    size_t _count = 0;
+    size_t _overscan = 0;
+    size_t _begin = 0;
+    NodeList _spares;
+    Stats _stats;
+  };
+
+#pragma mark - TreeSync
+  /**
+   * Brings a target tree in line with a source tree, descending only into
+   * subtrees whose subtreeHash() differs.
+   *
+   * Children are matched by key and type. Props and state are shared with
+   * the source, without running the update lifecycle; children missing from
+   * the target, or of another type, are cloned from the source through the
+   * registry.
+   * Children replaced or dropped from the target are released like removed
+   * ones, to its pool or disposal queue.
+   */
+  class TreeSync {
+  public:
+    struct Result {
+      size_t visited = 0; // components whose subtree hash had to be compared
+      size_t updated = 0; // components whose props or state were copied
+      size_t replaced = 0; // components cloned from source
+      size_t removed = 0; // children dropped from target
+    };
+
+    /**
+     * @returns what it took to sync; target must have source's key
+     * @throws std::out_of_range if a clone is needed for an unregistered type
+     */
+    static inline Result sync(Component &target, const Component &source,
+                              const Registry &registry) {
+      Result result;
+      syncNode(target, source, registry, result);
+      return result;
+    }
+
+    /**
+     * Deep copy of source, created through the registry. Props and state are
+     * shared with source rather than copied, for types whose factory takes
+     * SharedProps; see Registry::add().
+     */
+    static inline SharedComponent clone(const Component &source, const Registry &registry) {
+      // Post-order with an explicit stack, so deep trees don't recurse.
+      std::vector<CloneFrame> stack;
+      stack.push_back(CloneFrame{&source, 0, NodeList()});
+      SharedComponent root;
+      while (!stack.empty()) {
+        auto &top = stack.back();
+        const auto &children = top.source->_children;
+        while (top.next < children.size() && !children[top.next]) ++top.next;
+        if (top.next < children.size()) {
+          auto child = children[top.next++].get();
+          stack.push_back(CloneFrame{child, 0, NodeList()});
+          continue;
+        }
+        const auto &type = registry.typeOf(*top.source);
+        if (type.empty()) {
+          throw std::out_of_range(std::string("unregistered component type: ") +
+                                  typeid(*top.source).name());
+        }
+        auto component = registry.create(type, top.source->_key, top.source->_props,
+                                         std::move(top.children));
+        if (component->_props == top.source->_props) {
+          component->_propsPoolId = top.source->_propsPoolId;
+        }
+        component->commitState(top.source->_state);
+        stack.pop_back();
+        if (stack.empty()) {
+          root = std::move(component);
+        } else {
+          stack.back().children.push_back(std::move(component));
+        }
+      }
+      return root;
+    }
+
+  private:
+    // A source node whose clone waits for its children's clones.
+    struct CloneFrame {
+      const Component *source;
+      size_t next;
+      NodeList children;
+    };
+
+    static inline void syncNode(Component &root, const Component &sourceRoot,
+                                const Registry &registry, Result &result) {
+      // Children matched by key are synced after their parent's child list is
+      // rebuilt; they stay alive in it, so an explicit stack of pairs suffices.
+      std::vector<std::pair<Component*, const Component*>> stack(1, {&root, &sourceRoot});
+      while (!stack.empty()) {
+        auto &target = *stack.back().first;
+        auto &source = *stack.back().second;
+        stack.pop_back();
+        ++result.visited;
+        if (target.subtreeHash() == source.subtreeHash()) continue;
+
+        auto updated = false;
+        if (!target.hasSameProps(source)) {
+          target._props = source._props;
+          target._propsPoolId = source._propsPoolId;
+          target._propsHashValid = false;
+          updated = true;
+        }
+        if (target._state != source._state && *target._state != *source._state) {
+          target.commitState(source._state);
+          updated = true;
+        }
+        if (updated) {
+          target.invalidateHash();
+          ++result.updated;
+        }
+
+        NodeList children;
+        children.reserve(source._children.size());
+        std::unordered_set<const Component*> reused;
+        std::unique_ptr<Component::ChildIndex> index;
+        if (target._children.size() >= Component::kIndexedAddThreshold) {
+          index.reset(new Component::ChildIndex(target._children, target._children.size()));
+        }
+        auto pending = stack.size();
+        for (auto &sourceChild : source._children) {
+          if (!sourceChild) continue;
+          SharedComponent targetChild;
+          if (index) {
+            auto &key = sourceChild->_key;
+            auto found = index->slot(key, key.hash()).second;
+            if (found) targetChild = target._children[found - 1];
+          } else {
+            targetChild = target.getChild(sourceChild->_key);
+          }
+          if (targetChild && typeid(*targetChild) == typeid(*sourceChild) &&
+              reused.insert(targetChild.get()).second) {
+            stack.emplace_back(targetChild.get(), sourceChild.get());
+          } else {
+            targetChild = clone(*sourceChild, registry);
+            targetChild->setParent(&target);
+            ++result.replaced;
+          }
+          children.push_back(std::move(targetChild));
+        }
+        std::reverse(std::begin(stack) + pending, std::end(stack)); // visit in order
+        std::swap(target._children, children);
+        target.invalidateHash();
+        for (auto &child : children) { // the previous children
+          if (!child || reused.count(child.get())) continue;
+          target.release(child, target.findDisposalQueue());
+          ++result.removed;
+        }
+      }
+    }
+  };
+
+#pragma mark - Scheduler
+  /**
+   * Queues setState() calls in priority lanes and applies them from run(),
+   * higher lanes first. schedule() may be called from any thread; run() must
+   * be called on the thread that owns the components.
+   *
+   * Each update is rendered with prepareState() and then committed. If work
+   * in a higher lane arrives during that render, the render is discarded and
+   * the update goes back to the head of its lane. Updates that waited longer
+   * than their lane's timeout have expired: they jump ahead of every lane but
+   * Immediate and can no longer be interrupted, so busy higher lanes can't
+   * starve them.
+   *
+   * Committing updates out of order is rebased: an update never overwrites a
+   * key that a later-scheduled update already committed, so the final state
+   * is the same as applying every update in the order it was scheduled.
+   *
+   * runFrame() drives one frame: it applies updates within the frame budget,
+   * then hands whatever time is left to callbacks queued with
+   * requestIdleWork().
+   */
+  class Scheduler {
+  public:
+    typedef std::chrono::steady_clock Clock;
+
+    /**
+     * Passed to idle callbacks: how long they may run before the frame is due.
+     */
+    class IdleDeadline {
+    public:
+      IdleDeadline(Clock::time_point deadline, bool didTimeout)
+      : _deadline(deadline), _didTimeout(didTimeout) {}
+      inline Clock::duration timeRemaining() const {
+        auto now = Clock::now();
+        return now < _deadline ? _deadline - now : Clock::duration::zero();
+      }
+      /**
+       * @returns whether the callback runs because its timeout passed rather
+       * than because the frame had slack
+       */
+      inline bool didTimeout() const {return _didTimeout;}
+    private:
+      Clock::time_point _deadline;
+      bool _didTimeout;
+    };
+    typedef std::function<void(const IdleDeadline&)> IdleCb;
+    typedef uint64_t IdleHandle;
+
+    struct FrameResult {
+      size_t committed = 0; // updates applied
+      size_t idle = 0; // idle callbacks run
+    };
+
+    enum class Priority : uint8_t {
+      Immediate, // never deferred by the run() budget or interrupted
+      UserBlocking,
+      Normal,
+      Low,
+      Idle // never expires
+    };
+    enum : size_t {kLanes = 5};
+
+    struct Stats {
+      uint64_t committed = 0;
+      uint64_t interrupted = 0;
+      uint64_t expired = 0;
+      uint64_t dropped = 0; // components destroyed while their updates waited
+      uint64_t superseded = 0; // updates whose token was superseded
+    };
+
+    Scheduler() {
+      _timeouts[lane(Priority::Immediate)] = Clock::duration::zero();
+      _timeouts[lane(Priority::UserBlocking)] = std::chrono::milliseconds(250);
+      _timeouts[lane(Priority::Normal)] = std::chrono::seconds(5);
+      _timeouts[lane(Priority::Low)] = std::chrono::seconds(10);
+      _timeouts[lane(Priority::Idle)] = Clock::duration::max();
+    }
+
+    /**
+     * @param[in] component to merge partialState into; only weakly referenced
+     * @param[in] partialState
+     * @param[in] priority
+     * @param[in] token from component->beginUpdate(); the update is dropped
+     * if the token is superseded by the time it's applied
+     */
+    inline void schedule(const SharedComponent &component,
+                         State partialState,
+                         Priority priority = Priority::Normal,
+                         UpdateToken token = UpdateToken()) {
+      if (!component) return;
+      std::lock_guard<std::mutex> lock(_mutex);
+      Update update;
+      update.component = WeakComponent(component);
+      update.target = component.get();
+      update.partialState = std::move(partialState);
+      update.token = std::move(token);
+      update.sequence = ++_sequence;
+      update.scheduled = Clock::now();
+      _lanes[lane(priority)].push_back(std::move(update));
+      ++_rebases[component.get()].pending;
+    }
+
+    /**
+     * Applies queued updates until budget is spent. Immediate and expired
+     * updates are applied regardless of the budget.
      *
-     * @param[in] nextProps
-     * @param[in] nextState
-     * @returns bool
-     * @see https://facebook.github.io/react/docs/component-specs.html#updating-shouldcomponentupdate
+     * @param[in] budget
+     * @returns the number of updates committed; updates that leave the state
+     * as it was aren't counted
      */
-    virtual bool shouldComponentUpdate(const Props&, const State&) {return true;}
+    inline size_t run(Clock::duration budget) {
+      auto deadline = budget == Clock::duration::max() ? Clock::time_point::max()
+                                                       : Clock::now() + budget;
+      size_t committed = 0;
+      for (;;) {
+        Update update;
+        size_t index = 0;
+        bool expired = false;
+        {
+          std::lock_guard<std::mutex> lock(_mutex);
+          auto now = Clock::now();
+          if (!pick(now, index, expired)) break;
+          if (index != lane(Priority::Immediate) && !expired && now >= deadline) break;
+          update = std::move(_lanes[index].front());
+          _lanes[index].pop_front();
+          if (expired) ++_stats.expired;
+        }
+        if (apply(update, index, expired)) ++committed;
+      }
+      return committed;
+    }
 
     /**
-     * Invoked immediately before rendering when new props or state are being received.
-     * This method is not called for the initial render.
-     * Use this as an opportunity to perform preparation before an update occurs.
+     * Applies every queued update.
+     */
+    inline size_t flush() {return run(Clock::duration::max());}
+
+    /**
+     * Queues cb to run in a frame with time to spare. Callbacks run in the
+     * order they were requested, never in the frame that requested them, and
+     * should return once deadline.timeRemaining() runs out, requesting again
+     * for any work left over.
      *
-     * @param[in] nextProps
-     * @param[in] nextState
-     * @see https://facebook.github.io/react/docs/component-specs.html#updating-componentwillupdate
+     * @param[in] cb
+     * @param[in] timeout after which cb runs in the next frame even without slack
+     * @returns a handle for cancelIdleWork()
      */
-    virtual void componentWillUpdate(const Props&, const State&){}
+    inline IdleHandle requestIdleWork(IdleCb cb, Clock::duration timeout = Clock::duration::max()) {
+      std::lock_guard<std::mutex> lock(_mutex);
+      IdleTask task;
+      task.handle = ++_idleHandle;
+      task.cb = std::move(cb);
+      task.expires = timeout == Clock::duration::max() ? Clock::time_point::max()
+                                                       : Clock::now() + timeout;
+      auto handle = task.handle;
+      _idle.push_back(std::move(task));
+      return handle;
+    }
+    /**
+     * @returns whether the callback was still queued
+     */
+    inline bool cancelIdleWork(IdleHandle handle) {
+      std::lock_guard<std::mutex> lock(_mutex);
+      for (auto it = std::begin(_idle); it != std::end(_idle); ++it) {
+        if (it->handle == handle) {
+          _idle.erase(it);
+          return true;
+        }
+      }
+      return false;
+    }
+    inline size_t pendingIdleWork() const {
+      std::lock_guard<std::mutex> lock(_mutex);
+      return _idle.size();
+    }
 
     /**
-     * Invoked immediately after the component's updates are flushed to the DOM.
-     * This method is not called for the initial render.
-     * Use this as an opportunity to operate on the DOM when the component has been updated.
+     * Runs one frame: applies updates within budget, then runs idle callbacks
+     * while budget remains. Callbacks whose timeout passed run even without
+     * slack, and are told whatever slack is left. Updates left queued by the
+     * budget mean the frame has no slack.
      *
-     * @param[in] prevProps
-     * @param[in] prevState
-     * @see https://facebook.github.io/react/docs/component-specs.html#updating-componentdidupdate
+     * @param[in] budget for the whole frame
      */
-    virtual void componentDidUpdate(const Props&, const State&){}
+    inline FrameResult runFrame(Clock::duration budget) {
+      auto deadline = Clock::now() + budget;
+      FrameResult result;
+      IdleHandle last; // callbacks requested in this frame wait for the next
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        last = _idleHandle;
+      }
+      result.committed = run(budget);
 
-    inline void forceUpdate() {render(true);}
-    ////////////////////////////////////////////////////////////////////////////
+      bool busy = false;
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        for (auto &queue : _lanes) busy = busy || !queue.empty();
+      }
+      for (;;) {
+        IdleCb cb;
+        bool timedOut = false;
+        {
+          std::lock_guard<std::mutex> lock(_mutex);
+          auto now = Clock::now();
+          auto slack = !busy && now < deadline;
+          for (auto it = std::begin(_idle); it != std::end(_idle) && it->handle <= last; ++it) {
+            timedOut = now >= it->expires;
+            if (slack || timedOut) {
+              cb = std::move(it->cb);
+              _idle.erase(it);
+              break;
+            }
+          }
+        }
+        if (!cb) break;
+        // A timeout only forces the callback to run; it still gets the slack
+        cb(IdleDeadline(busy ? Clock::now() : deadline, timedOut));
+        ++result.idle;
+      }
+      return result;
+    }
+
+    inline size_t pending() const {
+      std::lock_guard<std::mutex> lock(_mutex);
+      size_t count = 0;
+      for (auto &queue : _lanes) count += queue.size();
+      return count;
+    }
+    inline size_t pending(Priority priority) const {
+      std::lock_guard<std::mutex> lock(_mutex);
+      return _lanes[lane(priority)].size();
+    }
 
-#pragma mark - State
-    ////////////////////////////////////////////////////////////////////////////
     /**
-     * Performs a shallow merge of nextState into current state.
-     * This is the primary method you use to trigger UI updates from event handlers
-     * and server request callbacks.
-     *
-     * @param[in] nextState
-     * @param[in] cb(prevState, currentProps)
-     * @see https://facebook.github.io/react/docs/component-api.html#setstate
+     * Sets how long updates of priority may wait before they expire.
      */
-    inline void setState(const State &nextState,
-                         const UpdateCb &cb = [](const State&,
-                                                 const Props&){}) {
-      auto prevState = _state;
+    inline void setTimeout(Priority priority, Clock::duration timeout) {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _timeouts[lane(priority)] = timeout;
+    }
+    inline Stats getStats() const {
+      std::lock_guard<std::mutex> lock(_mutex);
+      return _stats;
+    }
 
-      // Shallow merge
-      auto newState = _state;
-      for (auto it = std::begin(nextState); it != std::end(nextState); ++it) {
-        newState[it.key()] = it.value();
+  private:
+    struct IdleTask {
+      IdleHandle handle;
+      IdleCb cb;
+      Clock::time_point expires;
+    };
+
+    struct Update {
+      WeakComponent component;
+      const Component *target;
+      State partialState;
+      UpdateToken token;
+      uint64_t sequence;
+      Clock::time_point scheduled;
+    };
+
+    /**
+     * Keys committed per component while it still has updates queued, with
+     * the sequence number of the update that wrote them.
+     */
+    struct Rebase {
+      size_t pending = 0;
+      std::unordered_map<std::string, uint64_t> keys;
+    };
+
+    static inline size_t lane(Priority priority) {return static_cast<size_t>(priority);}
+
+    /**
+     * @returns the lane to take from: Immediate, then the oldest expired
+     * update, then the highest non-empty lane
+     */
+    inline bool pick(Clock::time_point now, size_t &index, bool &expired) const {
+      expired = false;
+      if (!_lanes[0].empty()) {
+        index = 0;
+        return true;
+      }
+      bool found = false;
+      for (size_t i = 1; i < kLanes; ++i) {
+        if (_lanes[i].empty()) continue;
+        auto &head = _lanes[i].front();
+        auto isExpired = _timeouts[i] != Clock::duration::max() &&
+                         now - head.scheduled >= _timeouts[i];
+        if (isExpired && (!expired || head.sequence < _lanes[index].front().sequence)) {
+          index = i;
+          expired = true;
+        } else if (!found) {
+          index = i;
+        }
+        found = true;
+      }
+      return found;
+    }
+
+    inline bool apply(Update &update, size_t index, bool expired) {
+      auto component = update.component.lock();
+      if (!component) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        ++_stats.dropped;
+        finish(update, State());
+        return false;
+      }
+      if (!component->isCurrent(update.token)) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        ++_stats.superseded;
+        finish(update, State());
+        return false;
       }
 
-      if (shouldComponentUpdate(_props, newState)) {
-        componentWillUpdate(_props, newState);
-        render(true);
-        componentDidUpdate(_props, prevState);
+      // Skip keys a later update already committed
+      State partialState = State::object();
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto &keys = _rebases[update.target].keys;
+        for (auto it = update.partialState.begin(); it != update.partialState.end(); ++it) {
+          auto written = keys.find(it.key());
+          if (written == std::end(keys) || written->second < update.sequence) {
+            partialState[it.key()] = it.value();
+          }
+        }
+      }
+
+      if (partialState.empty() && !update.partialState.empty()) {
+        // Every key was overwritten by a later update: nothing left to apply
+        std::lock_guard<std::mutex> lock(_mutex);
+        finish(update, State());
+        return false;
+      }
+
+      try {
+        component->prepareState(partialState);
+      } catch (...) {
+        component->abortWork();
+        std::lock_guard<std::mutex> lock(_mutex);
+        finish(update, State());
+        throw;
       }
-      _state = newState;
-      cb(prevState, _props);
+      if (!component->hasPendingWork()) {
+        // Every key already held its value: nothing to commit
+        std::lock_guard<std::mutex> lock(_mutex);
+        finish(update, State());
+        return false;
+      }
+      if (index != lane(Priority::Immediate) && !expired) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        for (size_t i = 0; i < index; ++i) {
+          if (_lanes[i].empty()) continue;
+          component->abortWork();
+          ++_stats.interrupted;
+          _lanes[index].push_front(std::move(update));
+          return false;
+        }
+      }
+      component->commitWork();
+
+      std::lock_guard<std::mutex> lock(_mutex);
+      ++_stats.committed;
+      finish(update, partialState);
+      return true;
     }
+
     /**
-     * Performs a shallow merge of nextState into current state.
-     * This is the primary method you use to trigger UI updates from event handlers
-     * and server request callbacks.
-     *
-     * @see https://facebook.github.io/react/docs/component-api.html#setstate
+     * Records committed keys while the component has more updates queued.
      */
-    inline void setState(const ReturnedUpdateCb &updateCb,
-                         const UpdateCb& = [](const State&, const Props&){}) {
-      setState(updateCb(_state, _props));
+    inline void finish(const Update &update, const State &committed) {
+      auto it = _rebases.find(update.target);
+      if (it == std::end(_rebases)) return;
+      if (--it->second.pending == 0) {
+        _rebases.erase(it);
+        return;
+      }
+      for (auto key = committed.begin(); key != committed.end(); ++key) {
+        auto &sequence = it->second.keys[key.key()];
+        sequence = std::max(sequence, update.sequence);
+      }
     }
-    ////////////////////////////////////////////////////////////////////////////
 
-#pragma mark - Rendering
-    virtual void render(bool force = false) = 0;
+    mutable std::mutex _mutex;
+    std::deque<Update> _lanes[kLanes];
+    Clock::duration _timeouts[kLanes];
+    std::unordered_map<const Component*, Rebase> _rebases;
+    uint64_t _sequence = 0;
+    std::deque<IdleTask> _idle;
+    IdleHandle _idleHandle = 0;
+    Stats _stats;
+  };
 
-#pragma mark - Children
-    inline void addChild(SharedComponent const component) {
+#pragma mark - Animator
+  /**
+   * Drives numeric state fields of many components towards target values.
+   * Each tick() interpolates every running animation in one pass over
+   * parallel arrays of plain doubles, which the compiler can vectorize, then
+   * merges each component's new values with a single setState().
+   * Animating a field that is already animating retargets it from its current
+   * value.
+   */
+  class Animator {
+  public:
+    typedef std::chrono::steady_clock Clock;
+
+    enum class Easing : uint8_t {
+      Linear,
+      EaseInOut // smoothstep
+    };
+
+    struct Stats {
+      uint64_t frames = 0;
+      uint64_t droppedFrames = 0; // frame intervals that passed without a tick
+      uint64_t updates = 0; // setState() calls
+      Clock::duration lastFrameTime = Clock::duration::zero(); // between ticks
+      Clock::duration worstFrameTime = Clock::duration::zero();
+      Clock::duration lastTickTime = Clock::duration::zero(); // spent in tick()
+    };
+
+    /**
+     * @param[in] frameInterval the expected time between ticks
+     */
+    explicit Animator(Clock::duration frameInterval = std::chrono::microseconds(16667))
+    : _frameInterval(frameInterval), _epoch(Clock::now()) {}
+
+    /**
+     * Animates component's state field from its current value (0 if it isn't
+     * a number) to value.
+     *
+     * @param[in] component; only weakly referenced
+     * @param[in] field top-level state key
+     * @param[in] value
+     * @param[in] duration
+     * @param[in] easing
+     * @param[in] start
+     */
+    inline void animate(const SharedComponent &component,
+                        const std::string &field,
+                        double value,
+                        Clock::duration duration,
+                        Easing easing = Easing::Linear,
+                        Clock::time_point start = Clock::now()) {
       if (!component) return;
-      // Don't allow duplicates.
-      auto it = std::find_if(std::begin(_children),
-                             std::end(_children),
-                             [&](const SharedComponent &c) {
-        return (c && c->getKey() == component->getKey());
-      });
-      if (it == std::end(_children)) {
-        _children.push_back(component);
-        component->setParent(this);
+      double from = 0;
+      auto running = find(*component, field);
+      if (running != kNone) {
+        from = _values[running];
+        remove(running);
       } else {
-        _children[it - std::begin(_children)] = component;
+        auto &state = component->getState();
+        auto current = state.is_object() ? state.find(field) : state.end();
+        if (current != state.end() && current->is_number()) from = current->get<double>();
       }
+      auto slot = targetOf(component);
+
+      auto seconds = std::chrono::duration<double>(duration).count();
+      auto begin = std::chrono::duration<double>(start - _epoch).count();
+      auto index = static_cast<uint32_t>(_values.size());
+      _from.push_back(seconds > 0 ? from : value);
+      _to.push_back(value);
+      _start.push_back(begin);
+      _end.push_back(begin + std::max(seconds, 0.0));
+      _rate.push_back(seconds > 0 ? 1 / seconds : 0);
+      _smooth.push_back(easing == Easing::EaseInOut ? 1 : 0);
+      _values.push_back(from);
+      _slots.push_back(slot);
+      _fields.push_back(field);
+      _targets[slot].fields[field] = index;
     }
-    inline void addChildren(NodeList components) {
-      for (auto &child : components) {addChild(child);}
+
+    /**
+     * Stops animating field, leaving it at its last value.
+     *
+     * @returns whether it was animating
+     */
+    inline bool cancel(const Component &component, const std::string &field) {
+      auto index = find(component, field);
+      if (index == kNone) return false;
+      remove(index);
+      return true;
     }
-    inline void removeChild(SharedComponent const component) {
-      if (!component) return;
-      removeChild(component->getKey());
+
+    inline size_t active() const {return _values.size();}
+
+    /**
+     * Advances every animation to now and applies the results.
+     *
+     * @returns the number of components updated
+     */
+    inline size_t tick(Clock::time_point now = Clock::now()) {
+      if (_ticked) {
+        auto frameTime = now - _lastTick;
+        _stats.lastFrameTime = frameTime;
+        _stats.worstFrameTime = std::max(_stats.worstFrameTime, frameTime);
+        if (frameTime * 2 > _frameInterval * 3) {
+          _stats.droppedFrames += static_cast<uint64_t>(frameTime / _frameInterval) - 1;
+        }
+      }
+      _ticked = true;
+      _lastTick = now;
+      ++_stats.frames;
+
+      // Interpolate: branch-free over contiguous arrays
+      auto time = std::chrono::duration<double>(now - _epoch).count();
+      auto count = _values.size();
+      const double *from = _from.data(), *to = _to.data(), *start = _start.data(),
+                   *rate = _rate.data(), *smooth = _smooth.data();
+      double *values = _values.data();
+      for (size_t i = 0; i < count; ++i) {
+        auto t = (time - start[i]) * rate[i];
+        t = t < 0 ? 0 : (t > 1 ? 1 : t);
+        t += smooth[i] * (t * t * (3 - 2 * t) - t);
+        values[i] = from[i] + (to[i] - from[i]) * t;
+      }
+
+      // Coalesce into one partial state per component
+      std::vector<uint32_t> touched;
+      for (size_t i = 0; i < count; ++i) {
+        auto &target = _targets[_slots[i]];
+        if (target.partialState.is_null()) touched.push_back(_slots[i]);
+        target.partialState[_fields[i]] = values[i];
+      }
+      size_t updated = 0;
+      for (auto slot : touched) {
+        auto &target = _targets[slot];
+        State partialState;
+        partialState.swap(target.partialState);
+        if (auto component = target.component.lock()) {
+          component->setState(partialState);
+          ++updated;
+        }
+      }
+      _stats.updates += updated;
+
+      // Retire finished animations and those of destroyed components
+      for (size_t i = _values.size(); i-- > 0;) {
+        if (time >= _end[i] || _targets[_slots[i]].component.expired()) remove(i);
+      }
+      _stats.lastTickTime = Clock::now() - now;
+      return updated;
     }
-    inline void removeChild(const std::string &key) {
-      if (_children.empty()) return;
-      _children.erase(std::remove_if(std::begin(_children),
-                                     std::end(_children),
-                                     [=](const SharedComponent &c) {
-        return (c && c->getKey() == key);
-      }));
+
+    inline Stats getStats() const {return _stats;}
+
+  private:
+    enum : uint32_t {kNone = 0xffffffff};
+
+    struct Target {
+      WeakComponent component;
+      const Component *raw = nullptr;
+      std::unordered_map<std::string, uint32_t> fields; // running animations
+      State partialState;
+    };
+
+    /**
+     * @returns the index of the animation of component's field, or kNone
+     */
+    inline uint32_t find(const Component &component, const std::string &field) const {
+      auto slot = _targetIndex.find(&component);
+      if (slot == std::end(_targetIndex) || _targets[slot->second].component.expired()) {
+        return kNone;
+      }
+      auto &fields = _targets[slot->second].fields;
+      auto it = fields.find(field);
+      return it == std::end(fields) ? kNone : it->second;
     }
-    inline void removeChildren() {_children.clear();}
 
-#pragma mark - Getters and Setters
-    // Props shouldn't be modified directly!
-    inline const Props &getProps() const {return _props;}
-    inline std::string getKey() const {return _key;}
-    // State shouldn't be modified directly!
-    inline const State &getState() const {return _state;}
-    inline const NodeList &getChildren() const {return _children;}
-    inline Component* const getParent() const {return _parent;}
-    inline void setParent(Component* const parent) {_parent = parent;}
+    inline uint32_t targetOf(const SharedComponent &component) {
+      auto it = _targetIndex.find(component.get());
+      if (it != std::end(_targetIndex)) {
+        if (!_targets[it->second].component.expired()) return it->second;
+        // A destroyed component's address was reused
+        while (!_targets[it->second].fields.empty()) {
+          remove(std::begin(_targets[it->second].fields)->second);
+        }
+        it = _targetIndex.find(component.get());
+        if (it != std::end(_targetIndex)) _targetIndex.erase(it);
+      }
+      uint32_t slot;
+      if (!_freeTargets.empty()) {
+        slot = _freeTargets.back();
+        _freeTargets.pop_back();
+      } else {
+        slot = static_cast<uint32_t>(_targets.size());
+        _targets.emplace_back();
+      }
+      _targets[slot].component = WeakComponent(component);
+      _targets[slot].raw = component.get();
+      _targetIndex[component.get()] = slot;
+      return slot;
+    }
 
-  protected:
-    std::string _key = ""; // string | boolean | number | null; primary key
-    Props _props = JSON(); // Use for static properties
-    State _state = JSON(); // Use for dynamic properties
-    NodeList _children;
-    Component *_parent = nullptr;
-  };
+    /**
+     * Swap-removes animation i from every array.
+     */
+    inline void remove(size_t i) {
+      auto &target = _targets[_slots[i]];
+      target.fields.erase(_fields[i]);
+      if (target.fields.empty()) {
+        _targetIndex.erase(target.raw);
+        target.component.reset();
+        target.raw = nullptr;
+        _freeTargets.push_back(_slots[i]);
+      }
+      auto last = _values.size() - 1;
+      if (i != last) {
+        _from[i] = _from[last];
+        _to[i] = _to[last];
+        _start[i] = _start[last];
+        _end[i] = _end[last];
+        _rate[i] = _rate[last];
+        _smooth[i] = _smooth[last];
+        _values[i] = _values[last];
+        _slots[i] = _slots[last];
+        _fields[i] = std::move(_fields[last]);
+        _targets[_slots[i]].fields[_fields[i]] = static_cast<uint32_t>(i);
+      }
+      _from.pop_back();
+      _to.pop_back();
+      _start.pop_back();
+      _end.pop_back();
+      _rate.pop_back();
+      _smooth.pop_back();
+      _values.pop_back();
+      _slots.pop_back();
+      _fields.pop_back();
+    }
 
-  typedef std::shared_ptr<Component> SharedComponent;
+    Clock::duration _frameInterval;
+    Clock::time_point _epoch;
+    Clock::time_point _lastTick;
+    bool _ticked = false;
+
+    // One entry per running animation; times in seconds since _epoch
+    std::vector<double> _from;
+    std::vector<double> _to;
+    std::vector<double> _start;
+    std::vector<double> _end;
+    std::vector<double> _rate; // 1 / duration
+    std::vector<double> _smooth; // 1 for EaseInOut, 0 for Linear
+    std::vector<double> _values;
+    std::vector<uint32_t> _slots; // into _targets
+    std::vector<std::string> _fields;
+
+    std::vector<Target> _targets;
+    std::vector<uint32_t> _freeTargets;
+    std::unordered_map<const Component*, uint32_t> _targetIndex;
+    Stats _stats;
+  };
 }}
 #endif /* jgod_reactive_h */
@@ -0,0 +1,146 @@
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "../src/reactive.h"
+
+using namespace jgod;
+
+template<class JSON>
+void run(const char *name, size_t members) {
+  typedef std::chrono::steady_clock Clock;
+  const size_t iterations = 2000000 / members;
+  std::vector<std::string> keys;
+  for (size_t i = 0; i < members; ++i) keys.push_back("field" + std::to_string(i));
+
+  auto start = Clock::now();
+  JSON state;
+  for (size_t n = 0; n < iterations; ++n) {
+    JSON next = JSON::object();
+    for (size_t i = 0; i < members; ++i) next[keys[i]] = static_cast<int>(n + i);
+    for (auto it = next.begin(); it != next.end(); ++it) state[it.key()] = it.value();
+  }
+  auto merged = Clock::now();
+
+  int64_t sum = 0;
+  for (size_t n = 0; n < iterations * 4; ++n) {
+    sum += state.find(keys[n % members])->template get<int>();
+  }
+  auto looked = Clock::now();
+
+  std::printf("%-14s %5zu members  merge %7.1f ns/member  lookup %6.1f ns  (%lld)\n",
+              name, members,
+              std::chrono::duration<double, std::nano>(merged - start).count() / (iterations * members),
+              std::chrono::duration<double, std::nano>(looked - merged).count() / (iterations * 4),
+              static_cast<long long>(sum));
+}
+
+class Row : public reactive::Component {
+public:
+  Row(reactive::Key key) : reactive::Component(key, reactive::Props(), reactive::NodeList()) {}
+  virtual void render(bool) override {
+    reactive::JSON output = reactive::JSON::array();
+    for (int i = 0; i < 200; ++i) output.push_back(i);
+    setRendered(reactive::Hash::json(output));
+  }
+  virtual bool isParallelSafe() const override {return true;}
+};
+
+void renderWide(unsigned threads) {
+  typedef std::chrono::steady_clock Clock;
+  Row root("root");
+  for (int i = 0; i < 20000; ++i) root.addChild(std::make_shared<Row>(i));
+  reactive::RenderPool pool(threads);
+  pool.render(root);
+  auto start = Clock::now();
+  for (int n = 0; n < 5; ++n) pool.render(root);
+  std::printf("render pool %3u threads  %8.2f ms per pass\n", pool.size(),
+              std::chrono::duration<double, std::milli>(Clock::now() - start).count() / 5);
+}
+
+class Sprite : public reactive::Component {
+public:
+  Sprite(reactive::Key key) : reactive::Component(key, reactive::Props(), reactive::NodeList()) {}
+  virtual void render(bool) override {}
+};
+
+void animate(size_t components) {
+  typedef reactive::Animator::Clock Clock;
+  std::vector<reactive::SharedComponent> rows;
+  reactive::Animator animator;
+  auto start = Clock::now();
+  for (size_t i = 0; i < components; ++i) {
+    rows.push_back(std::make_shared<Sprite>(static_cast<int>(i)));
+    animator.animate(rows.back(), "x", 100, std::chrono::seconds(10),
+                     reactive::Animator::Easing::EaseInOut, start);
+    animator.animate(rows.back(), "opacity", 1, std::chrono::seconds(10),
+                     reactive::Animator::Easing::Linear, start);
+  }
+  auto begin = Clock::now();
+  for (int frame = 1; frame <= 20; ++frame) {
+    animator.tick(start + std::chrono::milliseconds(16 * frame));
+  }
+  std::printf("animator %6zu components  %8.2f ms per frame\n", components,
+              std::chrono::duration<double, std::milli>(Clock::now() - begin).count() / 20);
+}
+
+class Node : public reactive::Component {
+public:
+  Node(reactive::Key &&key, reactive::Props &&props, reactive::NodeList &&children)
+  : reactive::Component(std::move(key), std::move(props), std::move(children)) {}
+  virtual void render(bool) override {}
+};
+
+void snapshot(size_t nodes) {
+  typedef std::chrono::steady_clock Clock;
+  reactive::Registry registry;
+  registry.add<Node>("Node");
+  auto root = registry.create("Node", "root");
+  reactive::NodeList rows;
+  for (size_t i = 0; i < nodes; ++i) {
+    auto row = registry.create("Node", "row" + std::to_string(i),
+                               reactive::JSON({{"label", "Row " + std::to_string(i)},
+                                               {"index", static_cast<int64_t>(i)}}));
+    row->setState({{"selected", i % 7 == 0}, {"count", static_cast<int64_t>(i)}});
+    rows.push_back(std::move(row));
+    if (rows.size() == 100) {
+      auto group = registry.create("Node", static_cast<int64_t>(i / 100), reactive::Props(),
+                                   std::move(rows));
+      root->addChild(group);
+      rows.clear();
+    }
+  }
+  auto start = Clock::now();
+  std::string data;
+  for (int n = 0; n < 5; ++n) {
+    data.clear();
+    reactive::Snapshot::save(*root, registry, data);
+  }
+  auto saved = Clock::now();
+  reactive::NodeList trees; // destroyed after timing
+  for (int n = 0; n < 5; ++n) trees.push_back(reactive::Snapshot::restore(data, registry));
+  auto done = Clock::now();
+  size_t restored = 0;
+  for (auto &tree : trees) restored += tree->getChildren().size();
+  std::printf("snapshot %7zu nodes  save %8.2f ms  restore %8.2f ms  (%zu bytes, %zu)\n",
+              nodes, std::chrono::duration<double, std::milli>(saved - start).count() / 5,
+              std::chrono::duration<double, std::milli>(done - saved).count() / 5,
+              data.size(), restored);
+}
+
+int main() {
+  for (size_t members : {5, 50, 1000}) {
+    run<nlohmann::basic_json<std::map>>("std::map", members);
+    run<nlohmann::basic_json<reactive::FlatMap>>("FlatMap", members);
+    run<nlohmann::basic_json<reactive::OpenHashMap>>("OpenHashMap", members);
+    run<nlohmann::basic_json<std::map, std::vector, std::string, bool, int64_t, double,
+                             reactive::SlabAllocator>>("std::map+slab", members);
+    run<nlohmann::basic_json<reactive::FlatMap, std::vector, std::string, bool, int64_t, double,
+                             reactive::SlabAllocator>>("FlatMap+slab", members);
+  }
+  animate(10000);
+  renderWide(1);
+  renderWide(0);
+  snapshot(100000);
+  return 0;
+}
@@ -9,15 +9,21 @@
 #define CATCH_CONFIG_MAIN
 #include "catch.hpp"
 #include "../src/reactive.h"
+#include <atomic>
+#include <cstdlib>
 using namespace jgod;
 
 class TestComponent : public reactive::Component {
 public:
   TestComponent(){}
-  TestComponent(const std::string type,
+  TestComponent(const reactive::Key type,
                 reactive::Props props,
                 reactive::NodeList children)
   : reactive::Component(type, props, children){}
+  TestComponent(const reactive::Key type,
+                reactive::SharedProps props,
+                reactive::NodeList children)
+  : reactive::Component(type, props, children){}
   virtual ~TestComponent(){};
   virtual void render(bool force = false) override {}
 };
@@ -59,6 +65,28 @@ TEST_CASE("Children") {
     REQUIRE(component->getChildren().empty());
   }
 
+  SECTION("Adding a mounted child again") {
+    auto queue = std::make_shared<reactive::DisposalQueue>();
+    auto component = createTestComponent();
+    component->setDisposalQueue(queue);
+    auto child = createTestComponent();
+    component->addChild(child);
+    component->addChild(child);
+    REQUIRE(component->getChildren().size() == 1);
+    REQUIRE(child->getParent() == component.get());
+
+    reactive::NodeList wide;
+    for (int i = 0; i < 40; ++i) {
+      wide.push_back(std::make_shared<TestComponent>(std::to_string(i), reactive::Props(), reactive::NodeList()));
+    }
+    component->addChildren(wide);
+    component->addChildren(wide);
+    REQUIRE(component->getChildren().size() == 41);
+    REQUIRE(wide[0]->getParent() == component.get());
+    REQUIRE(child->getParent() == component.get());
+    REQUIRE(queue->pending() == 0);
+  }
+
   SECTION("Removing children from component") {
     auto child1 = std::make_shared<TestComponent>();
     auto child2 = std::make_shared<TestComponent>();
@@ -74,4 +102,1981 @@ TEST_CASE("State") {
     component->setState(reactive::JSON::parse("{\"key\": \"value\"}"));
     REQUIRE(component->getState()["key"] == "value");
   }
+
+  SECTION("Keeping snapshots of earlier states") {
+    auto component = createTestComponent();
+    component->setState(reactive::JSON::parse("{\"count\": 1}"));
+    auto snapshot = component->getSharedState();
+    auto version = component->getStateVersion();
+
+    component->setState(reactive::JSON::parse("{\"count\": 2}"));
+    REQUIRE((*snapshot)["count"] == 1);
+    REQUIRE(component->getState()["count"] == 2);
+    REQUIRE(component->getStateVersion() > version);
+    REQUIRE(component->getSharedState() != snapshot);
+  }
+
+  SECTION("Passing the previous state without copying") {
+    auto component = createTestComponent();
+    component->setState(reactive::JSON::parse("{\"count\": 1}"));
+    auto before = component->getSharedState();
+    const reactive::State *prev = nullptr;
+    component->setState(reactive::JSON::parse("{\"count\": 2}"),
+                        [&](const reactive::State &prevState, const reactive::Props&) {
+                          prev = &prevState;
+                        });
+    REQUIRE(prev == before.get());
+  }
+
+  SECTION("Reading published state from other threads") {
+    auto component = createTestComponent();
+    std::atomic<bool> done(false);
+    std::atomic<int> inconsistent(0);
+    std::vector<std::thread> readers;
+    for (int r = 0; r < 4; ++r) {
+      readers.emplace_back([&] {
+        uint64_t lastVersion = 0;
+        while (!done.load()) {
+          auto published = component->loadState();
+          if (published.version < lastVersion) ++inconsistent;
+          if (published.version > 0 &&
+              (*published.state)["count"].get<uint64_t>() != published.version) {
+            ++inconsistent;
+          }
+          lastVersion = published.version;
+        }
+      });
+    }
+    for (uint64_t i = 1; i <= 2000; ++i) {
+      component->setState({{"count", i}});
+    }
+    done = true;
+    for (auto &reader : readers) reader.join();
+    REQUIRE(inconsistent == 0);
+    REQUIRE(component->loadState().version == 2000);
+    reactive::StateEpoch::global().collect();
+    REQUIRE(reactive::StateEpoch::global().retired() == 0);
+  }
+
+  SECTION("Reclaiming states left retired by exited threads") {
+    auto &epoch = reactive::StateEpoch::global();
+    epoch.collect();
+    {
+      reactive::StateEpoch::Guard guard; // keeps the other thread from freeing
+      std::thread([] {
+        auto component = createTestComponent();
+        for (int i = 1; i <= 10; ++i) component->setState({{"count", i}});
+      }).join();
+      REQUIRE(epoch.retired() == 10); // 9 replaced, 1 destroyed
+      epoch.collect();
+      REQUIRE(epoch.retired() == 10);
+    }
+    epoch.collect();
+    REQUIRE(epoch.retired() == 0);
+  }
+}
+
+class OtherComponent : public TestComponent {
+public:
+  OtherComponent(const reactive::Key key, reactive::Props props, reactive::NodeList children)
+  : TestComponent(key, props, children) {}
+};
+
+TEST_CASE("Registry") {
+  reactive::Registry registry;
+  registry.add<TestComponent>("Test");
+
+  SECTION("Creating components by type name") {
+    auto component = registry.create("Test", "a");
+    REQUIRE(component->getKey() == "a");
+    REQUIRE(registry.typeOf(*component) == "Test");
+    REQUIRE_THROWS(registry.create("Missing", "a"));
+  }
+
+  SECTION("Building a tree from a descriptor") {
+    auto root = registry.build(reactive::JSON::parse(
+      "{\"type\": \"Test\", \"key\": \"root\", \"props\": {\"title\": \"x\"},"
+      " \"children\": [{\"type\": \"Test\", \"key\": \"a\"},"
+      "                {\"type\": \"Test\", \"key\": \"b\","
+      "                 \"children\": [{\"type\": \"Test\", \"key\": \"c\"}]}]}"));
+    REQUIRE(root->getKey() == "root");
+    REQUIRE(root->getProps()["title"] == "x");
+    REQUIRE(root->getChildren().size() == 2);
+    REQUIRE(root->getChildren()[1]->getChildren()[0]->getKey() == "c");
+    REQUIRE(root->getChildren()[1]->getParent() == root.get());
+  }
+
+  SECTION("Building from a descriptor in place") {
+    const auto descriptor = reactive::JSON::parse(
+      "{\"type\": \"Test\", \"props\": {\"title\": \"x\"},"
+      " \"children\": [{\"type\": \"Test\", \"key\": \"a\", \"props\": {\"n\": 1}}]}");
+    auto expected = descriptor;
+    auto root = registry.build(descriptor);
+    REQUIRE(descriptor == expected);
+    REQUIRE(root->getProps()["title"] == "x");
+    REQUIRE(root->getChild("a")->getProps()["n"] == 1);
+    REQUIRE(registry.build(descriptor)->subtreeHash() == root->subtreeHash());
+  }
+
+  SECTION("Wide lists keep keys unique") {
+    reactive::JSON children = reactive::JSON::array();
+    for (int i = 0; i < 100; ++i) {
+      children.push_back(reactive::JSON({{"type", "Test"}, {"key", std::to_string(i % 50)}}));
+    }
+    auto root = registry.build(reactive::JSON({{"type", "Test"}, {"children", children}}));
+    REQUIRE(root->getChildren().size() == 50);
+  }
+
+  SECTION("Replacing a type's factory") {
+    auto pool = std::make_shared<reactive::ComponentPool>();
+    registry.setPool(pool);
+    auto root = createTestComponent();
+    root->addChild(registry.create("Test", "a"));
+    root->removeChild("a");
+    REQUIRE(pool->size(typeid(TestComponent)) == 1);
+
+    registry.add("Test", [](reactive::Key &&key, reactive::Props &&props,
+                            reactive::NodeList &&children) {
+      return reactive::SharedComponent(std::make_shared<OtherComponent>(key, props, children));
+    });
+    REQUIRE(pool->size(typeid(TestComponent)) == 0);
+    auto replaced = registry.create("Test", "b");
+    REQUIRE(dynamic_cast<OtherComponent*>(replaced.get()));
+    REQUIRE(registry.typeOf(*replaced).empty());
+    REQUIRE(registry.typeOf(*createTestComponent()).empty());
+
+    registry.add<TestComponent>("Test");
+    registry.add<TestComponent>("Alias");
+    registry.add<OtherComponent>("Test");
+    REQUIRE(registry.typeOf(*createTestComponent()) == "Alias");
+    REQUIRE(registry.typeOf(*registry.create("Test", "c")) == "Test");
+  }
+}
+
+// Builds a string key on another thread while it's constructed.
+class KeyingComponent : public TestComponent {
+public:
+  KeyingComponent(const reactive::Key key, reactive::Props props, reactive::NodeList children)
+  : TestComponent(key, props, children) {
+    std::thread([] {reactive::Key key(std::string("keying"));}).join();
+  }
+};
+
+TEST_CASE("Snapshot") {
+  reactive::Registry registry;
+  registry.add<TestComponent>("Test");
+
+  SECTION("Round-tripping JSON through MessagePack") {
+    auto value = reactive::JSON::parse(
+      "{\"a\": [1, -1, 200, -200, 70000, -70000, 5000000000, -5000000000],"
+      " \"b\": {\"c\": null, \"d\": true, \"e\": false, \"f\": 1.5},"
+      " \"g\": \"" + std::string(300, 'x') + "\"}");
+    REQUIRE(reactive::MessagePack::decode(reactive::MessagePack::encode(value)) == value);
+  }
+
+  SECTION("Saving and restoring a tree") {
+    auto root = registry.build(reactive::JSON::parse(
+      "{\"type\": \"Test\", \"key\": \"root\", \"props\": {\"title\": \"x\"},"
+      " \"children\": [{\"type\": \"Test\", \"key\": \"a\"}]}"));
+    root->getChildren()[0]->setState(reactive::JSON::parse("{\"count\": 3}"));
+
+    auto data = reactive::Snapshot::save(*root, registry);
+    auto restored = reactive::Snapshot::restore(data, registry);
+    REQUIRE(restored->getKey() == "root");
+    REQUIRE(restored->getProps()["title"] == "x");
+    REQUIRE(restored->getChildren()[0]->getParent() == restored.get());
+    REQUIRE(restored->getChildren()[0]->getState()["count"] == 3);
+  }
+
+  SECTION("Restoring trees larger than a batch") {
+    auto root = registry.create("Test", "root");
+    for (int i = 0; i < 600; ++i) {
+      root->addChild(registry.create("Test", "row" + std::to_string(i), {{"i", i}}));
+    }
+    auto data = reactive::Snapshot::save(*root, registry) + "tail";
+    const char *cursor = data.data();
+    auto restored = reactive::Snapshot::restore(cursor, data.data() + data.size(), registry);
+    REQUIRE(std::string(cursor) == "tail");
+    REQUIRE(restored->getChildren().size() == 600);
+    REQUIRE(restored->getChild("row599")->getProps()["i"] == 599);
+  }
+
+  SECTION("Constructing components outside the key intern lock") {
+    registry.add<KeyingComponent>("Keying");
+    auto root = registry.create("Keying", "root");
+    root->addChild(registry.create("Keying", "a"));
+    auto restored = reactive::Snapshot::restore(reactive::Snapshot::save(*root, registry),
+                                                registry);
+    REQUIRE(restored->getChild("a"));
+  }
+
+  SECTION("Rejecting malformed snapshots") {
+    auto data = reactive::Snapshot::save(*createTestComponent(), registry);
+    REQUIRE_THROWS(reactive::Snapshot::restore(data.substr(0, data.size() - 1), registry));
+    REQUIRE_THROWS(reactive::Snapshot::restore("nope", registry));
+  }
+}
+
+// A directory of its own under $TMPDIR, removed with the files it handed out.
+class TempDir {
+public:
+  TempDir() {
+    auto tmp = std::getenv("TMPDIR");
+    std::string pattern = std::string(tmp && *tmp ? tmp : "/tmp") + "/reactive-XXXXXX";
+    std::vector<char> path(std::begin(pattern), std::end(pattern));
+    path.push_back('\0');
+    if (!::mkdtemp(path.data())) throw std::runtime_error("mkdtemp " + pattern);
+    _path = path.data();
+  }
+  TempDir(const TempDir&) = delete;
+  TempDir &operator=(const TempDir&) = delete;
+  ~TempDir() {
+    for (auto &file : _files) std::remove(file.c_str());
+    ::rmdir(_path.c_str());
+  }
+  std::string file(const std::string &name) {
+    _files.push_back(_path + "/" + name);
+    return _files.back();
+  }
+private:
+  std::string _path;
+  std::vector<std::string> _files;
+};
+
+TEST_CASE("WriteAheadLog") {
+  reactive::Registry registry;
+  registry.add<TestComponent>("Test");
+  TempDir dir;
+  const std::string logPath = dir.file("test.wal");
+  const std::string checkpointPath = dir.file("test.checkpoint");
+  dir.file("test.checkpoint.tmp");
+
+  auto build = [&] {
+    return registry.build(reactive::JSON::parse(
+      "{\"type\": \"Test\", \"key\": \"root\","
+      " \"children\": [{\"type\": \"Test\", \"key\": \"a\"}]}"));
+  };
+
+  SECTION("Recovering state from the checkpoint and log tail") {
+    {
+      auto root = build();
+      root->setState(reactive::JSON::parse("{\"before\": 1}"));
+      auto wal = std::make_shared<reactive::WriteAheadLog>(logPath, checkpointPath, registry);
+      wal->attach(root);
+      root->getChild("a")->setState(reactive::JSON::parse("{\"count\": 1}"));
+      root->getChild("a")->setState(reactive::JSON::parse("{\"count\": 2, \"x\": true}"));
+      wal->commit();
+      REQUIRE(wal->getStats().records == 2);
+    }
+    auto wal = std::make_shared<reactive::WriteAheadLog>(logPath, checkpointPath, registry);
+    auto root = wal->recover();
+    REQUIRE(root);
+    REQUIRE(root->getState()["before"] == 1);
+    REQUIRE(root->getChild("a")->getState()["count"] == 2);
+    REQUIRE(root->getChild("a")->getState()["x"] == true);
+  }
+
+  SECTION("Batching records into group commits") {
+    reactive::WriteAheadLog::Options options;
+    options.groupCommitRecords = 4;
+    options.groupCommitInterval = std::chrono::milliseconds(60000);
+    auto root = build();
+    auto wal = std::make_shared<reactive::WriteAheadLog>(logPath, checkpointPath,
+                                                        registry, options);
+    wal->attach(root);
+    for (int i = 0; i < 8; ++i) {root->setState(reactive::JSON({{"i", i}}));}
+    REQUIRE(wal->getStats().commits == 2);
+  }
+
+  SECTION("Ignoring a torn log tail") {
+    {
+      auto root = build();
+      auto wal = std::make_shared<reactive::WriteAheadLog>(logPath, checkpointPath, registry);
+      wal->attach(root);
+      root->setState(reactive::JSON({{"i", 1}}));
+      root->setState(reactive::JSON({{"i", 2}}));
+    }
+    std::string log;
+    {
+      std::ifstream file(logPath, std::ios::binary);
+      log.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    }
+    std::ofstream(logPath, std::ios::binary | std::ios::trunc) << log.substr(0, log.size() - 1);
+
+    auto wal = std::make_shared<reactive::WriteAheadLog>(logPath, checkpointPath, registry);
+    REQUIRE(wal->recover()->getState()["i"] == 1);
+  }
+
+  SECTION("Committing the last group after the interval") {
+    reactive::WriteAheadLog::Options options;
+    options.groupCommitInterval = std::chrono::milliseconds(5);
+    auto root = build();
+    auto wal = std::make_shared<reactive::WriteAheadLog>(logPath, checkpointPath,
+                                                        registry, options);
+    wal->attach(root);
+    root->setState(reactive::JSON({{"i", 1}}));
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (wal->getStats().commits == 0 && std::chrono::steady_clock::now() < deadline) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    REQUIRE(wal->getStats().commits == 1);
+
+    // Recovered as if the process had died here
+    auto recovered = std::make_shared<reactive::WriteAheadLog>(logPath, checkpointPath, registry);
+    REQUIRE(recovered->recover()->getState()["i"] == 1);
+  }
+}
+
+TEST_CASE("Patch") {
+  SECTION("Diffing and patching JSON values") {
+    auto source = reactive::JSON::parse(
+      "{\"a\": 1, \"b\": {\"c\": [1, 2, 3], \"d\": \"x\"}, \"e/f\": true, \"g\": 0}");
+    auto target = reactive::JSON::parse(
+      "{\"a\": 2, \"b\": {\"c\": [1, 5], \"d\": \"x\", \"h\": null}, \"e/f\": false}");
+    auto patch = reactive::Patch::diff(source, target);
+    REQUIRE(reactive::Patch::applied(source, patch) == target);
+    REQUIRE(reactive::Patch::diff(target, target).empty());
+  }
+
+  SECTION("Applying move, copy and test operations") {
+    auto document = reactive::JSON::parse("{\"a\": {\"b\": 1}, \"list\": [1, 2]}");
+    reactive::Patch::apply(document, reactive::JSON::parse(
+      "[{\"op\": \"test\", \"path\": \"/a/b\", \"value\": 1},"
+      " {\"op\": \"copy\", \"from\": \"/a/b\", \"path\": \"/list/0\"},"
+      " {\"op\": \"move\", \"from\": \"/a\", \"path\": \"/moved\"}]"));
+    REQUIRE(document == reactive::JSON::parse(
+      "{\"list\": [1, 1, 2], \"moved\": {\"b\": 1}}"));
+    REQUIRE_THROWS(reactive::Patch::apply(document, reactive::JSON::parse(
+      "[{\"op\": \"test\", \"path\": \"/moved/b\", \"value\": 2}]")));
+    REQUIRE_THROWS(reactive::Patch::apply(document, reactive::JSON::parse(
+      "[{\"op\": \"remove\", \"path\": \"/missing\"}]")));
+  }
+
+  SECTION("Rejecting missing path components and malformed operations") {
+    auto document = reactive::JSON::parse("{\"a\": {\"b\": 1}}");
+    auto original = document;
+    auto apply = [&](const char *patch) {
+      reactive::Patch::apply(document, reactive::JSON::parse(patch));
+    };
+    REQUIRE_THROWS_AS(apply("[{\"op\": \"add\", \"path\": \"/missing/x\", \"value\": 1}]"),
+                      const std::out_of_range&);
+    REQUIRE_THROWS_AS(apply("[{\"op\": \"replace\", \"path\": \"/a/c\", \"value\": 1}]"),
+                      const std::out_of_range&);
+    REQUIRE_THROWS_AS(apply("[{\"op\": \"test\", \"path\": \"/a/b/c\", \"value\": 1}]"),
+                      const std::out_of_range&);
+    REQUIRE_THROWS_AS(apply("[{\"op\": \"copy\", \"path\": \"/c\"}]"),
+                      const std::invalid_argument&);
+    REQUIRE_THROWS_AS(apply("[{\"op\": 1, \"path\": \"/a\"}]"), const std::invalid_argument&);
+    REQUIRE_THROWS_AS(apply("[{\"op\": \"replace\", \"path\": \"/a\"}]"),
+                      const std::invalid_argument&);
+    REQUIRE(document == original);
+
+    auto root = createTestComponent();
+    REQUIRE_THROWS_AS(reactive::StateReplicator::apply(*root, reactive::JSON({{"path", {"root"}}})),
+                      const std::invalid_argument&);
+  }
+
+  SECTION("Replicating state deltas to a mirrored tree") {
+    reactive::Registry registry;
+    registry.add<TestComponent>("Test");
+    auto descriptor = reactive::JSON::parse(
+      "{\"type\": \"Test\", \"key\": \"root\","
+      " \"children\": [{\"type\": \"Test\", \"key\": \"a\"}]}");
+    auto source = registry.build(descriptor);
+    auto mirror = registry.build(descriptor);
+
+    std::vector<reactive::JSON> deltas;
+    source->addStateObserver(std::make_shared<reactive::StateReplicator>(
+      [&](const reactive::JSON &delta) {deltas.push_back(delta);}));
+
+    auto child = source->getChild("a");
+    child->setState(reactive::JSON::parse("{\"items\": [1, 2, 3], \"big\": \"unchanged\"}"));
+    child->setState(reactive::JSON::parse("{\"items\": [1, 2, 4]}"));
+    child->setState(reactive::JSON::parse("{\"items\": [1, 2, 4]}"));
+    REQUIRE(deltas.size() == 2);
+    REQUIRE(deltas[1]["patch"].size() == 1);
+
+    for (auto &delta : deltas) {REQUIRE(reactive::StateReplicator::apply(*mirror, delta));}
+    REQUIRE(mirror->getChild("a")->getState() == child->getState());
+  }
+}
+
+TEST_CASE("Subtree hashes") {
+  reactive::Registry registry;
+  registry.add<TestComponent>("Test");
+  auto descriptor = reactive::JSON::parse(
+    "{\"type\": \"Test\", \"key\": \"root\", \"props\": {\"p\": 1},"
+    " \"children\": [{\"type\": \"Test\", \"key\": \"a\","
+    "                 \"children\": [{\"type\": \"Test\", \"key\": \"b\"}]},"
+    "                {\"type\": \"Test\", \"key\": \"c\"}]}");
+  auto left = registry.build(descriptor);
+  auto right = registry.build(descriptor);
+
+  SECTION("Identical trees hash equally") {
+    REQUIRE(left->subtreeHash() == right->subtreeHash());
+  }
+
+  SECTION("Changes invalidate the parent chain") {
+    auto before = left->subtreeHash();
+    auto siblingBefore = left->getChild("c")->subtreeHash();
+    left->getChild("a")->getChild("b")->setState(reactive::JSON({{"x", 1}}));
+    REQUIRE(left->subtreeHash() != before);
+    REQUIRE(left->getChild("c")->subtreeHash() == siblingBefore);
+
+    left->getChild("a")->removeChild("b");
+    REQUIRE(left->subtreeHash() != right->subtreeHash());
+    left->getChild("a")->addChild(reactive::TreeSync::clone(*right->getChild("a")->getChild("b"), registry));
+    REQUIRE(left->subtreeHash() == right->subtreeHash());
+  }
+
+  SECTION("Syncing descends only into mismatched subtrees") {
+    right->getChild("a")->getChild("b")->setState(reactive::JSON({{"x", 1}}));
+    right->getChild("a")->addChild(registry.create("Test", "d"));
+    auto result = reactive::TreeSync::sync(*left, *right, registry);
+    REQUIRE(left->subtreeHash() == right->subtreeHash());
+    REQUIRE(result.updated == 1);
+    REQUIRE(result.replaced == 1);
+    REQUIRE(result.visited == 4); // root, a, b, c
+    REQUIRE(left->getChild("a")->getChild("d")->getParent() == left->getChild("a").get());
+  }
+
+  SECTION("Syncing props at every level") {
+    right->setProps({{"p", 2}});
+    right->getChild("a")->getChild("b")->setProps({{"q", 1}});
+    auto b = left->getChild("a")->getChild("b");
+    auto result = reactive::TreeSync::sync(*left, *right, registry);
+    REQUIRE(left->getProps()["p"] == 2);
+    REQUIRE(left->getChild("a")->getChild("b") == b);
+    REQUIRE(b->getProps()["q"] == 1);
+    REQUIRE(result.updated == 2);
+    REQUIRE(result.replaced == 0);
+    REQUIRE(left->subtreeHash() == right->subtreeHash());
+  }
+
+  SECTION("Releasing dropped children") {
+    auto disposal = std::make_shared<reactive::DisposalQueue>();
+    left->setDisposalQueue(disposal);
+    auto c = left->getChild("c");
+    right->removeChild("c");
+    auto result = reactive::TreeSync::sync(*left, *right, registry);
+    REQUIRE(result.removed == 1);
+    REQUIRE(c->getParent() == nullptr);
+    REQUIRE(disposal->pending() == 1);
+  }
+
+  SECTION("Hashing integral floats like integers") {
+    REQUIRE(reactive::Hash::json(1) == reactive::Hash::json(1.0));
+    REQUIRE(reactive::Hash::json(-0.0) == reactive::Hash::json(0));
+    REQUIRE(reactive::Hash::json(1.5) != reactive::Hash::json(1));
+    right->setState({{"n", 1.0}});
+    left->setState({{"n", 1}});
+    REQUIRE(left->subtreeHash() == right->subtreeHash());
+    REQUIRE(reactive::TreeSync::sync(*left, *right, registry).visited == 1);
+  }
+
+  SECTION("Cloning without copying props") {
+    auto clone = reactive::TreeSync::clone(*right, registry);
+    REQUIRE(clone->getSharedProps() == right->getSharedProps());
+    REQUIRE(clone->getSharedState() == right->getSharedState());
+    REQUIRE(clone->subtreeHash() == right->subtreeHash());
+
+    auto pool = std::make_shared<reactive::ComponentPool>();
+    registry.setPool(pool);
+    right->addChild(registry.create("Test", "recycled"));
+    right->removeChild("recycled");
+    REQUIRE(pool->size(typeid(TestComponent)) == 1);
+    clone = reactive::TreeSync::clone(*right->getChild("a"), registry);
+    REQUIRE(pool->size(typeid(TestComponent)) == 0);
+    REQUIRE(clone->getSharedProps() == right->getChild("a")->getSharedProps());
+  }
+
+  SECTION("Matching wide lists by key") {
+    for (int i = 0; i < 100; ++i) {
+      left->addChild(registry.create("Test", "row" + std::to_string(i)));
+      right->addChild(registry.create("Test", "row" + std::to_string(99 - i)));
+    }
+    auto row = left->getChild("row42");
+    right->getChild("row42")->setState({{"x", 1}});
+    auto result = reactive::TreeSync::sync(*left, *right, registry);
+    REQUIRE(result.replaced == 0);
+    REQUIRE(result.updated == 1);
+    REQUIRE(left->getChild("row42") == row);
+    REQUIRE(left->getChildren()[2]->getKey() == "row99");
+    REQUIRE(left->subtreeHash() == right->subtreeHash());
+  }
+}
+
+class RecordingObserver : public reactive::StateObserver {
+public:
+  virtual void componentDidSetState(reactive::Component&,
+                                    const reactive::State &partialState,
+                                    const reactive::State&) override {
+    partialStates.push_back(partialState);
+  }
+  std::vector<reactive::State> partialStates;
+};
+
+class LifecycleComponent : public TestComponent {
+public:
+  LifecycleComponent() : TestComponent("lifecycle", reactive::Props(), reactive::NodeList()) {}
+  virtual bool shouldComponentUpdate(const reactive::Props&, const reactive::State &nextState) override {
+    calls.push_back("shouldComponentUpdate");
+    return !nextState.count("skip");
+  }
+  virtual void componentWillUpdate(const reactive::Props&, const reactive::State&) override {
+    calls.push_back("componentWillUpdate");
+  }
+  virtual void render(bool) override {
+    calls.push_back("render");
+    setRendered(getState());
+  }
+  virtual void componentDidUpdate(const reactive::Props&, const reactive::State&) override {
+    calls.push_back("componentDidUpdate");
+  }
+  std::vector<std::string> calls;
+};
+
+class LabelComponent : public reactive::Component {
+public:
+  LabelComponent(const reactive::Key key,
+                 reactive::Props props,
+                 reactive::NodeList children)
+  : reactive::Component(key, props, children){}
+  virtual void render(bool) override {
+    ++renders;
+    setRendered(getProps()["prefix"].get<std::string>() +
+                getState()["text"].get<std::string>());
+  }
+  int renders = 0;
+};
+
+TEST_CASE("Render cache") {
+  auto cache = std::make_shared<reactive::RenderCache>();
+  auto label = std::make_shared<LabelComponent>("label",
+                                                reactive::JSON({{"prefix", "> "}}),
+                                                reactive::NodeList());
+  label->setRenderCache(cache);
+
+  SECTION("Rendering sees the merged state") {
+    label->setState(reactive::JSON({{"text", "a"}}));
+    REQUIRE(label->getRendered() == "> a");
+  }
+
+  SECTION("Hits bypass render") {
+    label->setState(reactive::JSON({{"text", "a"}}));
+    label->setState(reactive::JSON({{"text", "b"}}));
+    label->setState(reactive::JSON({{"text", "a"}}));
+    REQUIRE(label->renders == 2);
+    REQUIRE(label->getRendered() == "> a");
+    REQUIRE(label->getState()["text"] == "a");
+    REQUIRE(cache->getStats().hits == 1);
+    REQUIRE(cache->getStats().misses == 2);
+  }
+
+  SECTION("Skipping the update lifecycle on hits") {
+    LifecycleComponent lifecycle;
+    auto observer = std::make_shared<RecordingObserver>();
+    lifecycle.addStateObserver(observer);
+    lifecycle.setRenderCache(cache);
+    lifecycle.setState({{"text", "a"}});
+    lifecycle.setState({{"text", "b"}});
+    lifecycle.calls.clear();
+    lifecycle.setState({{"text", "a"}});
+    REQUIRE(cache->getStats().hits == 1);
+    REQUIRE(lifecycle.calls.empty());
+    REQUIRE(lifecycle.getRendered() == reactive::JSON({{"text", "a"}}));
+    REQUIRE(observer->partialStates.size() == 3);
+  }
+
+  SECTION("Evicting least recently used entries over budget") {
+    auto small = std::make_shared<reactive::RenderCache>(
+      2 * reactive::RenderCache::approximateSize(reactive::JSON("> x")));
+    label->setRenderCache(small);
+    label->setState(reactive::JSON({{"text", "a"}}));
+    label->setState(reactive::JSON({{"text", "b"}}));
+    label->setState(reactive::JSON({{"text", "c"}}));
+    REQUIRE(small->size() == 2);
+    REQUIRE(small->getStats().evictions == 1);
+    label->setState(reactive::JSON({{"text", "a"}}));
+    REQUIRE(label->renders == 4);
+  }
+}
+
+TEST_CASE("Virtual list") {
+  int version = 0;
+  reactive::VirtualList list("list",
+    [](reactive::Key key, reactive::Props props) {
+      return reactive::SharedComponent(std::make_shared<TestComponent>(key, props,
+                                                                      reactive::NodeList()));
+    },
+    [&version](size_t index) {return reactive::JSON({{"row", index}, {"version", version}});});
+  list.setItemCount(1000000);
+  list.setOverscan(2);
+
+  SECTION("Materializing only the window plus overscan") {
+    list.setWindow(100, 10);
+    REQUIRE(list.getItemCount() == 1000000);
+    REQUIRE(list.getChildren().size() == 14);
+    REQUIRE(list.getFirstMaterialized() == 98);
+    REQUIRE(list.getChildren()[0]->getKey() == 98);
+    REQUIRE(list.getChildren()[0]->getProps()["row"] == 98);
+    REQUIRE(list.getChildren()[0]->getParent() == &list);
+  }
+
+  SECTION("Recycling rows as the window moves") {
+    list.setWindow(0, 10);
+    REQUIRE(list.getChildren().size() == 12);
+    list.getChildren()[0]->setState(reactive::JSON({{"selected", true}}));
+    for (size_t first = 1; first <= 500; ++first) {list.setWindow(first, 10);}
+    REQUIRE(list.getStats().created == 14);
+    REQUIRE(list.getChildren().front()->getKey() == 498);
+    REQUIRE(list.getChildren().back()->getProps()["row"] == 511);
+    for (auto &row : list.getChildren()) {REQUIRE(row->getState().is_null());}
+  }
+
+  SECTION("Detaching rows that leave the window") {
+    list.setWindow(0, 10);
+    auto row = list.getChildren()[0];
+    auto token = row->beginUpdate();
+    int notified = 0;
+    list.addStateObserver(std::make_shared<reactive::StateReplicator>(
+      [&](const reactive::JSON&) {++notified;}));
+    list.setWindow(90, 2); // reuses 6 of the 12 spares, the last ones
+    REQUIRE(row->getParent() == nullptr);
+    REQUIRE(!row->isCurrent(token));
+    row->setState(reactive::JSON({{"late", true}}));
+    REQUIRE(notified == 0);
+  }
+
+  SECTION("Releasing spares beyond one window") {
+    auto disposal = std::make_shared<reactive::DisposalQueue>();
+    list.setDisposalQueue(disposal);
+    list.setWindow(0, 10);
+    list.setWindow(100, 1);
+    REQUIRE(list.getChildren().size() == 5);
+    REQUIRE(disposal->pending() == 12 - 5 - 5); // 5 reused, 5 kept
+  }
+
+  SECTION("Refreshing props without resetting row state") {
+    list.setWindow(0, 10);
+    auto row = list.getChildren()[3];
+    row->setState(reactive::JSON({{"selected", true}}));
+    auto hash = list.subtreeHash();
+    list.refresh();
+    REQUIRE(list.subtreeHash() == hash);
+
+    version = 1;
+    list.refresh();
+    REQUIRE(list.subtreeHash() != hash);
+    REQUIRE(list.getChildren()[3] == row);
+    REQUIRE(row->getProps()["version"] == 1);
+    REQUIRE(row->getState()["selected"] == true);
+    REQUIRE(row->getParent() == &list);
+  }
+
+  SECTION("Clamping the window to the item count") {
+    list.setItemCount(5);
+    list.setWindow(3, 10);
+    REQUIRE(list.getChildren().size() == 4);
+    REQUIRE(list.getChildren().back()->getKey() == 4);
+  }
+}
+
+TEST_CASE("Component pool") {
+  reactive::Registry registry;
+  registry.add<TestComponent>("Test");
+  auto pool = std::make_shared<reactive::ComponentPool>(2);
+  registry.setPool(pool);
+  auto root = createTestComponent();
+  auto type = std::type_index(typeid(TestComponent));
+
+  SECTION("Reusing removed components for new keys") {
+    root->addChild(registry.create("Test", "a", reactive::JSON({{"n", 1}})));
+    auto *instance = root->getChildren()[0].get();
+    instance->setState(reactive::JSON({{"x", 1}}));
+    root->removeChild("a");
+    REQUIRE(pool->size(type) == 1);
+    REQUIRE(instance->getParent() == nullptr);
+
+    auto reused = registry.create("Test", "b", reactive::JSON({{"n", 2}}));
+    REQUIRE(reused.get() == instance);
+    REQUIRE(reused->getKey() == "b");
+    REQUIRE(reused->getProps()["n"] == 2);
+    REQUIRE(reused->getState().is_null());
+    REQUIRE(pool->getStats().reused == 1);
+  }
+
+  SECTION("Pooling removed subtrees up to the cap") {
+    root->addChild(registry.create("Test", "a", reactive::Props(), reactive::NodeList{
+      registry.create("Test", "b"), registry.create("Test", "c")}));
+    root->removeChildren();
+    REQUIRE(pool->size(type) == 2);
+    REQUIRE(pool->getStats().released == 2);
+    REQUIRE(pool->getStats().dropped == 1);
+  }
+
+  SECTION("Pooling a child removed through the parent's reference") {
+    root->addChild(registry.create("Test", "a"));
+    root->removeChild(root->getChildren()[0]);
+    REQUIRE(root->getChildren().empty());
+    REQUIRE(pool->size(type) == 1);
+  }
+
+  SECTION("Dropping observers and disposal queues of pooled components") {
+    root->addChild(registry.create("Test", "row1"));
+    auto row = root->getChildren()[0].get();
+    int notified = 0;
+    row->addStateObserver(std::make_shared<reactive::StateReplicator>(
+      [&](const reactive::JSON&) {++notified;}));
+    row->setDisposalQueue(std::make_shared<reactive::DisposalQueue>());
+    row->setState(reactive::JSON({{"x", 1}}));
+    REQUIRE(notified == 1);
+    root->removeChild("row1");
+
+    auto unrelated = registry.create("Test", "unrelated");
+    REQUIRE(unrelated.get() == row);
+    unrelated->setState(reactive::JSON({{"x", 2}}));
+    REQUIRE(notified == 1);
+    REQUIRE(!unrelated->getDisposalQueue());
+  }
+
+  SECTION("Leaving components that are still referenced alone") {
+    auto child = registry.create("Test", "a");
+    root->addChild(child);
+    root->removeChild(child);
+    REQUIRE(pool->size(type) == 0);
+    REQUIRE(child->getKey() == "a");
+  }
+}
+
+class CountedComponent : public TestComponent {
+public:
+  CountedComponent(const std::string key, std::atomic<int> &destroyed)
+  : TestComponent(key, reactive::Props(), reactive::NodeList()), _destroyed(destroyed) {}
+  virtual ~CountedComponent() {++_destroyed;}
+private:
+  std::atomic<int> &_destroyed;
+};
+
+class DisposedOnComponent : public CountedComponent {
+public:
+  DisposedOnComponent(const std::string key, std::atomic<int> &destroyed,
+                      std::atomic<std::thread::id> &thread)
+  : CountedComponent(key, destroyed), _thread(thread) {}
+  virtual ~DisposedOnComponent() {_thread = std::this_thread::get_id();}
+private:
+  std::atomic<std::thread::id> &_thread;
+};
+
+TEST_CASE("Disposal queue") {
+  std::atomic<int> destroyed(0);
+  auto makeSubtree = [&](int width) {
+    auto subtree = std::make_shared<CountedComponent>("subtree", destroyed);
+    for (int i = 0; i < width; ++i) {
+      subtree->addChild(std::make_shared<CountedComponent>(std::to_string(i), destroyed));
+    }
+    return subtree;
+  };
+
+  SECTION("Destroying removed subtrees incrementally") {
+    auto queue = std::make_shared<reactive::DisposalQueue>();
+    auto root = createTestComponent();
+    root->setDisposalQueue(queue);
+    root->addChild(makeSubtree(100));
+    root->removeChildren();
+    REQUIRE(destroyed == 0);
+    REQUIRE(queue->pending() == 1);
+
+    REQUIRE(queue->drain(std::chrono::microseconds(0)) == 32);
+    REQUIRE(destroyed == 32);
+    queue->drainAll();
+    REQUIRE(destroyed == 101);
+    REQUIRE(queue->pending() == 0);
+  }
+
+  SECTION("Destroying removed subtrees on a background thread") {
+    auto queue = std::make_shared<reactive::DisposalQueue>(
+      reactive::DisposalQueue::Mode::Background);
+    auto root = createTestComponent();
+    root->setDisposalQueue(queue);
+    auto subtree = makeSubtree(100);
+    subtree->addChild(makeSubtree(10));
+    root->addChild(subtree);
+    subtree.reset();
+    root->removeChild("subtree");
+    for (int i = 0; i < 1000 && destroyed < 112; ++i) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    REQUIRE(destroyed == 112);
+  }
+
+  SECTION("Leaving components referenced elsewhere to the calling thread") {
+    auto queue = std::make_shared<reactive::DisposalQueue>(
+      reactive::DisposalQueue::Mode::Background);
+    auto root = createTestComponent();
+    root->setDisposalQueue(queue);
+    auto subtree = makeSubtree(10);
+    auto held = subtree->getChild("3");
+    root->addChild(subtree);
+    subtree.reset();
+    root->removeChild("subtree");
+    REQUIRE(held->getParent() == nullptr);
+    for (int i = 0; i < 1000 && destroyed < 10; ++i) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    REQUIRE(destroyed == 10);
+
+    auto kept = makeSubtree(5);
+    root->addChild(kept);
+    root->removeChild("subtree");
+    REQUIRE(queue->pending() == 0);
+    REQUIRE(kept->getChildren().size() == 5);
+    REQUIRE(kept->getChild("0")->getParent() == kept.get());
+  }
+
+  SECTION("Keeping components with pending updates off the worker") {
+    auto queue = std::make_shared<reactive::DisposalQueue>(
+      reactive::DisposalQueue::Mode::Background);
+    auto root = createTestComponent();
+    root->setDisposalQueue(queue);
+    reactive::Scheduler scheduler;
+    reactive::Animator animator;
+    auto subtree = makeSubtree(10);
+    subtree->getChild("3")->addChild(makeSubtree(5));
+    scheduler.schedule(subtree->getChild("3"), {{"x", 1}});
+    animator.animate(subtree->getChild("4"), "x", 1, std::chrono::seconds(1));
+    root->addChild(subtree);
+    subtree.reset();
+    root->removeChild("subtree");
+    REQUIRE(destroyed >= 2); // "3" and "4", before removeChild() returned
+
+    // While the worker drains the rest
+    REQUIRE(scheduler.flush() == 0);
+    REQUIRE(animator.tick() == 0);
+    for (int i = 0; i < 1000 && destroyed < 17; ++i) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    REQUIRE(destroyed == 17);
+    REQUIRE(scheduler.getStats().dropped == 1);
+  }
+
+  SECTION("Disposing components in the background once their updates have run") {
+    auto queue = std::make_shared<reactive::DisposalQueue>(
+      reactive::DisposalQueue::Mode::Background);
+    auto root = createTestComponent();
+    root->setDisposalQueue(queue);
+    reactive::Scheduler scheduler;
+    reactive::Animator animator;
+    std::atomic<std::thread::id> scheduled, animated;
+    auto subtree = makeSubtree(10);
+    subtree->addChild(std::make_shared<DisposedOnComponent>("scheduled", destroyed, scheduled));
+    subtree->addChild(std::make_shared<DisposedOnComponent>("animated", destroyed, animated));
+    scheduler.schedule(subtree->getChild("scheduled"), {{"x", 1}});
+    animator.animate(subtree->getChild("animated"), "x", 1, std::chrono::seconds(1));
+    root->addChild(subtree);
+    subtree.reset();
+    REQUIRE(scheduler.flush() == 1);
+    REQUIRE(animator.tick(reactive::Animator::Clock::now() + std::chrono::seconds(2)) == 1);
+    REQUIRE(animator.active() == 0);
+
+    root->removeChild("subtree");
+    for (int i = 0; i < 1000 && destroyed < 13; ++i) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    REQUIRE(destroyed == 13);
+    REQUIRE(scheduled.load() != std::this_thread::get_id());
+    REQUIRE(animated.load() != std::this_thread::get_id());
+  }
+}
+
+TEST_CASE("Traversal") {
+  reactive::Registry registry;
+  registry.add<TestComponent>("Test");
+  auto root = registry.build(reactive::JSON::parse(
+    "{\"type\": \"Test\", \"key\": \"a\","
+    " \"children\": [{\"type\": \"Test\", \"key\": \"b\","
+    "                 \"children\": [{\"type\": \"Test\", \"key\": \"d\"},"
+    "                                {\"type\": \"Test\", \"key\": \"e\"}]},"
+    "                {\"type\": \"Test\", \"key\": \"c\"}]}"));
+  auto keys = [](reactive::Traversal<reactive::PreOrderIterator> t) {
+    std::string out;
+    for (auto &c : t) {out += c.getKey();}
+    return out;
+  };
+
+  SECTION("Visiting components in pre-, post- and level-order") {
+    REQUIRE(keys(reactive::preOrder(*root)) == "abdec");
+    std::string post, level;
+    for (auto &c : reactive::postOrder(*root)) {post += c.getKey();}
+    for (auto &c : reactive::levelOrder(*root)) {level += c.getKey();}
+    REQUIRE(post == "debca");
+    REQUIRE(level == "abcde");
+  }
+
+  SECTION("Handling trees deeper than the call stack allows") {
+    const int depth = 200000;
+    auto deep = createTestComponent();
+    reactive::Component *tail = deep.get();
+    for (int i = 0; i < depth; ++i) {
+      auto child = std::make_shared<TestComponent>(std::to_string(i), reactive::Props(),
+                                                   reactive::NodeList());
+      tail->addChild(child);
+      tail = child.get();
+    }
+    size_t count = 0;
+    for (auto &c : reactive::postOrder(*deep)) {(void)c; ++count;}
+    REQUIRE(count == depth + 1);
+    REQUIRE(deep->subtreeHash() != 0);
+
+    auto restored = reactive::Snapshot::restore(reactive::Snapshot::save(*deep, registry),
+                                                registry);
+    REQUIRE(restored->subtreeHash() == deep->subtreeHash());
+
+    auto cloned = reactive::TreeSync::clone(*deep, registry);
+    REQUIRE(cloned->subtreeHash() == deep->subtreeHash());
+    tail->setState({{"x", 1}});
+    tail->addChild(createTestComponent());
+    auto result = reactive::TreeSync::sync(*cloned, *deep, registry);
+    REQUIRE(result.visited == depth + 1);
+    REQUIRE(result.updated == 1);
+    REQUIRE(result.replaced == 1);
+    REQUIRE(cloned->subtreeHash() == deep->subtreeHash());
+
+    reactive::JSON descriptor = {{"type", "Test"}, {"key", "leaf"}};
+    for (int i = 0; i < depth; ++i) {
+      reactive::JSON parent = {{"type", "Test"}, {"key", std::to_string(i)},
+                               {"children", reactive::JSON::array()}};
+      parent["children"].push_back(std::move(descriptor));
+      descriptor = std::move(parent);
+    }
+    auto built = registry.build(std::move(descriptor));
+    count = 0;
+    for (auto &c : reactive::postOrder(*built)) {(void)c; ++count;}
+    REQUIRE(count == depth + 1);
+    // Unnest the descriptor so destroying it doesn't recurse either
+    while (descriptor.is_object() && descriptor.count("children")) {
+      reactive::JSON child = std::move(descriptor["children"][0]);
+      descriptor = std::move(child);
+    }
+    deep.reset();
+    restored.reset();
+  }
+}
+
+TEST_CASE("Flat tree") {
+  reactive::Registry registry;
+  registry.add<TestComponent>("Test");
+  auto root = registry.build(reactive::JSON::parse(
+    "{\"type\": \"Test\", \"key\": \"a\","
+    " \"children\": [{\"type\": \"Test\", \"key\": \"b\","
+    "                 \"children\": [{\"type\": \"Test\", \"key\": \"d\"},"
+    "                                {\"type\": \"Test\", \"key\": \"e\"}]},"
+    "                {\"type\": \"Test\", \"key\": \"c\"}]}"));
+  root->getChild("c")->setState(reactive::JSON({{"x", 1}}));
+  reactive::FlatTree tree(*root);
+
+  SECTION("Laying nodes out in pre-order") {
+    REQUIRE(tree.size() == 5);
+    std::string keys;
+    for (reactive::FlatTree::Index i = 0; i < tree.size(); ++i) {keys += tree.key(i);}
+    REQUIRE(keys == "abdec");
+    REQUIRE(tree.parent(2) == 1);
+    REQUIRE(tree.firstChild(1) == 2);
+    REQUIRE(tree.nextSibling(2) == 3);
+    REQUIRE(tree.nextSibling(1) == 4);
+    REQUIRE(tree.subtreeEnd(1) == 4);
+    REQUIRE(tree.subtreeEnd(0) == 5);
+    REQUIRE(tree.state(4)["x"] == 1);
+    REQUIRE(&tree.component(tree.indexOf(*root->getChild("c"))) == root->getChild("c").get());
+  }
+
+  SECTION("Propagating dirty bits to ancestors") {
+    tree.markDirty(3);
+    tree.propagateDirty();
+    REQUIRE(tree.isSubtreeDirty(0));
+    REQUIRE(tree.isSubtreeDirty(1));
+    REQUIRE(!tree.isDirty(1));
+    REQUIRE(!tree.isSubtreeDirty(4));
+  }
+
+  SECTION("Hashing matches component subtree hashes") {
+    tree.hashAll();
+    REQUIRE(tree.hash(0) == root->subtreeHash());
+    REQUIRE(tree.hash(1) == root->getChild("b")->subtreeHash());
+  }
+
+  SECTION("Rehashing only dirty nodes and their ancestors") {
+    tree.hashAll();
+    auto clean = tree.hash(0);
+    auto d = root->getChild("b")->getChild("d");
+    d->setState(reactive::JSON({{"y", 2}}));
+    tree.hashAll();
+    REQUIRE(tree.hash(0) == clean);
+
+    tree.markDirty(tree.indexOf(*d));
+    tree.hashAll();
+    REQUIRE(tree.hash(0) != clean);
+    REQUIRE(tree.hash(0) == root->subtreeHash());
+    REQUIRE(tree.hash(1) == root->getChild("b")->subtreeHash());
+    REQUIRE(tree.hash(4) == root->getChild("c")->subtreeHash());
+    REQUIRE(!tree.isSubtreeDirty(0));
+    REQUIRE(!tree.isDirty(2));
+  }
+}
+
+TEST_CASE("Keys") {
+  SECTION("Interning string keys") {
+    reactive::Key a(std::string("row"));
+    reactive::Key b("row");
+    REQUIRE(a == b);
+    REQUIRE(&a.string() == &b.string());
+    REQUIRE(a == "row");
+    REQUIRE(a.hash() == b.hash());
+    REQUIRE(a != reactive::Key("other"));
+  }
+
+  SECTION("Dropping interned strings with their last key") {
+    auto before = reactive::Key::interned();
+    {
+      reactive::Key a("transient");
+      auto b = a;
+      std::vector<reactive::Key> keys;
+      for (int i = 0; i < 1000; ++i) keys.push_back("transient-" + std::to_string(i));
+      REQUIRE(reactive::Key::interned() == before + 1001);
+      keys.clear();
+      REQUIRE(reactive::Key::interned() == before + 1);
+      a = reactive::Key(1);
+      REQUIRE(b == "transient");
+    }
+    REQUIRE(reactive::Key::interned() == before);
+
+    // Entries that shared a probe run with dropped ones are still found.
+    std::vector<reactive::Key> keys;
+    for (int i = 0; i < 100; ++i) keys.push_back("kept-" + std::to_string(i));
+    for (int i = 0; i < 100; i += 2) keys[i] = reactive::Key();
+    for (int i = 1; i < 100; i += 2) {
+      REQUIRE(&reactive::Key("kept-" + std::to_string(i)).string() == &keys[i].string());
+    }
+    REQUIRE(reactive::Key::interned() == before + 50);
+  }
+
+  SECTION("Storing numbers and booleans inline") {
+    REQUIRE(reactive::Key(7) == reactive::Key(7L));
+    REQUIRE(reactive::Key(7) != reactive::Key("7"));
+    REQUIRE(reactive::Key(7).str() == "7");
+    REQUIRE(reactive::Key(true).type() == reactive::Key::Type::Boolean);
+    REQUIRE(reactive::Key().type() == reactive::Key::Type::Null);
+    REQUIRE(reactive::Key::fromJSON(reactive::Key(7).toJSON()) == reactive::Key(7));
+  }
+
+  SECTION("Keying components by any key type") {
+    reactive::Registry registry;
+    registry.add<TestComponent>("Test");
+    auto root = registry.build(reactive::JSON::parse(
+      "{\"type\": \"Test\", \"key\": \"root\","
+      " \"children\": [{\"type\": \"Test\", \"key\": 1}, {\"type\": \"Test\", \"key\": true}]}"));
+    REQUIRE(root->getChild(1));
+    REQUIRE(root->getChild(true));
+    REQUIRE(!root->getChild("1"));
+
+    auto restored = reactive::Snapshot::restore(reactive::Snapshot::save(*root, registry),
+                                                registry);
+    REQUIRE(restored->getChildren()[0]->getKey() == reactive::Key(1));
+    auto child = root->getChild(true);
+    REQUIRE(root->findByKeyPath(child->getKeyPath()) == child.get());
+  }
+}
+
+TEST_CASE("Props pool") {
+  reactive::Registry registry;
+  registry.add<TestComponent>("Test");
+  auto pool = std::make_shared<reactive::PropsPool>();
+  registry.setPropsPool(pool);
+
+  SECTION("Sharing identical props between siblings") {
+    auto root = registry.create("Test", "root");
+    for (int i = 0; i < 100; ++i) {
+      root->addChild(registry.create("Test", i, {{"style", "row"}, {"height", 20}}));
+    }
+    auto &children = root->getChildren();
+    REQUIRE(children[0]->getSharedProps() == children[99]->getSharedProps());
+    REQUIRE(children[0]->hasSameProps(*children[99]));
+    REQUIRE(pool->getStats().hits == 99);
+    REQUIRE(children[0]->getProps()["height"] == 20);
+  }
+
+  SECTION("Keeping distinct props apart") {
+    auto a = registry.create("Test", "a", {{"height", 20}});
+    auto b = registry.create("Test", "b", {{"height", 21}});
+    REQUIRE(a->getSharedProps() != b->getSharedProps());
+    REQUIRE(!a->hasSameProps(*b));
+  }
+
+  SECTION("Collecting unused props") {
+    {
+      auto a = registry.create("Test", "a", {{"height", 20}});
+      REQUIRE(pool->size() == 1);
+    }
+    pool->collect();
+    REQUIRE(pool->size() == 0);
+  }
+
+  SECTION("Leaving unpooled components alone") {
+    TestComponent a("a", {{"height", 20}}, {}), b("b", {{"height", 20}}, {});
+    REQUIRE(a.getSharedProps() != b.getSharedProps());
+    REQUIRE(a.hasSameProps(b));
+  }
+
+  SECTION("Comparing props interned by different pools") {
+    auto a = registry.create("Test", "a", {{"height", 20}});
+    reactive::Registry other;
+    other.add<TestComponent>("Test");
+    other.setPropsPool(std::make_shared<reactive::PropsPool>());
+    REQUIRE(other.getPropsPool()->id() != pool->id());
+    auto b = other.create("Test", "b", {{"height", 20}});
+    auto c = other.create("Test", "c", {{"height", 21}});
+    REQUIRE(a->getSharedProps() != b->getSharedProps());
+    REQUIRE(a->hasSameProps(*b));
+    REQUIRE(!b->hasSameProps(*c));
+    b->setProps({{"height", 21}});
+    REQUIRE(!a->hasSameProps(*b));
+  }
+}
+
+TEST_CASE("Object containers") {
+  typedef nlohmann::basic_json<reactive::FlatMap> FlatJSON;
+  typedef nlohmann::basic_json<reactive::OpenHashMap> HashJSON;
+
+  SECTION("Keeping flat objects sorted") {
+    auto state = FlatJSON::parse("{\"b\": 2, \"a\": 1, \"c\": {\"d\": [1, 2]}}");
+    REQUIRE(state.dump() == "{\"a\":1,\"b\":2,\"c\":{\"d\":[1,2]}}");
+    state["aa"] = true;
+    state.erase("b");
+    REQUIRE(state.dump() == "{\"a\":1,\"aa\":true,\"c\":{\"d\":[1,2]}}");
+    REQUIRE(state.find("b") == state.end());
+    REQUIRE(state.at("c")["d"][1] == 2);
+    REQUIRE_THROWS_AS(state.at("missing"), const std::out_of_range&);
+    REQUIRE(state == FlatJSON::parse("{\"c\": {\"d\": [1, 2]}, \"aa\": true, \"a\": 1}"));
+  }
+
+  SECTION("Matching std::map through inserts and erases") {
+    std::map<std::string, int> expected;
+    HashJSON hashed = HashJSON::object();
+    FlatJSON flat = FlatJSON::object();
+    uint64_t seed = 1;
+    for (int i = 0; i < 5000; ++i) {
+      seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+      auto key = std::to_string((seed >> 33) % 512);
+      if ((seed >> 20) % 3 == 0) {
+        REQUIRE(hashed.erase(key) == expected.erase(key));
+        flat.erase(key);
+      } else {
+        expected[key] = i;
+        hashed[key] = i;
+        flat[key] = i;
+      }
+    }
+    REQUIRE(hashed.size() == expected.size());
+    REQUIRE(flat.size() == expected.size());
+    for (const auto &item : expected) {
+      REQUIRE(hashed.at(item.first) == item.second);
+      REQUIRE(flat.at(item.first) == item.second);
+    }
+    REQUIRE(hashed == HashJSON::parse(flat.dump()));
+  }
+
+  SECTION("Erasing while iterating") {
+    auto state = HashJSON::parse("{\"a\": 1, \"b\": 2, \"c\": 3, \"d\": 4}");
+    for (auto it = state.begin(); it != state.end();) {
+      it = it.value().get<int>() % 2 ? state.erase(it) : std::next(it);
+    }
+    REQUIRE(state == HashJSON::parse("{\"b\": 2, \"d\": 4}"));
+  }
+}
+
+TEST_CASE("Slab allocator") {
+  typedef nlohmann::basic_json<std::map, std::vector, std::string, bool, int64_t, double,
+                               reactive::SlabAllocator> SlabJSON;
+
+  SECTION("Reusing freed blocks") {
+    reactive::SlabAllocator<std::string> alloc;
+    auto first = alloc.allocate(1);
+    alloc.deallocate(first, 1);
+    auto second = alloc.allocate(1);
+    REQUIRE(first == second);
+    alloc.deallocate(second, 1);
+  }
+
+  SECTION("Falling back to the heap for large blocks") {
+    reactive::SlabAllocator<char> alloc;
+    auto block = alloc.allocate(reactive::Slab::kMaxSize + 1);
+    block[reactive::Slab::kMaxSize] = 1;
+    alloc.deallocate(block, reactive::Slab::kMaxSize + 1);
+  }
+
+  SECTION("Returning blocks freed on other threads to their owner") {
+    reactive::SlabAllocator<char> alloc;
+    auto round = [&] {
+      std::vector<char*> blocks;
+      for (int i = 0; i < 10000; ++i) blocks.push_back(alloc.allocate(64));
+      std::thread([&] {
+        for (auto block : blocks) alloc.deallocate(block, 64);
+      }).join();
+    };
+    round();
+    auto chunks = reactive::Slab::chunks();
+    for (int i = 0; i < 50; ++i) round();
+    REQUIRE(reactive::Slab::chunks() == chunks);
+  }
+
+  SECTION("Backing JSON values") {
+    auto state = SlabJSON::parse("{\"status\": \"ok\", \"items\": [1, 2, {\"a\": \"b\"}]}");
+    auto copy = state;
+    copy["items"].push_back("more");
+    REQUIRE(state["items"].size() == 3);
+    REQUIRE(copy.dump() == "{\"items\":[1,2,{\"a\":\"b\"},\"more\"],\"status\":\"ok\"}");
+  }
+}
+
+class RenderedComponent : public reactive::Component {
+public:
+  RenderedComponent(const reactive::Key key, bool parallelSafe, bool throws = false)
+  : reactive::Component(key, reactive::Props(), reactive::NodeList()),
+    _parallelSafe(parallelSafe), _throws(throws) {}
+  virtual void render(bool) override {
+    if (_throws) throw std::runtime_error("render failed");
+    thread = std::this_thread::get_id();
+    setRendered(getKey().toJSON());
+    ++renders();
+  }
+  virtual bool isParallelSafe() const override {return _parallelSafe;}
+  virtual bool shouldComponentUpdate(const reactive::Props&, const reactive::State&) override {
+    return update;
+  }
+  virtual void componentDidUpdate(const reactive::Props&, const reactive::State&) override {
+    committer = std::this_thread::get_id();
+    rendersAtCommit = renders();
+  }
+  static std::atomic<int> &renders() {
+    static std::atomic<int> renders{0};
+    return renders;
+  }
+  std::thread::id thread;
+  std::thread::id committer;
+  int rendersAtCommit = 0;
+  bool update = true;
+private:
+  bool _parallelSafe;
+  bool _throws;
+};
+
+class ChainedComponent : public reactive::Component {
+public:
+  ChainedComponent(const reactive::Key key)
+  : reactive::Component(key, reactive::Props(), reactive::NodeList()) {}
+  virtual void render(bool) override {
+    int n = getState().count("n") ? getState()["n"].get<int>() : 0;
+    setRendered(n);
+    if (n < 5) setState({{"n", n + 1}});
+  }
+  virtual bool isParallelSafe() const override {return true;}
+};
+
+TEST_CASE("Render pool") {
+  reactive::RenderPool pool(4);
+  auto root = std::make_shared<RenderedComponent>("root", false);
+  std::vector<std::shared_ptr<RenderedComponent>> serial;
+  for (int i = 0; i < 64; ++i) {
+    auto row = std::make_shared<RenderedComponent>(i, true);
+    for (int j = 0; j < 4; ++j) row->addChild(std::make_shared<RenderedComponent>(j, true));
+    auto unsafe = std::make_shared<RenderedComponent>("unsafe", false);
+    row->addChild(unsafe);
+    serial.push_back(unsafe);
+    root->addChild(row);
+  }
+
+  SECTION("Rendering every component of the subtree") {
+    pool.render(*root);
+    REQUIRE(pool.getStats().rendered == 1 + 64 * 6);
+    for (auto &component : reactive::preOrder(*root)) {
+      REQUIRE(!component.getRendered().is_null());
+    }
+  }
+
+  SECTION("Keeping components that aren't parallel-safe on the calling thread") {
+    pool.render(*root);
+    REQUIRE(root->thread == std::this_thread::get_id());
+    for (auto &component : serial) {
+      REQUIRE(component->thread == std::this_thread::get_id());
+    }
+  }
+
+  SECTION("Committing on the calling thread once every render finished") {
+    RenderedComponent::renders() = 0;
+    pool.render(*root);
+    for (auto &component : reactive::preOrder(*root)) {
+      auto &rendered = dynamic_cast<RenderedComponent&>(component);
+      REQUIRE(rendered.committer == std::this_thread::get_id());
+      REQUIRE(rendered.rendersAtCommit == 1 + 64 * 6);
+    }
+  }
+
+  SECTION("Applying updates set off by renders after the commit") {
+    for (unsigned threads : {1u, 4u}) {
+      reactive::RenderPool chained(threads);
+      auto parent = std::make_shared<ChainedComponent>("parent");
+      for (int i = 0; i < 16; ++i) parent->addChild(std::make_shared<ChainedComponent>(i));
+      chained.render(*parent);
+      for (auto &component : reactive::preOrder(*parent)) {
+        REQUIRE(component.getState()["n"] == 5);
+        REQUIRE(component.getRendered() == 5);
+      }
+    }
+  }
+
+  SECTION("Skipping subtrees shouldComponentUpdate declines unless forced") {
+    auto declining = std::static_pointer_cast<RenderedComponent>(root->getChild(0));
+    declining->update = false;
+    pool.render(*root, false);
+    REQUIRE(pool.getStats().rendered == 1 + 63 * 6);
+    REQUIRE(pool.getStats().declined == 1);
+    REQUIRE(declining->getRendered().is_null());
+    REQUIRE(declining->getChild(0)->getRendered().is_null());
+    REQUIRE(!declining->hasPendingWork());
+
+    pool.render(*root);
+    REQUIRE(!declining->getChild(0)->getRendered().is_null());
+  }
+
+  SECTION("Rethrowing render errors after the pass") {
+    root->getChild(3)->addChild(std::make_shared<RenderedComponent>("bad", true, true));
+    REQUIRE_THROWS_AS(pool.render(*root), const std::runtime_error&);
+    REQUIRE(pool.getStats().rendered == 1 + 64 * 6);
+    for (auto &component : reactive::preOrder(*root)) { // nothing committed
+      REQUIRE(component.getRendered().is_null());
+      REQUIRE(!component.hasPendingWork());
+    }
+    root->getChild(3)->removeChild(reactive::Key("bad"));
+    pool.render(*root);
+    REQUIRE(pool.getStats().rendered == 2 * (1 + 64 * 6));
+  }
+}
+
+class PhasedComponent : public TestComponent {
+public:
+  PhasedComponent() : TestComponent("phased", reactive::Props(), reactive::NodeList()) {}
+  virtual void render(bool) override {
+    if (getState().count("fail")) throw std::runtime_error("render failed");
+    setRendered(getState());
+  }
+  virtual void componentDidUpdate(const reactive::Props&, const reactive::State&) override {
+    ++updates;
+  }
+  int updates = 0;
+};
+
+TEST_CASE("Render and commit phases") {
+  auto component = std::make_shared<PhasedComponent>();
+  component->setState({{"count", 1}});
+  auto version = component->getStateVersion();
+
+  SECTION("Rendering without touching the visible component") {
+    REQUIRE(component->prepareState({{"count", 2}}));
+    REQUIRE(component->hasPendingWork());
+    REQUIRE(component->getState()["count"] == 1);
+    REQUIRE(component->getRendered()["count"] == 1);
+    REQUIRE(component->getStateVersion() == version);
+    REQUIRE(component->updates == 1);
+
+    component->commitWork();
+    REQUIRE(!component->hasPendingWork());
+    REQUIRE(component->getState()["count"] == 2);
+    REQUIRE(component->getRendered()["count"] == 2);
+    REQUIRE(component->updates == 2);
+  }
+
+  SECTION("Abandoning work") {
+    component->prepareState({{"count", 2}});
+    component->abortWork();
+    component->commitWork();
+    REQUIRE(component->getState()["count"] == 1);
+    REQUIRE(component->getStateVersion() == version);
+  }
+
+  SECTION("Restarting work on top of the work in progress") {
+    component->prepareState({{"count", 2}});
+    component->prepareState({{"label", "x"}});
+    component->commitWork();
+    REQUIRE(component->getRendered() == reactive::JSON({{"count", 2}, {"label", "x"}}));
+    REQUIRE(component->updates == 2);
+  }
+
+  SECTION("Calling componentWillUpdate before render") {
+    LifecycleComponent lifecycle;
+    lifecycle.setState({{"count", 1}});
+    REQUIRE(lifecycle.calls == std::vector<std::string>({
+      "shouldComponentUpdate", "componentWillUpdate", "render", "componentDidUpdate"}));
+    lifecycle.calls.clear();
+    lifecycle.setState({{"skip", true}});
+    REQUIRE(lifecycle.calls == std::vector<std::string>({"shouldComponentUpdate"}));
+  }
+
+  SECTION("Leaving the visible state alone when render fails") {
+    REQUIRE_THROWS_AS(component->setState({{"fail", true}}), const std::runtime_error&);
+    REQUIRE(!component->hasPendingWork());
+    REQUIRE(component->getState() == reactive::JSON({{"count", 1}}));
+  }
+}
+
+class InterruptedComponent : public TestComponent {
+public:
+  InterruptedComponent(reactive::Scheduler &scheduler)
+  : TestComponent("interrupted", reactive::Props(), reactive::NodeList()), _scheduler(scheduler) {}
+  virtual void render(bool) override {
+    // Input arrives while the low-priority render is under way
+    if (getState().count("low") && !getState().count("input") && !_interrupted) {
+      _interrupted = true;
+      _scheduler.schedule(getParent()->getChild("interrupted"), {{"input", true}},
+                          reactive::Scheduler::Priority::UserBlocking);
+    }
+  }
+private:
+  reactive::Scheduler &_scheduler;
+  bool _interrupted = false;
+};
+
+TEST_CASE("Scheduler") {
+  typedef reactive::Scheduler::Priority Priority;
+  reactive::Scheduler scheduler;
+  auto component = createTestComponent();
+  auto observer = std::make_shared<RecordingObserver>();
+  component->addStateObserver(observer);
+
+  SECTION("Applying higher lanes first") {
+    scheduler.schedule(component, {{"low", 1}}, Priority::Low);
+    scheduler.schedule(component, {{"normal", 1}}, Priority::Normal);
+    scheduler.schedule(component, {{"input", 1}}, Priority::UserBlocking);
+    REQUIRE(scheduler.flush() == 3);
+    REQUIRE(observer->partialStates.size() == 3);
+    REQUIRE(observer->partialStates[0].count("input"));
+    REQUIRE(observer->partialStates[1].count("normal"));
+    REQUIRE(observer->partialStates[2].count("low"));
+  }
+
+  SECTION("Rebasing updates committed out of order") {
+    scheduler.schedule(component, {{"x", 1}, {"y", 1}}, Priority::Low);
+    scheduler.schedule(component, {{"x", 2}}, Priority::UserBlocking);
+    scheduler.flush();
+    REQUIRE(component->getState() == reactive::JSON({{"x", 2}, {"y", 1}}));
+  }
+
+  SECTION("Counting only updates that change state") {
+    scheduler.schedule(component, {{"x", 1}});
+    scheduler.schedule(component, {{"x", 1}});
+    REQUIRE(scheduler.flush() == 1);
+    REQUIRE(scheduler.getStats().committed == 1);
+    REQUIRE(component->getStateVersion() == 1);
+  }
+
+  SECTION("Deferring all but immediate updates past the budget") {
+    scheduler.schedule(component, {{"normal", 1}});
+    scheduler.schedule(component, {{"now", 1}}, Priority::Immediate);
+    REQUIRE(scheduler.run(reactive::Scheduler::Clock::duration::zero()) == 1);
+    REQUIRE(component->getState().count("now"));
+    REQUIRE(scheduler.pending(Priority::Normal) == 1);
+  }
+
+  SECTION("Expiring starved updates") {
+    scheduler.setTimeout(Priority::Low, reactive::Scheduler::Clock::duration::zero());
+    scheduler.schedule(component, {{"low", 1}}, Priority::Low);
+    scheduler.schedule(component, {{"input", 1}}, Priority::UserBlocking);
+    REQUIRE(scheduler.run(reactive::Scheduler::Clock::duration::zero()) == 1);
+    REQUIRE(component->getState().count("low"));
+    REQUIRE(scheduler.getStats().expired == 1);
+  }
+
+  SECTION("Interrupting low-priority renders for input") {
+    auto root = createTestComponent();
+    auto interrupted = std::make_shared<InterruptedComponent>(scheduler);
+    root->addChild(interrupted);
+    scheduler.schedule(interrupted, {{"low", 1}}, Priority::Low);
+    scheduler.flush();
+    REQUIRE(scheduler.getStats().interrupted == 1);
+    REQUIRE(interrupted->getState() == reactive::JSON({{"input", true}, {"low", 1}}));
+    REQUIRE(interrupted->getStateVersion() == 2);
+  }
+
+  SECTION("Dropping updates for destroyed components") {
+    auto doomed = createTestComponent();
+    scheduler.schedule(doomed, {{"x", 1}});
+    doomed.reset();
+    REQUIRE(scheduler.flush() == 0);
+    REQUIRE(scheduler.getStats().dropped == 1);
+  }
+
+  SECTION("Running idle work in frames with slack") {
+    std::vector<int> ran;
+    scheduler.requestIdleWork([&](const reactive::Scheduler::IdleDeadline &deadline) {
+      ran.push_back(1);
+      REQUIRE(!deadline.didTimeout());
+      REQUIRE(deadline.timeRemaining() > reactive::Scheduler::Clock::duration::zero());
+      // Requeued work waits for the next frame
+      scheduler.requestIdleWork([&](const reactive::Scheduler::IdleDeadline&) {ran.push_back(3);});
+    });
+    auto cancelled = scheduler.requestIdleWork([&](const reactive::Scheduler::IdleDeadline&) {
+      ran.push_back(2);
+    });
+    REQUIRE(scheduler.cancelIdleWork(cancelled));
+
+    auto frame = scheduler.runFrame(std::chrono::seconds(1));
+    REQUIRE(frame.idle == 1);
+    REQUIRE(ran == std::vector<int>({1}));
+    scheduler.runFrame(std::chrono::seconds(1));
+    REQUIRE(ran == std::vector<int>({1, 3}));
+  }
+
+  SECTION("Deferring idle work requested by this frame's updates") {
+    bool ran = false;
+    component->addStateObserver(std::make_shared<reactive::StateReplicator>(
+      [&](const reactive::JSON&) {
+        scheduler.requestIdleWork([&](const reactive::Scheduler::IdleDeadline&) {ran = true;});
+      }));
+    scheduler.schedule(component, {{"x", 1}});
+    auto frame = scheduler.runFrame(std::chrono::seconds(1));
+    REQUIRE(frame.committed == 1);
+    REQUIRE(frame.idle == 0);
+    REQUIRE(!ran);
+    REQUIRE(scheduler.runFrame(std::chrono::seconds(1)).idle == 1);
+    REQUIRE(ran);
+  }
+
+  SECTION("Keeping idle work out of busy frames") {
+    bool ran = false;
+    scheduler.requestIdleWork([&](const reactive::Scheduler::IdleDeadline&) {ran = true;});
+    scheduler.schedule(component, {{"x", 1}});
+    auto frame = scheduler.runFrame(reactive::Scheduler::Clock::duration::zero());
+    REQUIRE(frame.committed == 0);
+    REQUIRE(!ran);
+    REQUIRE(scheduler.pendingIdleWork() == 1);
+  }
+
+  SECTION("Running timed-out idle work without slack") {
+    bool timedOut = false;
+    scheduler.requestIdleWork([&](const reactive::Scheduler::IdleDeadline &deadline) {
+      timedOut = deadline.didTimeout();
+      REQUIRE(deadline.timeRemaining() == reactive::Scheduler::Clock::duration::zero());
+    }, reactive::Scheduler::Clock::duration::zero());
+    scheduler.schedule(component, {{"x", 1}});
+    REQUIRE(scheduler.runFrame(reactive::Scheduler::Clock::duration::zero()).idle == 1);
+    REQUIRE(timedOut);
+  }
+
+  SECTION("Passing timed-out idle work the frame's slack") {
+    bool timedOut = false;
+    auto remaining = reactive::Scheduler::Clock::duration::zero();
+    scheduler.requestIdleWork([&](const reactive::Scheduler::IdleDeadline &deadline) {
+      timedOut = deadline.didTimeout();
+      remaining = deadline.timeRemaining();
+    }, reactive::Scheduler::Clock::duration::zero());
+    REQUIRE(scheduler.runFrame(std::chrono::seconds(1)).idle == 1);
+    REQUIRE(timedOut);
+    REQUIRE(remaining > reactive::Scheduler::Clock::duration::zero());
+  }
+}
+
+class GuardedComponent : public PhasedComponent {
+public:
+  virtual bool shouldComponentUpdate(const reactive::Props&, const reactive::State&) override {
+    ++asked;
+    return true;
+  }
+  int asked = 0;
+};
+
+TEST_CASE("Stale updates") {
+  auto component = std::make_shared<GuardedComponent>();
+  auto observer = std::make_shared<RecordingObserver>();
+  component->addStateObserver(observer);
+
+  SECTION("Dropping responses to superseded requests") {
+    auto first = component->beginUpdate("search");
+    auto second = component->beginUpdate("search");
+    auto other = component->beginUpdate("profile");
+    REQUIRE(!component->isCurrent(first));
+    REQUIRE(component->isCurrent(second));
+    REQUIRE(component->isCurrent(reactive::UpdateToken()));
+
+    bool called = false;
+    REQUIRE(!component->setStateIfCurrent(first, {{"query", "a"}},
+                                          [&](const reactive::State&, const reactive::Props&) {
+                                            called = true;
+                                          }));
+    REQUIRE(!called);
+    REQUIRE(component->getStateVersion() == 0);
+    REQUIRE(component->setStateIfCurrent(second, {{"query", "ab"}}));
+    REQUIRE(component->setStateIfCurrent(other, {{"name", "x"}}));
+    REQUIRE(component->getState()["query"] == "ab");
+
+    component->cancelUpdates();
+    REQUIRE(!component->setStateIfCurrent(other, {{"name", "y"}}));
+    REQUIRE(component->getState()["name"] == "x");
+  }
+
+  SECTION("Dropping superseded scheduled updates") {
+    reactive::Scheduler scheduler;
+    auto stale = component->beginUpdate();
+    scheduler.schedule(component, {{"page", 1}}, reactive::Scheduler::Priority::Normal, stale);
+    auto current = component->beginUpdate();
+    scheduler.schedule(component, {{"page", 2}}, reactive::Scheduler::Priority::Normal, current);
+    REQUIRE(scheduler.flush() == 1);
+    REQUIRE(scheduler.getStats().superseded == 1);
+    REQUIRE(component->getState()["page"] == 2);
+    REQUIRE(observer->partialStates.size() == 1);
+  }
+
+  SECTION("Deduplicating identical updates") {
+    component->setState({{"x", 1}, {"y", 2}});
+    REQUIRE(component->asked == 1);
+    auto version = component->getStateVersion();
+
+    bool called = false;
+    component->setState({{"x", 1}}, [&](const reactive::State&, const reactive::Props&) {
+      called = true;
+    });
+    REQUIRE(called);
+    REQUIRE(component->asked == 1);
+    REQUIRE(component->updates == 1);
+    REQUIRE(component->getStateVersion() == version);
+    REQUIRE(observer->partialStates.size() == 1);
+
+    REQUIRE(!component->prepareState({{"x", 1}, {"y", 2}}));
+    REQUIRE(!component->hasPendingWork());
+
+    // Against the work in progress, not the visible state
+    REQUIRE(component->prepareState({{"x", 3}}));
+    REQUIRE(!component->prepareState({{"x", 3}}));
+    REQUIRE(component->asked == 2);
+    component->commitWork();
+    REQUIRE(component->getState()["x"] == 3);
+
+    // Any change, or an empty update, still renders
+    component->setState({{"x", 3}, {"y", 4}});
+    component->setState(reactive::State::object());
+    REQUIRE(component->asked == 4);
+  }
+
+  SECTION("Recycling supersedes outstanding requests") {
+    auto token = component->beginUpdate();
+    component->recycle("recycled", reactive::Props());
+    REQUIRE(!component->setStateIfCurrent(token, {{"x", 1}}));
+    REQUIRE(component->setStateIfCurrent(component->beginUpdate(), {{"x", 1}}));
+  }
+}
+
+class CascadeComponent : public TestComponent {
+public:
+  CascadeComponent(const reactive::Key key) : TestComponent(key, reactive::Props(), reactive::NodeList()) {}
+  virtual void render(bool) override {
+    ++renders;
+    maxDepth = std::max(maxDepth, ++depth);
+    if (onRender) onRender(*this);
+    --depth;
+  }
+  virtual void componentDidUpdate(const reactive::Props&, const reactive::State&) override {
+    maxDepth = std::max(maxDepth, ++depth);
+    if (onDidUpdate) onDidUpdate(*this);
+    --depth;
+  }
+  std::function<void(CascadeComponent&)> onRender;
+  std::function<void(CascadeComponent&)> onDidUpdate;
+  int renders = 0;
+  int depth = 0;
+  int maxDepth = 0;
+};
+
+static int countOf(const reactive::State &state, const std::string &key) {
+  return state.count(key) ? state[key].get<int>() : 0;
+}
+
+TEST_CASE("Nested updates") {
+  auto &queue = reactive::UpdateQueue::current();
+  auto stats = queue.getStats();
+  auto component = std::make_shared<CascadeComponent>("cascade");
+  auto other = std::make_shared<CascadeComponent>("other");
+
+  SECTION("Deferring setState from render until the commit") {
+    component->onRender = [](CascadeComponent &c) {
+      auto count = c.getState()["count"].get<int>();
+      if (count < 3) c.setState({{"count", count + 1}, {"seen", count}});
+    };
+    component->setState({{"count", 0}});
+    REQUIRE(component->getState()["count"] == 3);
+    REQUIRE(component->getState()["seen"] == 2);
+    REQUIRE(component->renders == 4);
+    REQUIRE(component->maxDepth == 1);
+    REQUIRE(queue.size() == 0);
+    REQUIRE(queue.getStats().deferred - stats.deferred == 3);
+    REQUIRE(queue.getStats().applied - stats.applied == 3);
+    REQUIRE(queue.getStats().longestCascade >= 3);
+  }
+
+  SECTION("Dropping deferred updates whose token was superseded meanwhile") {
+    auto token = other->beginUpdate();
+    component->onRender = [&](CascadeComponent&) {
+      if (other->getState().count("v")) return;
+      REQUIRE(other->setStateIfCurrent(token, {{"v", "stale"}}));
+      other->beginUpdate();
+    };
+    component->setState({{"count", 0}});
+    REQUIRE(!other->getState().count("v"));
+    REQUIRE(queue.getStats().superseded - stats.superseded == 1);
+  }
+
+  SECTION("Cascading from componentDidUpdate to another component") {
+    component->onDidUpdate = [&](CascadeComponent &c) {
+      other->setState({{"mirror", c.getState()["value"]}});
+      REQUIRE(countOf(other->getState(), "mirror") != countOf(c.getState(), "value"));
+      other->setState([](const reactive::State &state, const reactive::Props&) {
+        return reactive::State{{"updates", countOf(state, "updates") + 1}};
+      });
+    };
+    other->onDidUpdate = [](CascadeComponent &c) {
+      // The updater runs against committed state
+      REQUIRE(c.getState().count("mirror"));
+    };
+    component->setState({{"value", 1}});
+    component->setState({{"value", 2}});
+    REQUIRE(other->getState()["mirror"] == 2);
+    REQUIRE(other->getState()["updates"] == 2);
+    REQUIRE(other->maxDepth == 1);
+  }
+
+  SECTION("Stopping runaway cascades") {
+    queue.setCascadeLimit(10);
+    component->onDidUpdate = [](CascadeComponent &c) {
+      c.setState({{"n", countOf(c.getState(), "n") + 1}});
+    };
+    REQUIRE_THROWS_AS(component->setState({{"n", 0}}), const std::runtime_error&);
+    queue.setCascadeLimit(reactive::UpdateQueue::kDefaultCascadeLimit);
+    REQUIRE(component->getState()["n"] == 10);
+    REQUIRE(queue.size() == 0);
+    REQUIRE(queue.getStats().aborted - stats.aborted == 1);
+
+    component->onDidUpdate = nullptr;
+    component->setState({{"n", 0}});
+    REQUIRE(component->getState()["n"] == 0);
+  }
+
+  SECTION("Discarding updates from failed and aborted work") {
+    component->onRender = [&](CascadeComponent &c) {
+      other->setState({{"x", 1}});
+      if (c.getState().count("fail")) throw std::runtime_error("render failed");
+    };
+    REQUIRE_THROWS_AS(component->setState({{"fail", true}}), const std::runtime_error&);
+    REQUIRE(queue.size() == 0);
+
+    component->prepareState({{"y", 1}});
+    REQUIRE(queue.size() == 1);
+    component->abortWork();
+    REQUIRE(queue.size() == 0);
+    REQUIRE(!other->getState().count("x"));
+
+    component->prepareState({{"y", 2}});
+    component->commitWork();
+    REQUIRE(other->getState()["x"] == 1);
+  }
+
+  SECTION("Dropping updates for destroyed components") {
+    component->onDidUpdate = [&](CascadeComponent&) {
+      other->setState({{"x", 1}});
+      other.reset();
+    };
+    component->setState({{"y", 1}});
+    REQUIRE(!other);
+    REQUIRE(queue.size() == 0);
+  }
+
+  SECTION("Dropping updates for components removed to a background disposal queue") {
+    std::atomic<int> destroyed(0);
+    auto disposal = std::make_shared<reactive::DisposalQueue>(
+      reactive::DisposalQueue::Mode::Background);
+    component->setDisposalQueue(disposal);
+    component->addChild(std::make_shared<CountedComponent>("child", destroyed));
+    component->onDidUpdate = [&](CascadeComponent &c) {
+      c.getChildren()[0]->setState({{"x", 1}});
+      c.removeChild("child");
+      for (int i = 0; i < 1000 && destroyed == 0; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+    };
+    component->setState({{"y", 1}});
+    REQUIRE(destroyed == 1);
+    REQUIRE(queue.size() == 0);
+    REQUIRE(queue.getStats().applied == stats.applied);
+  }
+}
+
+TEST_CASE("Animator") {
+  typedef reactive::Animator::Clock Clock;
+  reactive::Animator animator(std::chrono::milliseconds(10));
+  auto component = createTestComponent();
+  auto start = Clock::now();
+
+  SECTION("Interpolating numeric fields") {
+    animator.animate(component, "x", 10, std::chrono::seconds(1),
+                     reactive::Animator::Easing::Linear, start);
+    animator.animate(component, "y", 10, std::chrono::seconds(1),
+                     reactive::Animator::Easing::EaseInOut, start);
+    animator.tick(start + std::chrono::milliseconds(250));
+    REQUIRE(component->getState()["x"].get<double>() == Approx(2.5));
+    REQUIRE(component->getState()["y"].get<double>() == Approx(1.5625));
+
+    animator.tick(start + std::chrono::seconds(2));
+    REQUIRE(component->getState()["x"].get<double>() == Approx(10));
+    REQUIRE(animator.active() == 0);
+  }
+
+  SECTION("Coalescing fields into one update per component") {
+    auto other = createTestComponent();
+    for (auto field : {"x", "y", "z"}) {
+      animator.animate(component, field, 1, std::chrono::seconds(1),
+                       reactive::Animator::Easing::Linear, start);
+    }
+    animator.animate(other, "x", 1, std::chrono::seconds(1),
+                     reactive::Animator::Easing::Linear, start);
+    auto version = component->getStateVersion();
+    REQUIRE(animator.tick(start + std::chrono::milliseconds(500)) == 2);
+    REQUIRE(component->getStateVersion() == version + 1);
+    REQUIRE(animator.getStats().updates == 2);
+  }
+
+  SECTION("Retargeting from the current value") {
+    component->setState({{"x", 4}});
+    animator.animate(component, "x", 8, std::chrono::seconds(1),
+                     reactive::Animator::Easing::Linear, start);
+    animator.tick(start + std::chrono::milliseconds(500));
+    REQUIRE(component->getState()["x"].get<double>() == Approx(6));
+    animator.animate(component, "x", 0, std::chrono::seconds(1),
+                     reactive::Animator::Easing::Linear, start + std::chrono::milliseconds(500));
+    REQUIRE(animator.active() == 1);
+    animator.tick(start + std::chrono::seconds(1));
+    REQUIRE(component->getState()["x"].get<double>() == Approx(3));
+  }
+
+  SECTION("Counting dropped frames") {
+    animator.tick(start);
+    animator.tick(start + std::chrono::milliseconds(10));
+    animator.tick(start + std::chrono::milliseconds(50));
+    auto stats = animator.getStats();
+    REQUIRE(stats.frames == 3);
+    REQUIRE(stats.droppedFrames == 3);
+    REQUIRE(stats.worstFrameTime == std::chrono::milliseconds(40));
+  }
+
+  SECTION("Forgetting destroyed components") {
+    auto doomed = createTestComponent();
+    animator.animate(doomed, "x", 1, std::chrono::seconds(1),
+                     reactive::Animator::Easing::Linear, start);
+    doomed.reset();
+    REQUIRE(animator.tick(start + std::chrono::milliseconds(500)) == 0);
+    REQUIRE(animator.active() == 0);
+  }
+}
+
+#ifdef JGOD_REACTIVE_COROUTINES
+reactive::Task fetchLabel(reactive::SharedComponent component,
+                          reactive::Deferred<std::string> response,
+                          std::vector<std::string> &log) {
+  auto label = co_await response;
+  component->setState({{"label", label}});
+  log.push_back("set " + label);
+}
+
+reactive::Task awaitCommit(reactive::SharedComponent component, std::vector<std::string> &log) {
+  auto state = co_await component->nextCommit();
+  log.push_back("committed " + std::to_string((*state)["count"].get<int>()));
+}
+
+// Records the thread that destroys it, e.g. along with a cancelled task's frame.
+class DestroyedOn {
+public:
+  explicit DestroyedOn(std::thread::id &id) : _id(id) {}
+  ~DestroyedOn() {_id = std::this_thread::get_id();}
+private:
+  std::thread::id &_id;
+};
+
+reactive::Task awaitResponse(reactive::Deferred<std::string> response, std::thread::id &destroyedOn) {
+  DestroyedOn frame(destroyedOn);
+  co_await response;
+}
+
+TEST_CASE("Coroutines") {
+  auto component = createTestComponent();
+  std::vector<std::string> log;
+
+  SECTION("Awaiting data sources") {
+    reactive::Deferred<std::string> response;
+    component->spawn(fetchLabel(component, response, log));
+    REQUIRE(component->runningTasks() == 1);
+    response.resolve("ready");
+    REQUIRE(component->getState()["label"] == "ready");
+    REQUIRE(component->runningTasks() == 0);
+  }
+
+  SECTION("Awaiting commits") {
+    component->spawn(awaitCommit(component, log));
+    REQUIRE(log.empty());
+    component->setState({{"count", 1}});
+    REQUIRE(log == std::vector<std::string>({"committed 1"}));
+  }
+
+  SECTION("Cancelling superseded tasks") {
+    reactive::Deferred<std::string> first, second;
+    component->spawn(fetchLabel(component, first, log), "fetch");
+    component->spawn(fetchLabel(component, second, log), "fetch");
+    first.resolve("stale");
+    second.resolve("fresh");
+    REQUIRE(log == std::vector<std::string>({"set fresh"}));
+  }
+
+  SECTION("Cancelling tasks of removed components") {
+    auto root = createTestComponent();
+    auto child = std::make_shared<TestComponent>("child", reactive::Props(), reactive::NodeList());
+    root->addChild(child);
+    reactive::Deferred<std::string> response;
+    child->spawn(fetchLabel(child, response, log));
+    root->removeChild(child);
+    REQUIRE(child->runningTasks() == 0);
+    response.resolve("late");
+    REQUIRE(log.empty());
+  }
+
+  SECTION("Cancelling tasks of descendants before background disposal") {
+    auto root = createTestComponent();
+    root->setDisposalQueue(std::make_shared<reactive::DisposalQueue>(
+      reactive::DisposalQueue::Mode::Background));
+    auto child = std::make_shared<TestComponent>("child", reactive::Props(), reactive::NodeList());
+    auto grandchild = std::make_shared<TestComponent>("grandchild", reactive::Props(),
+                                                      reactive::NodeList());
+    child->addChild(grandchild);
+    root->addChild(child);
+    reactive::Deferred<std::string> response;
+    std::thread::id destroyedOn;
+    grandchild->spawn(awaitResponse(response, destroyedOn));
+    grandchild.reset();
+    child.reset();
+    root->removeChild("child");
+    REQUIRE(destroyedOn == std::this_thread::get_id());
+    response.resolve("late");
+  }
+
+  SECTION("Rethrowing rejections into the task") {
+    reactive::Deferred<std::string> response;
+    component->spawn(fetchLabel(component, response, log));
+    REQUIRE_THROWS_AS(response.reject(std::make_exception_ptr(std::runtime_error("offline"))),
+                      const std::runtime_error&);
+    REQUIRE(component->runningTasks() == 0);
+  }
 }
+#endif